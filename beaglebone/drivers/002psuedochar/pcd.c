@@ -4,7 +4,8 @@
 #include<linux/device.h>
 #include<linux/kdev_t.h>
 #include<linux/err.h>
-#include<linux/uaccess.h>
+
+#include "pcd_core.h"
 
 #define DEVICE_MEM_SIZE 512
 #undef pr_fmt
@@ -16,105 +17,12 @@ char device_buffer[DEVICE_MEM_SIZE];
 /* This holds the device number */
 dev_t device_num;
 
-/* Device structure for character device */
-struct cdev pcd_dev;
+/* Device structure for character device, read/write/lseek are done by
+the pcd core on device_buffer */
+struct pcd_core_dev pcd_dev;
 struct class* class_pcd;
 struct device* device_pcd;
 
-loff_t pcd_lseek(struct file *filep, loff_t off, int whence){
-	loff_t tmp;
-	pr_info("lseek requested\n");
-	pr_info("Current file position = %lld\n", filep->f_pos);
-	
-	switch(whence){
-		case SEEK_SET:
-			if( (off > DEVICE_MEM_SIZE) || (off < 0) )
-				return -EINVAL;
-			filep->f_pos = off;
-			break;
-		case SEEK_CUR:
-			tmp = filep->f_pos + off;
-			if( (tmp > DEVICE_MEM_SIZE) || (tmp<0))
-				return -EINVAL;
-			filep->f_pos = tmp;
-			break;
-		case SEEK_END:
-		deafult:
-			return -EINVAL;
-	};
-			
-	pr_info("Current file position after lseek = %lld\n", filep->f_pos);
-	return 0;
-}
-        
-ssize_t pcd_read(struct file *filep, char __user *buffer, size_t count, loff_t *f_pos){
-	pr_info("Read requested for %zu bytes\n", count);
-	pr_info("Initial file position = %lld\n", *f_pos);
-	
-	/* Adjust the count */
-	if((*f_pos + count) > DEVICE_MEM_SIZE)
-		count = DEVICE_MEM_SIZE - *f_pos;
-
-	/* Copy to user */
-	if(copy_to_user(buffer, &device_buffer[*f_pos], count)){
-		return -EFAULT;
-	}
-	
-	/* Uodate the current file position */
-	*f_pos += count;
-	
-	pr_info("Number of bytes successfully read is %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
-	
-	/* Return numbe rof bytes successfully read */
-	return count;
-}
-
-ssize_t pcd_write(struct file *filep, const char __user *buffer, size_t count, loff_t *f_pos){
-	pr_info("Write requested for %zu bytes\n", count);
-	pr_info("Initial file position = %lld\n", *f_pos); 
-
-	if((*f_pos + count) > DEVICE_MEM_SIZE || (count < 0)){
-		count = DEVICE_MEM_SIZE - *f_pos;
-	}
-
-	if(!count){
-		pr_warning("No space remaining on device to write new bytes\n");
-		return -ENOMEM;
-	}
-	
-	if(copy_from_user(&device_buffer[*f_pos], buffer, count)){
-		return -EFAULT;
-	}
-	*f_pos += count;
-
-	pr_info("Number of bytes successfully written = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
-
-	return count;
-}
-
-int pcd_open(struct inode *p_inode, struct file *filep){
-	pr_info("Open was successful\n");
-	return 0;
-}
-
-int pcd_release(struct inode *p_inode, struct file *filep){
-	pr_info("Close was successful\n");
-	return 0;
-}
-
-
-/* struct to hold the file operations of the driver */
-struct file_operations pcd_fops = {
-	.open = pcd_open,
-	.write = pcd_write,
-	.read = pcd_read,
-	.llseek = pcd_lseek,
-	.release = pcd_release,
-	.owner = THIS_MODULE
-};
-
 static int __init pcd_driver_init(void){
 	int ret;
 
@@ -127,12 +35,9 @@ static int __init pcd_driver_init(void){
 
 	pr_info("Device number <major>:<minor> = %d:%d\n", MAJOR(device_num), MINOR(device_num));
 	
-	/* Initialize character device with the device structure and fops structure */
-	cdev_init(&pcd_dev, &pcd_fops);
-	pcd_dev.owner = THIS_MODULE;
-
-	/* Register device (cdev structure) with the VFS */
-	ret = cdev_add(&pcd_dev, device_num, 1);
+	/* Initialize the device with the array backend and register it with the VFS */
+	pcd_core_init(&pcd_dev, &pcd_core_array_ops, device_buffer, DEVICE_MEM_SIZE, RDWR);
+	ret = pcd_core_add(&pcd_dev, &pcd_core_fops, THIS_MODULE, device_num);
 	if(ret < 0){
 		pr_warn("Device addition failed\n");
 		goto unreg_chrdev;
@@ -162,7 +67,7 @@ class_del:
 	class_destroy(class_pcd);
 
 cdev_del:
-	cdev_del(&pcd_dev);
+	pcd_core_del(&pcd_dev);
 
 unreg_chrdev:
 	unregister_chrdev_region(device_num, 1);
@@ -174,7 +79,7 @@ out:
 static void __exit pcd_driver_exit(void){
 	device_destroy(class_pcd, device_num);
 	class_destroy(class_pcd);
-	cdev_del(&pcd_dev);
+	pcd_core_del(&pcd_dev);
 	unregister_chrdev_region(device_num, 1);
 	pr_info("%s module unloaded\n", THIS_MODULE->name);
 }			
@@ -4,7 +4,7 @@
 #include<linux/device.h>
 #include<linux/kdev_t.h>
 #include<linux/err.h>
-#include<linux/uaccess.h>
+#include "pcd_core.h"
 
 #undef pr_fmt
 #define pr_fmt(fmt) "%s:" fmt, __func__
@@ -27,7 +27,7 @@ struct pcdev_private_data{
 	unsigned int size;
 	const char* serial_number;
 	unsigned short int perm;
-	struct cdev cdev;
+	struct pcd_core_dev core;	/* read/write/lseek on buffer */
 };
 
 /* Driver private data structure */
@@ -39,10 +39,6 @@ struct pcdrv_private_data{
 	struct pcdev_private_data pcdev_data[NUMBER_OF_DEVICES];
 };
 
-#define RDONLY 0x01
-#define WRONLY 0x10
-#define RDWR 0x11
-
 struct pcdrv_private_data pcdrv_data = {
 	.total_devices = NUMBER_OF_DEVICES,
 	.pcdev_data = {
@@ -73,142 +69,6 @@ struct pcdrv_private_data pcdrv_data = {
 	}
 };
 
-loff_t pcd_lseek(struct file *filep, loff_t off, int whence){
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data *)filep->private_data;
-	
-	int max_data = pcdev_data -> size;off_t tmp;
-	pr_info("lseek requested\n");
-	pr_info("Current file position = %lld\n", filep->f_pos);
-	
-	switch(whence){
-		case SEEK_SET:
-			if( (off > max_data) || (off < 0) )
-				return -EINVAL;
-			filep->f_pos = off;
-			break;
-		case SEEK_CUR:
-			tmp = filep->f_pos + off;
-			if( (tmp > max_data) || (tmp<0))
-				return -EINVAL;
-			filep->f_pos = tmp;
-			break;
-		case SEEK_END:
-		default:
-			return -EINVAL;
-	};
-			
-	pr_info("Current file position after lseek = %lld\n", filep->f_pos);
-	return 0;
-}
-
-ssize_t pcd_read(struct file *filep, char __user *buffer, size_t count, loff_t *f_pos){
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data *)filep->private_data;
-	
-	int max_data = pcdev_data -> size;
-	pr_info("Read requested for %zu bytes\n", count);
-	pr_info("Initial file position = %lld\n", *f_pos);
-	
-	/* Adjust the count */
-	if((*f_pos + count) > max_data)
-		count = max_data - *f_pos;
-
-	/* Copy to user */
-	if(copy_to_user(buffer, &pcdev_data->buffer[*f_pos], count)){
-		return -EFAULT;
-	}
-	
-	/* Uodate the current file position */
-	*f_pos += count;
-	
-	pr_info("Number of bytes successfully read is %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
-	
-	/* Return numbe rof bytes successfully read */
-	return count;
-}
-
-ssize_t pcd_write(struct file *filep, const char __user *buffer, size_t count, loff_t *f_pos){
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data *)filep->private_data;
-	
-	int max_data = pcdev_data -> size;
-	
-	pr_info("Write requested for %zu bytes\n", count);
-	pr_info("Initial file position = %lld\n", *f_pos); 
-
-	if((*f_pos + count) > max_data || (count < 0)){
-		count = max_data - *f_pos;
-	}
-
-	if(!count){
-		pr_warning("No space remaining on device to write new bytes\n");
-		return -ENOMEM;
-	}
-	
-	if(copy_from_user(&pcdev_data->buffer[*f_pos], buffer, count)){
-		return -EFAULT;
-	}
-	*f_pos += count;
-
-	pr_info("Number of bytes successfully written = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
-
-	return count;
-}
-
-int check_permission(int perm, int mode){
-	if(perm == RDWR){
-		return 0;
-	}
-	else if(perm == RDONLY){
-		if((mode & FMODE_READ) && !(mode & FMODE_WRITE)){
-			return 0;
-		}
-	}
-	else if(perm == WRONLY){
-		if(!(mode & FMODE_READ) && (mode & FMODE_WRITE)){
-			return 0;
-		}
-	}
-	return -EPERM;
-}
-
-int pcd_open(struct inode *p_inode, struct file *filep){
-	int ret, minor_n;
-	struct pcdev_private_data* pcdev_data;
-
-	/* Find out which device file open was attempted by the uer space */
-	minor_n = MINOR(p_inode->i_rdev);
-	pr_info("Minore access = %d\n", minor_n);
-	
-	/* Get device's private data structure */
-	pcdev_data = container_of(p_inode->i_cdev, struct pcdev_private_data, cdev);
-
-	/* To supply device private data to other methods of the driver */
-	filep->private_data = pcdev_data;
-
-	pr_info("permission is %x\n", pcdev_data->perm);
-	/* check permissions */
-	ret = check_permission(pcdev_data->perm, filep->f_mode);
-
-	(!ret) ? pr_info("Open was successful\n") : pr_info("Open was unsuccessfull\n");
-	
-	return ret;
-}
-
-int pcd_release(struct inode *p_inode, struct file *filep){
-	pr_info("Close was successful\n");
-	return 0;
-}
-
-/* struct to hold the file operations of the driver */
-struct file_operations pcd_fops = {
-	.open = pcd_open,
-	.write = pcd_write,
-	.read = pcd_read,
-	.release = pcd_release,
-	.llseek = pcd_lseek,
-};
-
 static int __init pcd_driver_init(void){
 	int ret, i;
 
@@ -230,12 +90,10 @@ static int __init pcd_driver_init(void){
 	for(i=0; i<NUMBER_OF_DEVICES; i++){
 		pr_info("Device number <major>:<minor> = %d:%d\n", MAJOR(pcdrv_data.device_num+i), MINOR(pcdrv_data.device_num+i));
 	
-		/* Initialize character device with the device structure and fops structure */
-		cdev_init(&pcdrv_data.pcdev_data[i].cdev, &pcd_fops);
-		pcdrv_data.pcdev_data[i].cdev.owner = THIS_MODULE;
-
-		/* Register device (cdev structure) with the VFS */
-		ret = cdev_add(&pcdrv_data.pcdev_data[i].cdev, pcdrv_data.device_num+i, NUMBER_OF_DEVICES);
+		/* Initialize the device with the array backend and register it with the VFS */
+		pcd_core_init(&pcdrv_data.pcdev_data[i].core, &pcd_core_array_ops, pcdrv_data.pcdev_data[i].buffer,
+				pcdrv_data.pcdev_data[i].size, pcdrv_data.pcdev_data[i].perm);
+		ret = pcd_core_add(&pcdrv_data.pcdev_data[i].core, &pcd_core_fops, THIS_MODULE, pcdrv_data.device_num+i);
 		if(ret < 0){
 			pr_warn("Device addition failed\n");
 			goto class_del;
@@ -254,14 +112,14 @@ static int __init pcd_driver_init(void){
 
 	
 cdev_del:
-	cdev_del(&pcdrv_data.pcdev_data[i].cdev);
+	pcd_core_del(&pcdrv_data.pcdev_data[i].core);
 
 class_del:
 	if(i>0){
 		for(i=i-1; i>=0; i--){
 			pr_info("Destroying device %d\n", i);
 			device_destroy(pcdrv_data.class_pcd, pcdrv_data.device_num+i);
-			cdev_del(&pcdrv_data.pcdev_data[i].cdev);
+			pcd_core_del(&pcdrv_data.pcdev_data[i].core);
 		}
 	}
 	class_destroy(pcdrv_data.class_pcd);
@@ -278,7 +136,7 @@ static void __exit pcd_driver_exit(void){
 	int i;
 	for(i=0; i<NUMBER_OF_DEVICES; i++){
 		device_destroy(pcdrv_data.class_pcd, pcdrv_data.device_num+i);	
-		cdev_del(&pcdrv_data.pcdev_data[i].cdev);
+		pcd_core_del(&pcdrv_data.pcdev_data[i].core);
 	}	
 		class_destroy(pcdrv_data.class_pcd);
 		unregister_chrdev_region(pcdrv_data.device_num, NUMBER_OF_DEVICES);
@@ -5,30 +5,35 @@
 /* Function declarations */
 void pcdev_release(struct device*);
 
-// 1. Create two platform data
+// 1. Create nine platform data
 
-struct pcdev_platform_data pcdev_pdata[2] = {
+struct pcdev_platform_data pcdev_pdata[9] = {
 	[0] = {.size = 512, .perm = RDWR, .serial_number = "PCDEVABC1111"},
-	[1] = {.size = 1024, .perm = RDWR, .serial_number = "PCDEXYZ2222"}
+	[1] = {.size = 1024, .perm = RDWR, .serial_number = "PCDEXYZ2222"},
+	[2] = {.size = 4096, .perm = RDWR, .serial_number = "PCDEFIFO3333", .mode = PCD_MODE_FIFO},
+	[3] = {.size = 65536, .perm = RDWR, .serial_number = "PCDESPSC4444", .mode = PCD_MODE_SPSC},
+	[4] = {.size = 4194304, .perm = RDWR, .serial_number = "PCDEZIP5555", .compress = 1},
+	[5] = {.size = 1024, .perm = RDWR, .serial_number = "PCDECRC6666", .integrity = 1},
+	[6] = {.size = 65536, .perm = RDWR, .serial_number = "PCDESHARD7777", .mode = PCD_MODE_SHARD},
+	[7] = {.size = 65536, .perm = RDWR, .serial_number = "PCDELOG8888", .mode = PCD_MODE_LOG},
+	[8] = {.size = 65536, .perm = RDWR, .serial_number = "PCDEKV9999", .mode = PCD_MODE_KV}
 };
 
 
-// 2. Create two platform devices
+// 2. Create nine platform devices, device n uses platform data n
 
-struct platform_device platform_pcdev_1 = {
-	.name = "pseudo-char-device",
-	.id = 0,
-	.dev = { .platform_data = &pcdev_pdata[0], 
-		.release = pcdev_release
-	}
-};
+#define PCDEV(n) [n] = { \
+	.name = "pseudo-char-device", \
+	.id = n, \
+	.dev = { \
+		.platform_data = &pcdev_pdata[n], \
+		.release = pcdev_release \
+	} \
+}
 
-struct platform_device platform_pcdev_2 = {
-	.name = "pseudo-char-device",
-	.id = 1,
-	.dev = { .platform_data = &pcdev_pdata[1],
-		.release = pcdev_release
-	 }
+struct platform_device platform_pcdevs[ARRAY_SIZE(pcdev_pdata)] = {
+	PCDEV(0), PCDEV(1), PCDEV(2), PCDEV(3), PCDEV(4),
+	PCDEV(5), PCDEV(6), PCDEV(7), PCDEV(8)
 };
 
 void pcdev_release(struct device* dev){
@@ -37,17 +42,31 @@ void pcdev_release(struct device* dev){
 
 static int __init pcdev_platform_init(void)
 {
-	// register platform device
-	platform_device_register(&platform_pcdev_1);
-	platform_device_register(&platform_pcdev_2);
-	
+	int i, ret;
+
+	// register platform devices, on failure the ones already registered go again
+	for(i = 0; i < ARRAY_SIZE(platform_pcdevs); i++){
+		ret = platform_device_register(&platform_pcdevs[i]);
+		if(ret){
+			pr_err("pcdev-%d registration failed %d\n", i, ret);
+			goto unregister;
+		}
+	}
+
 	pr_info("Device setup module inserted\n");
 	return 0;
+
+unregister:
+	while(--i >= 0)
+		platform_device_unregister(&platform_pcdevs[i]);
+	return ret;
 }
 
 static void __exit pcdev_platform_exit(void){
-	platform_device_unregister(&platform_pcdev_1);
-        platform_device_unregister(&platform_pcdev_2);
+	int i;
+
+	for(i = ARRAY_SIZE(platform_pcdevs) - 1; i >= 0; i--)
+		platform_device_unregister(&platform_pcdevs[i]);
 
 	pr_info("Device setup moodule released\n");
 }
@@ -4,206 +4,4139 @@
 #include<linux/device.h>
 #include<linux/kdev_t.h>
 #include<linux/platform_device.h>
+#include<linux/of.h>
+#include<linux/idr.h>
 #include<linux/err.h>
 #include<linux/slab.h>
+#include<linux/mm.h>
+#include<linux/highmem.h>
+#include<linux/sizes.h>
+#include<linux/mutex.h>
+#include<linux/rwsem.h>
+#include<linux/wait.h>
+#include<linux/poll.h>
+#include<linux/uio.h>
+#include<linux/percpu.h>
+#include<linux/u64_stats_sync.h>
+#include<linux/ktime.h>
+#include<linux/math64.h>
+#include<linux/debugfs.h>
+#include<linux/seq_file.h>
+#include<linux/compat.h>
+#include<linux/list.h>
+#include<linux/vmalloc.h>
+#include<linux/scatterlist.h>
+#include<linux/dma-mapping.h>
+#include<linux/dma-buf.h>
+#include<linux/bitmap.h>
+#include<linux/workqueue.h>
+#include<linux/anon_inodes.h>
+#include<linux/kref.h>
+#include<linux/file.h>
+#include<linux/bvec.h>
+#include<linux/jhash.h>
+#include<linux/random.h>
+#include<linux/crypto.h>
+#include<crypto/hash.h>
 #include<linux/uaccess.h>
+#include "pcd_core.h"
 #include "platform.h"
+#include "pcd_ioctl.h"
 
 #undef pr_fmt
 #define pr_fmt(fmt) "%s:" fmt, __func__
 
-#define MAX_DEVICES 4
+#include "pcd_trace.h"
+
+/* Number of minors reserved for the driver. Minors are handed out by an
+IDA, so probing doesn't get slower as the number of devices grows */
+#define MAX_DEVICES 1024
+
+/* Largest buffer a device can have, the buffer is made of single pages
+so this is only a sanity limit and not an allocator one */
+#define PCD_MAX_SIZE SZ_256M
+
+/* Ring state of a device in PCD_MODE_FIFO */
+struct pcd_fifo{
+	struct mutex lock;
+	size_t head;	/* next byte to be written */
+	size_t tail;	/* next byte to be read */
+	size_t fill;	/* number of bytes stored */
+	wait_queue_head_t readq;	/* readers waiting for data */
+	wait_queue_head_t writeq;	/* writers waiting for space */
+};
+
+/* Where a record of a PCD_MODE_LOG device is in the ring */
+struct pcd_log_slot{
+	u32 off;
+	u32 reclen;	/* header, data and padding */
+};
+
+/* Ring state of a device in PCD_MODE_LOG. The records are kept in the
+page array the way read() returns them. Every record has a slot in the
+index at seq % nr_slots, a ring never holds more than nr_slots records
+so the live ones never share a slot and a seek by sequence number is one
+lookup */
+struct pcd_log{
+	u64 first_seq;	/* oldest record kept */
+	u64 next_seq;	/* sequence number of the next write */
+	size_t head;
+	size_t fill;
+	struct pcd_log_slot *index;
+	u32 nr_slots;
+};
+
+/* Slot of the hash table of a device in PCD_MODE_KV */
+struct pcd_kv_slot{
+	u32 hash;	/* 0 for a free slot */
+	u32 off;	/* of the key in the buffer, the value follows it */
+	u32 key_len;
+	u32 val_len;
+};
+
+/* Key-value store of a device in PCD_MODE_KV, kept in the device buffer.
+The buffer starts with an open addressing table of nr_slots slots, the
+keys and values follow in a heap that is appended to and compacted when
+it runs full. Protected by core.lock */
+struct pcd_kv_store{
+	void *base;	/* the whole buffer, mapped in one piece */
+	struct pcd_kv_slot *slots;	/* at base */
+	u32 nr_slots;	/* a power of two */
+	u32 count;	/* keys stored */
+	u32 seed;
+	size_t heap;	/* offset of the heap */
+	size_t end;	/* first heap byte not handed out */
+	size_t live;	/* heap bytes of the keys stored, the rest is garbage */
+};
+
+/* One CPU's part of a device in PCD_MODE_SHARD, a ring of records laid
+out as read() returns them. Writers running on the CPU append under the
+lock, the reader looks at the oldest record without it */
+struct pcd_shard{
+	struct mutex lock;	/* writers, and the reader when it consumes */
+	size_t head;	/* where the next record goes */
+	size_t tail;	/* oldest record, only moved by the reader */
+	size_t fill;	/* bytes of records stored, published with release */
+	struct pcd_shard_rec next;	/* header at tail if have_next, reader only */
+	bool have_next;
+	char data[];
+} ____cacheline_aligned_in_smp;
+
+/* Latency histogram buckets, bucket n counts operations that took
+less than 2^n ns */
+#define PCD_LAT_BUCKETS 32
+
+enum{
+	PCD_STAT_READ,
+	PCD_STAT_WRITE,
+	PCD_STAT_DIRS
+};
+
+/* Usage counters of a device. Everything is a u64 so that the per CPU
+copies can be summed up as plain arrays */
+struct pcd_counters{
+	u64 bytes[PCD_STAT_DIRS];
+	u64 ops[PCD_STAT_DIRS];
+	u64 short_ops[PCD_STAT_DIRS];
+	u64 err_nomem;
+	u64 err_fault;
+	u64 err_perm;
+	u64 err_integrity;
+	u64 opens;
+	u64 releases;
+	u64 lat_hist[PCD_STAT_DIRS][PCD_LAT_BUCKETS];
+};
+
+#define PCD_NR_COUNTERS (sizeof(struct pcd_counters) / sizeof(u64))
+
+/* Per CPU copy of the counters, only ever written by its own CPU */
+struct pcd_stats{
+	struct pcd_counters cnt;
+	struct u64_stats_sync syncp;
+};
 
 /* Device private data structure */
 struct pcdev_private_data{
 	struct pcdev_platform_data pdata;
-	char* buffer;
-	dev_t dev_num;
-	struct cdev cdev;
+	struct page **pages;	/* device buffer, PAGE_SIZE bytes per entry */
+	struct pcd_zstore *zs;	/* compressed buffer instead of pages, NULL if not compressed */
+	u32 *crcs;	/* CRC32C of every present page, NULL if not in integrity mode */
+	struct crypto_shash *crc_tfm;
+	unsigned long nr_pages;
+	struct kref ref;	/* the platform device, open files, dma-bufs and snapshots */
+	atomic_t map_count;	/* number of vmas and dma-bufs sharing the pages */
+	atomic_t snapshots;	/* live snapshots, pages they share are copied before a write */
+	int id;		/* minor offset, the N of pcdev-N */
+	u64 probe_ns;	/* time pcd_platform_driver_probe() took */
+	struct device *device;
+	struct pcd_core_dev core;	/* flat read/write/lseek, the lock is held for writing by resize too */
+	struct pcd_fifo fifo;
+	struct pcd_spsc_ctrl *spsc;	/* control page, first page of the buffer in PCD_MODE_SPSC */
+	struct mutex spsc_write_lock;	/* serializes write() producers, fifo.lock the read() consumers */
+	struct pcd_shard **shards;	/* one per possible CPU in PCD_MODE_SHARD, fifo.lock serializes readers */
+	struct pcd_log log;	/* PCD_MODE_LOG, protected by core.lock */
+	struct pcd_kv_store kv;	/* PCD_MODE_KV, protected by core.lock */
+	struct pcd_stats __percpu *stats;
+	struct mutex stats_lock;	/* protects stats_base */
+	struct pcd_counters stats_base;	/* totals at the last reset */
+	struct dentry *debugfs_dir;
+	struct file *backing;	/* persistent copy of the buffer, NULL if there is none */
+	unsigned long *dirty;	/* pages written since the last checkpoint, one bit each */
+	struct mutex persist_lock;	/* one checkpoint at a time */
+	struct delayed_work checkpoint_work;
+};
+
+/* A dma-buf exported from a device. It holds its own reference on every
+page, the device's page array may not be touched once the device is gone */
+struct pcd_dmabuf{
+	struct pcdev_private_data *pcdev_data;
+	struct page **pages;
+	unsigned long nr_pages;
+	struct mutex lock;	/* protects attachments */
+	struct list_head attachments;
+};
+
+/* An importing device and its mapping of the pages, if any */
+struct pcd_dmabuf_attachment{
+	struct device *dev;
+	struct sg_table *sgt;
+	enum dma_data_direction dir;
+	struct list_head node;
+};
+
+/* Point in time copy of a flat device buffer behind a snapshot fd. The
+pages are shared with the device until the device writes to them */
+struct pcd_snapshot{
+	struct pcdev_private_data *pcdev_data;	/* holds a reference */
+	struct page **pages;	/* NULL entries read as zeros */
+	u32 *crcs;	/* CRC32C of the pages when the snapshot was taken, NULL if not in integrity mode */
+	unsigned long nr_pages;
+	size_t size;
+	size_t data_len;
 };
 
 /* Driver private data structure */
 struct pcdrv_private_data{
-	int total_devices;
+	atomic_t total_devices;	/* devices probe concurrently */
 	dev_t device_num_base;
 	struct class* class_pcd;
-	struct device* device_pcd;
+	struct ida minor_ida;	/* ids in use out of MAX_DEVICES */
+	struct dentry *debugfs_root;
 };
 
-struct pcdrv_private_data pcdrv_data;
+static struct pcdrv_private_data pcdrv_data;
 
-loff_t pcd_lseek(struct file *filep, loff_t off, int whence){
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data *)filep->private_data;
-	
-	int max_data = pcdev_data->pdata.size;
-	off_t tmp;
-	pr_info("lseek requested\n");
-	pr_info("Current file position = %lld\n", filep->f_pos);
-	
-	switch(whence){
-		case SEEK_SET:
-			if( (off > max_data) || (off < 0) )
-				return -EINVAL;
-			filep->f_pos = off;
+/* Device behind an open pcdev-N, private_data points into it at the part
+the pcd core works on */
+static struct pcdev_private_data* pcd_file_data(struct file *filep){
+	return container_of(filep->private_data, struct pcdev_private_data, core);
+}
+
+/* Bump one counter of the calling CPU */
+#define pcd_stats_inc(pcdev_data, field)				\
+do{									\
+	struct pcd_stats *__stats = get_cpu_ptr((pcdev_data)->stats);	\
+	u64_stats_update_begin(&__stats->syncp);			\
+	__stats->cnt.field++;						\
+	u64_stats_update_end(&__stats->syncp);				\
+	put_cpu_ptr((pcdev_data)->stats);				\
+}while(0)
+
+/* Account a finished read or write of count requested bytes */
+static void pcd_stats_account_io(struct pcdev_private_data *pcdev_data, int dir, size_t count, ssize_t ret, u64 start){
+	struct pcd_stats *stats;
+	u64 delta = ktime_get_ns() - start;
+	int bucket = min_t(int, fls64(delta), PCD_LAT_BUCKETS - 1);
+
+	stats = get_cpu_ptr(pcdev_data->stats);
+	u64_stats_update_begin(&stats->syncp);
+
+	stats->cnt.ops[dir]++;
+	stats->cnt.lat_hist[dir][bucket]++;
+	if(ret >= 0){
+		stats->cnt.bytes[dir] += ret;
+		if((size_t)ret < count)
+			stats->cnt.short_ops[dir]++;
+	}
+	else if(ret == -ENOMEM)
+		stats->cnt.err_nomem++;
+	else if(ret == -EFAULT)
+		stats->cnt.err_fault++;
+
+	u64_stats_update_end(&stats->syncp);
+	put_cpu_ptr(pcdev_data->stats);
+}
+
+/* Add up the counters of all CPUs */
+static void pcd_stats_sum(struct pcdev_private_data *pcdev_data, struct pcd_counters *sum){
+	struct pcd_counters snap;
+	u64 *dst = (u64 *)sum;
+	const u64 *src = (const u64 *)&snap;
+	unsigned int start, i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu){
+		struct pcd_stats *stats = per_cpu_ptr(pcdev_data->stats, cpu);
+
+		do{
+			start = u64_stats_fetch_begin(&stats->syncp);
+			snap = stats->cnt;
+		}while(u64_stats_fetch_retry(&stats->syncp, start));
+
+		for(i = 0; i < PCD_NR_COUNTERS; i++)
+			dst[i] += src[i];
+	}
+}
+
+/* Counters since the last reset. The number of open handles is worked
+out before that, resets must not make it go negative */
+static void pcd_stats_get(struct pcdev_private_data *pcdev_data, struct pcd_counters *cnt, u64 *open_handles){
+	u64 *dst = (u64 *)cnt;
+	const u64 *base = (const u64 *)&pcdev_data->stats_base;
+	unsigned int i;
+
+	pcd_stats_sum(pcdev_data, cnt);
+	*open_handles = cnt->opens - cnt->releases;
+
+	mutex_lock(&pcdev_data->stats_lock);
+	for(i = 0; i < PCD_NR_COUNTERS; i++)
+		dst[i] -= base[i];
+	mutex_unlock(&pcdev_data->stats_lock);
+}
+
+/* The per CPU counters are never written from outside their CPU, a reset
+just moves the base line */
+static void pcd_stats_reset(struct pcdev_private_data *pcdev_data){
+	mutex_lock(&pcdev_data->stats_lock);
+	pcd_stats_sum(pcdev_data, &pcdev_data->stats_base);
+	mutex_unlock(&pcdev_data->stats_lock);
+}
+
+/* Compressed storage of a flat device with pdata.compress set. Each page
+of the buffer is kept as an lz4 compressed chunk and pages that are all
+zeros as no chunk at all. Reads and writes go through a small cache of
+decompressed pages, a page that was written to is only compressed again
+when it leaves the cache */
+#define PCD_ZCACHE_SIZE 8
+
+/* A page that doesn't get any smaller is stored as it is, len PAGE_SIZE */
+struct pcd_zchunk{
+	unsigned int len;
+	u8 data[];
+};
+
+struct pcd_zcache_entry{
+	unsigned long idx;	/* page held, ULONG_MAX if none */
+	void *data;	/* PAGE_SIZE bytes */
+	bool dirty;	/* newer than the chunk */
+	unsigned long used;	/* time of the last use, the oldest entry goes first */
+};
+
+struct pcd_zstore{
+	struct crypto_comp *tfm;
+	struct pcd_zchunk **chunks;	/* one per page of the buffer */
+	struct mutex lock;	/* protects the chunks and the cache */
+	struct pcd_zcache_entry cache[PCD_ZCACHE_SIZE];
+	unsigned long clock;
+	void *wbuf;	/* compressor output, lz4 may grow a page a little */
+	size_t stored_bytes;	/* total size of the chunks */
+};
+
+static void pcd_z_destroy(struct pcd_zstore *zs, unsigned long nr_pages){
+	unsigned long i;
+
+	if(zs->chunks){
+		for(i = 0; i < nr_pages; i++)
+			kfree(zs->chunks[i]);
+		kvfree(zs->chunks);
+	}
+	for(i = 0; i < PCD_ZCACHE_SIZE; i++)
+		kfree(zs->cache[i].data);
+	kfree(zs->wbuf);
+	if(zs->tfm)
+		crypto_free_comp(zs->tfm);
+	kfree(zs);
+}
+
+/* Compressed counterpart of pcd_buf_alloc(), every page starts out as zeros */
+static int pcd_z_alloc(struct pcdev_private_data *pcdev_data, size_t size){
+	unsigned long nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	struct pcd_zstore *zs;
+	int i, ret = -ENOMEM;
+
+	zs = kzalloc(sizeof(*zs), GFP_KERNEL);
+	if(zs == NULL)
+		return -ENOMEM;
+	mutex_init(&zs->lock);
+
+	zs->tfm = crypto_alloc_comp("lz4", 0, 0);
+	if(IS_ERR(zs->tfm)){
+		ret = PTR_ERR(zs->tfm);
+		zs->tfm = NULL;
+		goto free;
+	}
+
+	zs->chunks = kvcalloc(nr_pages, sizeof(*zs->chunks), GFP_KERNEL);
+	zs->wbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	if((zs->chunks == NULL) || (zs->wbuf == NULL))
+		goto free;
+
+	for(i = 0; i < PCD_ZCACHE_SIZE; i++){
+		zs->cache[i].idx = ULONG_MAX;
+		zs->cache[i].data = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if(zs->cache[i].data == NULL)
+			goto free;
+	}
+
+	pcdev_data->zs = zs;
+	pcdev_data->nr_pages = nr_pages;
+	return 0;
+
+free:
+	pcd_z_destroy(zs, 0);
+	return ret;
+}
+
+/* Compress the page of a dirty cache entry back into its chunk. Called
+with zs->lock held */
+static int pcd_z_writeback(struct pcd_zstore *zs, struct pcd_zcache_entry *e){
+	struct pcd_zchunk *chunk = NULL, *old = zs->chunks[e->idx];
+	unsigned int len = 2 * PAGE_SIZE;
+	const void *src = zs->wbuf;
+
+	if(!e->dirty)
+		return 0;
+
+	if(memchr_inv(e->data, 0, PAGE_SIZE)){
+		if(crypto_comp_compress(zs->tfm, e->data, PAGE_SIZE, zs->wbuf, &len) || (len >= PAGE_SIZE)){
+			src = e->data;
+			len = PAGE_SIZE;
+		}
+		chunk = kmalloc(sizeof(*chunk) + len, GFP_KERNEL);
+		if(chunk == NULL)
+			return -ENOMEM;
+		chunk->len = len;
+		memcpy(chunk->data, src, len);
+		zs->stored_bytes += len;
+	}
+
+	if(old){
+		zs->stored_bytes -= old->len;
+		kfree(old);
+	}
+	zs->chunks[e->idx] = chunk;
+	e->dirty = false;
+	return 0;
+}
+
+/* Cache entry of page idx, filled from the chunk on a miss. The least
+recently used entry makes room. Called with zs->lock held */
+static struct pcd_zcache_entry* pcd_z_get(struct pcd_zstore *zs, unsigned long idx){
+	struct pcd_zcache_entry *e, *victim = &zs->cache[0];
+	struct pcd_zchunk *chunk;
+	unsigned int len = PAGE_SIZE;
+	int i, ret;
+
+	for(i = 0; i < PCD_ZCACHE_SIZE; i++){
+		e = &zs->cache[i];
+		if(e->idx == idx)
+			goto hit;
+		if(e->used < victim->used)
+			victim = e;
+	}
+
+	e = victim;
+	if(e->idx != ULONG_MAX){
+		ret = pcd_z_writeback(zs, e);
+		if(ret)
+			return ERR_PTR(ret);
+		e->idx = ULONG_MAX;
+	}
+
+	chunk = zs->chunks[idx];
+	if(chunk == NULL)
+		memset(e->data, 0, PAGE_SIZE);
+	else if(chunk->len == PAGE_SIZE)
+		memcpy(e->data, chunk->data, PAGE_SIZE);
+	else if(crypto_comp_decompress(zs->tfm, chunk->data, chunk->len, e->data, &len) || (len != PAGE_SIZE))
+		return ERR_PTR(-EIO);
+	e->idx = idx;
+
+hit:
+	e->used = ++zs->clock;
+	return e;
+}
+
+/* Returns the bytes copied, or the error of pcd_z_get() if that failed
+before anything was copied */
+static ssize_t pcd_z_read(struct pcdev_private_data *pcdev_data, size_t pos, size_t count, struct iov_iter *to){
+	struct pcd_zstore *zs = pcdev_data->zs;
+	struct pcd_zcache_entry *e;
+	size_t done = 0, offset, chunk, copied;
+
+	while(done < count){
+		offset = offset_in_page(pos);
+		chunk = min_t(size_t, count - done, PAGE_SIZE - offset);
+
+		mutex_lock(&zs->lock);
+		e = pcd_z_get(zs, pos >> PAGE_SHIFT);
+		if(IS_ERR(e)){
+			mutex_unlock(&zs->lock);
+			return done ? done : PTR_ERR(e);
+		}
+		copied = copy_to_iter(e->data + offset, chunk, to);
+		mutex_unlock(&zs->lock);
+
+		done += copied;
+		pos += copied;
+		if(copied < chunk)
 			break;
-		case SEEK_CUR:
-			tmp = filep->f_pos + off;
-			if( (tmp > max_data) || (tmp<0))
-				return -EINVAL;
-			filep->f_pos = tmp;
+	}
+	return done;
+}
+
+static ssize_t pcd_z_write(struct pcdev_private_data *pcdev_data, size_t pos, size_t count, struct iov_iter *from){
+	struct pcd_zstore *zs = pcdev_data->zs;
+	struct pcd_zcache_entry *e;
+	size_t done = 0, offset, chunk, copied;
+
+	while(done < count){
+		offset = offset_in_page(pos);
+		chunk = min_t(size_t, count - done, PAGE_SIZE - offset);
+
+		mutex_lock(&zs->lock);
+		e = pcd_z_get(zs, pos >> PAGE_SHIFT);
+		if(IS_ERR(e)){
+			mutex_unlock(&zs->lock);
+			return done ? done : PTR_ERR(e);
+		}
+		copied = copy_from_iter(e->data + offset, chunk, from);
+		/* A faulting user buffer changed nothing, the entry need not be
+		compressed again */
+		if(copied)
+			e->dirty = true;
+		mutex_unlock(&zs->lock);
+
+		if(!copied)
 			break;
-		case SEEK_END:
-		default:
-			return -EINVAL;
-	};
-			
-	pr_info("Current file position after lseek = %lld\n", filep->f_pos);
+		done += copied;
+		pos += copied;
+		if(copied < chunk)
+			break;
+	}
+	return done;
+}
+
+/* Has page idx ever been written with anything but zeros */
+static bool pcd_z_present(struct pcd_zstore *zs, unsigned long idx){
+	bool present;
+	int i;
+
+	mutex_lock(&zs->lock);
+	present = zs->chunks[idx] != NULL;
+	for(i = 0; !present && (i < PCD_ZCACHE_SIZE); i++)
+		present = (zs->cache[i].idx == idx) && zs->cache[i].dirty;
+	mutex_unlock(&zs->lock);
+
+	return present;
+}
+
+/* Copy page idx out of and into the compressed buffer */
+static int pcd_z_copy_page(struct pcd_zstore *zs, unsigned long idx, void *dst){
+	struct pcd_zcache_entry *e;
+
+	mutex_lock(&zs->lock);
+	e = pcd_z_get(zs, idx);
+	if(!IS_ERR(e))
+		memcpy(dst, e->data, PAGE_SIZE);
+	mutex_unlock(&zs->lock);
+
+	return PTR_ERR_OR_ZERO(e);
+}
+
+static int pcd_z_fill_page(struct pcd_zstore *zs, unsigned long idx, const void *src, size_t len){
+	struct pcd_zcache_entry *e;
+
+	mutex_lock(&zs->lock);
+	e = pcd_z_get(zs, idx);
+	if(!IS_ERR(e)){
+		memcpy(e->data, src, len);
+		e->dirty = true;
+	}
+	mutex_unlock(&zs->lock);
+
+	return PTR_ERR_OR_ZERO(e);
+}
+
+/* pcd_resize() of a compressed buffer, the caller holds the device lock
+for writing. Same rules as for the page array */
+static int pcd_z_resize(struct pcd_zstore *zs, unsigned long old_pages, unsigned long nr_pages, size_t keep_size){
+	struct pcd_zchunk **chunks;
+	struct pcd_zcache_entry *e;
+	unsigned long i;
+	int ret = 0;
+
+	chunks = kvcalloc(nr_pages, sizeof(*chunks), GFP_KERNEL);
+	if(chunks == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&zs->lock);
+
+	if(offset_in_page(keep_size)){
+		e = pcd_z_get(zs, keep_size >> PAGE_SHIFT);
+		if(IS_ERR(e)){
+			ret = PTR_ERR(e);
+			goto unlock;
+		}
+		memset(e->data + offset_in_page(keep_size), 0, PAGE_SIZE - offset_in_page(keep_size));
+		e->dirty = true;
+	}
+
+	/* Cached pages past the new end are dropped, not written back */
+	for(i = 0; i < PCD_ZCACHE_SIZE; i++){
+		e = &zs->cache[i];
+		if((e->idx != ULONG_MAX) && (e->idx >= nr_pages)){
+			e->idx = ULONG_MAX;
+			e->dirty = false;
+			e->used = 0;
+		}
+	}
+
+	memcpy(chunks, zs->chunks, min(nr_pages, old_pages) * sizeof(*chunks));
+	for(i = nr_pages; i < old_pages; i++){
+		if(zs->chunks[i]){
+			zs->stored_bytes -= zs->chunks[i]->len;
+			kfree(zs->chunks[i]);
+		}
+	}
+	swap(chunks, zs->chunks);
+
+unlock:
+	mutex_unlock(&zs->lock);
+	kvfree(chunks);
+	return ret;
+}
+
+/* PCD_MODE_SHARD: every possible CPU has its own ring of pdata.size bytes
+and a write() goes to the ring of the CPU it runs on, so writers on
+different CPUs share neither a lock nor a cache line. read() merges the
+rings: the oldest record at the tail of any of them goes out next. The
+records of one ring are in time order since they are stamped under its
+lock, across rings the order holds for the records that are there when
+the reader looks */
+
+/* Bytes a record of len bytes takes up in a ring and in the read buffer */
+static size_t pcd_shard_reclen(size_t len){
+	return ALIGN(sizeof(struct pcd_shard_rec) + len, PCD_SHARD_ALIGN);
+}
+
+static void pcd_shard_free(struct pcdev_private_data *pcdev_data){
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kvfree(pcdev_data->shards[cpu]);
+	kfree(pcdev_data->shards);
+	pcdev_data->shards = NULL;
+}
+
+/* The rings are allocated on the node of their CPU */
+static int pcd_shard_alloc(struct pcdev_private_data *pcdev_data){
+	struct pcd_shard *shard;
+	int cpu;
+
+	pcdev_data->shards = kcalloc(nr_cpu_ids, sizeof(*pcdev_data->shards), GFP_KERNEL);
+	if(pcdev_data->shards == NULL)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu){
+		shard = kvzalloc_node(sizeof(*shard) + pcdev_data->pdata.size, GFP_KERNEL, cpu_to_node(cpu));
+		if(shard == NULL){
+			pcd_shard_free(pcdev_data);
+			return -ENOMEM;
+		}
+		mutex_init(&shard->lock);
+		pcdev_data->shards[cpu] = shard;
+	}
+	return 0;
+}
+
+/* Copies in and out of a ring of size bytes, wrapping at its end */
+static void pcd_shard_put(struct pcd_shard *shard, size_t size, size_t off, const void *src, size_t len){
+	size_t chunk = min(len, size - off);
+
+	memcpy(shard->data + off, src, chunk);
+	memcpy(shard->data, src + chunk, len - chunk);
+}
+
+static void pcd_shard_get(struct pcd_shard *shard, size_t size, size_t off, void *dst, size_t len){
+	size_t chunk = min(len, size - off);
+
+	memcpy(dst, shard->data + off, chunk);
+	memcpy(dst + chunk, shard->data, len - chunk);
+}
+
+static size_t pcd_shard_from_iter(struct pcd_shard *shard, size_t size, size_t off, size_t len, struct iov_iter *from){
+	size_t chunk = min(len, size - off);
+	size_t ret;
+
+	ret = copy_from_iter(shard->data + off, chunk, from);
+	if(ret == chunk && len > chunk)
+		ret += copy_from_iter(shard->data, len - chunk, from);
+	return ret;
+}
+
+static size_t pcd_shard_to_iter(struct pcd_shard *shard, size_t size, size_t off, size_t len, struct iov_iter *to){
+	size_t chunk = min(len, size - off);
+	size_t ret;
+
+	ret = copy_to_iter(shard->data + off, chunk, to);
+	if(ret == chunk && len > chunk)
+		ret += copy_to_iter(shard->data, len - chunk, to);
+	return ret;
+}
+
+/* Header of the oldest record of a ring, NULL if the ring is empty. Only
+the reader moves tail, so once fill says a record is there it stays put
+until the reader consumes it and no lock is needed to look at it */
+static struct pcd_shard_rec* pcd_shard_peek(struct pcd_shard *shard, size_t size){
+	if(!shard->have_next && smp_load_acquire(&shard->fill)){
+		pcd_shard_get(shard, size, shard->tail, &shard->next, sizeof(shard->next));
+		shard->have_next = true;
+	}
+	return shard->have_next ? &shard->next : NULL;
+}
+
+static bool pcd_shard_pending(struct pcdev_private_data *pcdev_data){
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if(READ_ONCE(pcdev_data->shards[cpu]->fill))
+			return true;
+	return false;
+}
+
+static ssize_t pcd_shard_write_iter(struct kiocb *iocb, struct iov_iter *from){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_fifo *fifo = &pcdev_data->fifo;
+	struct pcd_shard *shard;
+	struct pcd_shard_rec rec;
+
+	size_t size = pcdev_data->pdata.size;
+	size_t req = iov_iter_count(from);
+	size_t reclen = pcd_shard_reclen(req);
+	size_t head = 0;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+	int cpu;
+
+	if(!req)
+		return 0;
+
+	/* A record is never split, it has to fit into an empty ring */
+	if(reclen > size){
+		ret = -EMSGSIZE;
+		goto out;
+	}
+
+	for(;;){
+		/* Ring of the CPU we run on. Being migrated right after costs
+		locality only, the ring lock keeps it correct */
+		cpu = raw_smp_processor_id();
+		shard = pcdev_data->shards[cpu];
+
+		if(mutex_lock_interruptible(&shard->lock)){
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		if(size - shard->fill >= reclen)
+			break;
+		mutex_unlock(&shard->lock);
+
+		/* Sleep until the reader has made room, maybe on another CPU
+		by the time it does */
+		if(nonblock){
+			ret = -EAGAIN;
+			goto out;
+		}
+		if(wait_event_interruptible(fifo->writeq, size - READ_ONCE(shard->fill) >= reclen)){
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+
+	head = shard->head;
+	if(pcd_shard_from_iter(shard, size, (head + sizeof(rec)) % size, req, from) != req){
+		mutex_unlock(&shard->lock);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	/* Stamped under the lock, a ring is always in time order */
+	rec.ts_ns = ktime_get_ns();
+	rec.len = req;
+	rec.cpu = cpu;
+	rec.reserved = 0;
+	pcd_shard_put(shard, size, head, &rec, sizeof(rec));
+
+	/* The padding is never read, the reader zero fills it */
+	shard->head = (head + reclen) % size;
+	smp_store_release(&shard->fill, shard->fill + reclen);
+	mutex_unlock(&shard->lock);
+	ret = req;
+
+	/* The wait queue is shared by all CPUs, only touch it when the reader
+	sleeps. wq_has_sleeper() orders the fill update before the check */
+	if(wq_has_sleeper(&fifo->readq))
+		wake_up_interruptible(&fifo->readq);
+
+out:
+	trace_pcd_write(pcdev_data->core.devt, head, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_WRITE, req, ret, start);
+	return ret;
+}
+
+static ssize_t pcd_shard_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_fifo *fifo = &pcdev_data->fifo;
+	struct pcd_shard *shard, *oldest;
+	struct pcd_shard_rec *rec;
+
+	size_t size = pcdev_data->pdata.size;
+	size_t req = iov_iter_count(to);
+	size_t done = 0, reclen, n;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	u64 start = ktime_get_ns();
+	ssize_t ret = 0;
+	int cpu;
+
+	if(!req)
+		return 0;
+
+	if(mutex_lock_interruptible(&fifo->lock)){
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	for(;;){
+		/* k-way merge, the oldest record at the tail of any ring is next */
+		oldest = NULL;
+		for_each_possible_cpu(cpu){
+			shard = pcdev_data->shards[cpu];
+			rec = pcd_shard_peek(shard, size);
+			if(rec && (!oldest || (rec->ts_ns < oldest->next.ts_ns)))
+				oldest = shard;
+		}
+
+		if(oldest == NULL){
+			if(done)
+				break;
+
+			/* Sleep until a writer has put something in */
+			mutex_unlock(&fifo->lock);
+			if(nonblock){
+				ret = -EAGAIN;
+				goto out;
+			}
+			if(wait_event_interruptible(fifo->readq, pcd_shard_pending(pcdev_data)) ||
+			   mutex_lock_interruptible(&fifo->lock)){
+				ret = -ERESTARTSYS;
+				goto out;
+			}
+			continue;
+		}
+
+		/* Only whole records go out */
+		rec = &oldest->next;
+		reclen = pcd_shard_reclen(rec->len);
+		if(reclen > iov_iter_count(to)){
+			if(!done)
+				ret = -EINVAL;
+			break;
+		}
+
+		n = copy_to_iter(rec, sizeof(*rec), to);
+		if(n == sizeof(*rec))
+			n += pcd_shard_to_iter(oldest, size, (oldest->tail + sizeof(*rec)) % size, rec->len, to);
+		if(n == sizeof(*rec) + rec->len)
+			n += iov_iter_zero(reclen - n, to);
+		if(n != reclen){
+			if(!done)
+				ret = -EFAULT;
+			break;
+		}
+
+		/* Hand the space back to the writers of the ring */
+		mutex_lock(&oldest->lock);
+		oldest->tail = (oldest->tail + reclen) % size;
+		WRITE_ONCE(oldest->fill, oldest->fill - reclen);
+		mutex_unlock(&oldest->lock);
+		oldest->have_next = false;
+		done += reclen;
+	}
+
+	mutex_unlock(&fifo->lock);
+
+	if(done){
+		ret = done;
+		if(wq_has_sleeper(&fifo->writeq))
+			wake_up_interruptible(&fifo->writeq);
+	}
+
+out:
+	trace_pcd_read(pcdev_data->core.devt, 0, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_READ, req, ret, start);
+	return ret;
+}
+
+/* Writable as long as the ring of the polling CPU has room for a record */
+static __poll_t pcd_shard_poll(struct file *filep, poll_table *wait){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_shard *shard = pcdev_data->shards[raw_smp_processor_id()];
+	
+	__poll_t mask = 0;
+
+	poll_wait(filep, &pcdev_data->fifo.readq, wait);
+	poll_wait(filep, &pcdev_data->fifo.writeq, wait);
+
+	if(pcd_shard_pending(pcdev_data))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if(pcdev_data->pdata.size - READ_ONCE(shard->fill) >= pcd_shard_reclen(1))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+/* Page array for a buffer of size bytes. The pages themselves are only
+allocated when they are first written to, until then the entry is NULL
+and reads of it return zeros */
+static int pcd_buf_alloc(struct pcdev_private_data *pcdev_data, size_t size){
+	unsigned long nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	pcdev_data->pages = kvcalloc(nr_pages, sizeof(*pcdev_data->pages), GFP_KERNEL);
+	if(pcdev_data->pages == NULL)
+		return -ENOMEM;
+
+	pcdev_data->nr_pages = nr_pages;
+	return 0;
+}
+
+static void pcd_buf_free(struct pcdev_private_data *pcdev_data){
+	unsigned long i;
+
+	if(pcdev_data->shards){
+		pcd_shard_free(pcdev_data);
+		return;
+	}
+
+	if(pcdev_data->zs){
+		pcd_z_destroy(pcdev_data->zs, pcdev_data->nr_pages);
+		pcdev_data->zs = NULL;
+		pcdev_data->nr_pages = 0;
+		return;
+	}
+
+	if(pcdev_data->kv.base){
+		vunmap(pcdev_data->kv.base);
+		pcdev_data->kv.base = NULL;
+	}
+
+	for(i = 0; i < pcdev_data->nr_pages; i++)
+		if(pcdev_data->pages[i])
+			__free_page(pcdev_data->pages[i]);
+	kvfree(pcdev_data->pages);
+	pcdev_data->pages = NULL;
+	pcdev_data->nr_pages = 0;
+
+	kvfree(pcdev_data->log.index);
+	pcdev_data->log.index = NULL;
+}
+
+/* Page idx of the buffer, allocated if it isn't there yet. Writers and
+page faults can race for the same missing page, the loser of the cmpxchg
+gives its page back. Returns NULL if no memory is left */
+static struct page* pcd_buf_get_page(struct pcdev_private_data *pcdev_data, unsigned long idx){
+	struct page *page = READ_ONCE(pcdev_data->pages[idx]);
+	struct page *old;
+
+	if(page)
+		return page;
+
+	page = alloc_page(GFP_HIGHUSER | __GFP_ZERO);
+	if(page == NULL)
+		return NULL;
+
+	old = cmpxchg(&pcdev_data->pages[idx], NULL, page);
+	if(old){
+		__free_page(page);
+		page = old;
+	}
+	return page;
+}
+
+/* Page idx for a write, the caller holds the lock for writing. A page a
+snapshot still shares is copied first and the snapshot keeps the old one.
+Snapshots and mappings exclude each other, so while there are snapshots
+any extra reference on a page is one of theirs */
+static struct page* pcd_buf_get_page_write(struct pcdev_private_data *pcdev_data, unsigned long idx){
+	struct page *page = pcd_buf_get_page(pcdev_data, idx);
+	struct page *copy;
+
+	if((page == NULL) || !atomic_read(&pcdev_data->snapshots) || (page_count(page) == 1))
+		return page;
+
+	copy = alloc_page(GFP_HIGHUSER);
+	if(copy == NULL)
+		return NULL;
+
+	copy_highpage(copy, page);
+	pcdev_data->pages[idx] = copy;
+	put_page(page);
+	return copy;
+}
+
+/* Copy count bytes starting at pos out of a page array to user space. The
+caller has made sure the range is inside the array. Returns the number of
+bytes copied, less than count if user memory faulted. The bytes are always
+copied: copy_page_to_iter() would hand the page itself to a splice pipe,
+which can't use pages outside the page cache and would alias the buffer
+and keep a reference the snapshot copy-on-write test counts */
+static size_t pcd_pages_read(struct page **pages, size_t pos, size_t count, struct iov_iter *to){
+	size_t done = 0, offset, chunk, copied;
+	struct page *page;
+	void *vaddr;
+
+	while(done < count){
+		offset = offset_in_page(pos);
+		chunk = min_t(size_t, count - done, PAGE_SIZE - offset);
+		page = READ_ONCE(pages[pos >> PAGE_SHIFT]);
+		if(page){
+			vaddr = kmap(page);
+			copied = copy_to_iter(vaddr + offset, chunk, to);
+			kunmap(page);
+		}
+		else
+			copied = iov_iter_zero(chunk, to);
+		done += copied;
+		pos += copied;
+		if(copied < chunk)
+			break;
+	}
+	return done;
+}
+
+/* Read from the device buffer, the caller holds the lock. Only a
+compressed buffer can fail with an error */
+static ssize_t pcd_buf_read(struct pcdev_private_data *pcdev_data, size_t pos, size_t count, struct iov_iter *to){
+	if(pcdev_data->zs)
+		return pcd_z_read(pcdev_data, pos, count, to);
+	return pcd_pages_read(pcdev_data->pages, pos, count, to);
+}
+
+/* Counterpart of pcd_buf_read() for writes, missing pages are allocated on
+the way. Returns -ENOMEM if not even the first page could be allocated */
+static ssize_t pcd_buf_write(struct pcdev_private_data *pcdev_data, size_t pos, size_t count, struct iov_iter *from){
+	size_t done = 0, offset, chunk, copied;
+	struct page *page;
+
+	if(pcdev_data->zs)
+		return pcd_z_write(pcdev_data, pos, count, from);
+
+	while(done < count){
+		offset = offset_in_page(pos);
+		chunk = min_t(size_t, count - done, PAGE_SIZE - offset);
+		page = pcd_buf_get_page_write(pcdev_data, pos >> PAGE_SHIFT);
+		if(page == NULL)
+			return done ? done : -ENOMEM;
+		copied = copy_page_from_iter(page, offset, chunk, from);
+		done += copied;
+		pos += copied;
+		if(copied < chunk)
+			break;
+	}
+	return done;
+}
+
+/* Has page idx of the buffer ever been written */
+static bool pcd_buf_present(struct pcdev_private_data *pcdev_data, unsigned long idx){
+	if(pcdev_data->zs)
+		return pcd_z_present(pcdev_data->zs, idx);
+	return READ_ONCE(pcdev_data->pages[idx]) != NULL;
+}
+
+/* Copy page idx of the buffer to dst, zeros if it was never written */
+static int pcd_buf_copy_page(struct pcdev_private_data *pcdev_data, unsigned long idx, void *dst){
+	struct page *page;
+	void *vaddr;
+
+	if(pcdev_data->zs)
+		return pcd_z_copy_page(pcdev_data->zs, idx, dst);
+
+	page = READ_ONCE(pcdev_data->pages[idx]);
+	if(page){
+		vaddr = kmap_atomic(page);
+		memcpy(dst, vaddr, PAGE_SIZE);
+		kunmap_atomic(vaddr);
+	}
+	else
+		memset(dst, 0, PAGE_SIZE);
+	return 0;
+}
+
+/* Store len bytes from src at the start of page idx */
+static int pcd_buf_fill_page(struct pcdev_private_data *pcdev_data, unsigned long idx, const void *src, size_t len){
+	struct page *page;
+	void *vaddr;
+
+	if(pcdev_data->zs)
+		return pcd_z_fill_page(pcdev_data->zs, idx, src, len);
+
+	page = pcd_buf_get_page(pcdev_data, idx);
+	if(page == NULL)
+		return -ENOMEM;
+	vaddr = kmap_atomic(page);
+	memcpy(vaddr, src, len);
+	kunmap_atomic(vaddr);
+	return 0;
+}
+
+/* Integrity mode, pdata.integrity set. Every page of the buffer has a
+CRC32C that writes keep up to date and reads check first. The crypto API
+hands out the fastest crc32c the CPU has, SSE4.2 or the ARMv8 CRC
+instructions, and falls back to the generic table driven one */
+static u32 pcd_crc_page(struct pcdev_private_data *pcdev_data, struct page *page){
+	SHASH_DESC_ON_STACK(desc, pcdev_data->crc_tfm);
+	u32 crc = 0;
+	void *vaddr;
+
+	desc->tfm = pcdev_data->crc_tfm;
+	vaddr = kmap_atomic(page);
+	crypto_shash_digest(desc, vaddr, PAGE_SIZE, (u8 *)&crc);
+	kunmap_atomic(vaddr);
+	return crc;
+}
+
+/* Recompute the CRCs of the pages in [pos, pos + count), the caller holds
+the lock for writing */
+static void pcd_integrity_update(struct pcdev_private_data *pcdev_data, size_t pos, size_t count){
+	unsigned long idx, last;
+	struct page *page;
+
+	if(!pcdev_data->crcs || !count)
+		return;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for(idx = pos >> PAGE_SHIFT; idx <= last; idx++){
+		page = pcdev_data->pages[idx];
+		if(page)
+			pcdev_data->crcs[idx] = pcd_crc_page(pcdev_data, page);
+	}
+}
+
+/* Check the pages in [pos, pos + count) before they are read, the caller
+holds the lock. Pages that were never written have nothing to check */
+static int pcd_integrity_check(struct pcdev_private_data *pcdev_data, size_t pos, size_t count){
+	unsigned long idx, last;
+	struct page *page;
+
+	if(!pcdev_data->crcs || !count)
+		return 0;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for(idx = pos >> PAGE_SHIFT; idx <= last; idx++){
+		page = pcdev_data->pages[idx];
+		if(page && (pcd_crc_page(pcdev_data, page) != pcdev_data->crcs[idx])){
+			pcd_stats_inc(pcdev_data, err_integrity);
+			pr_err_ratelimited("pcdev-%d CRC mismatch in the block at %lu\n", pcdev_data->id, idx << PAGE_SHIFT);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/* PCD_IOC_VERIFY, check every page of the buffer */
+static int pcd_integrity_verify(struct pcdev_private_data *pcdev_data, struct pcd_verify *res){
+	unsigned long idx;
+	struct page *page;
+
+	if(!pcdev_data->crcs)
+		return -EINVAL;
+
+	memset(res, 0, sizeof(*res));
+	res->block_size = PAGE_SIZE;
+
+	down_read(&pcdev_data->core.lock);
+	for(idx = 0; idx < pcdev_data->nr_pages; idx++){
+		page = pcdev_data->pages[idx];
+		if(page && (pcd_crc_page(pcdev_data, page) != pcdev_data->crcs[idx])){
+			if(!res->bad_blocks++)
+				res->first_bad = (u64)idx << PAGE_SHIFT;
+			pcd_stats_inc(pcdev_data, err_integrity);
+		}
+	}
+	up_read(&pcdev_data->core.lock);
+	return 0;
+}
+
+/* Set up integrity mode, the buffer may already hold restored data */
+static int pcd_integrity_init(struct pcdev_private_data *pcdev_data){
+	unsigned long idx;
+
+	pcdev_data->crc_tfm = crypto_alloc_shash("crc32c", 0, 0);
+	if(IS_ERR(pcdev_data->crc_tfm)){
+		int ret = PTR_ERR(pcdev_data->crc_tfm);
+
+		pcdev_data->crc_tfm = NULL;
+		return ret;
+	}
+
+	pcdev_data->crcs = kvcalloc(pcdev_data->nr_pages, sizeof(*pcdev_data->crcs), GFP_KERNEL);
+	if(pcdev_data->crcs == NULL){
+		crypto_free_shash(pcdev_data->crc_tfm);
+		pcdev_data->crc_tfm = NULL;
+		return -ENOMEM;
+	}
+
+	for(idx = 0; idx < pcdev_data->nr_pages; idx++)
+		if(pcdev_data->pages[idx])
+			pcdev_data->crcs[idx] = pcd_crc_page(pcdev_data, pcdev_data->pages[idx]);
+
+	pr_debug("pcdev-%d integrity mode using %s\n", pcdev_data->id, crypto_shash_driver_name(pcdev_data->crc_tfm));
+	return 0;
+}
+
+static void pcd_integrity_exit(struct pcdev_private_data *pcdev_data){
+	if(pcdev_data->crcs == NULL)
+		return;
+
+	kvfree(pcdev_data->crcs);
+	pcdev_data->crcs = NULL;
+	crypto_free_shash(pcdev_data->crc_tfm);
+	pcdev_data->crc_tfm = NULL;
+}
+
+/* Grow or shrink the buffer of a flat device. Pages below the smaller of
+the two sizes are kept as they are, so are their contents */
+static int pcd_resize(struct pcdev_private_data *pcdev_data, u64 new_size){
+	unsigned long nr_pages, old_pages, keep;
+	struct page **pages = NULL, **old;
+	unsigned long *dirty = NULL;
+	u32 *crcs = NULL;
+	struct page *page;
+	size_t keep_size;
+	int ret = 0;
+
+	if(pcdev_data->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+
+	if(!new_size || new_size > PCD_MAX_SIZE)
+		return -EINVAL;
+
+	nr_pages = PAGE_ALIGN(new_size) >> PAGE_SHIFT;
+	if(pcdev_data->zs == NULL){
+		pages = kvcalloc(nr_pages, sizeof(*pages), GFP_KERNEL);
+		if(pages == NULL)
+			return -ENOMEM;
+	}
+
+	if(pcdev_data->backing){
+		dirty = bitmap_zalloc(nr_pages, GFP_KERNEL);
+		if(dirty == NULL){
+			kvfree(pages);
+			return -ENOMEM;
+		}
+	}
+
+	if(pcdev_data->crcs){
+		crcs = kvcalloc(nr_pages, sizeof(*crcs), GFP_KERNEL);
+		if(crcs == NULL){
+			bitmap_free(dirty);
+			kvfree(pages);
+			return -ENOMEM;
+		}
+	}
+
+	down_write(&pcdev_data->core.lock);
+
+	/* Mapped pages can't be taken away from under user space */
+	if(atomic_read(&pcdev_data->map_count)){
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	keep_size = min_t(size_t, pcdev_data->pdata.size, new_size);
+	old_pages = pcdev_data->nr_pages;
+	keep = min(nr_pages, old_pages);
+
+	if(pcdev_data->zs){
+		ret = pcd_z_resize(pcdev_data->zs, old_pages, nr_pages, keep_size);
+		if(ret)
+			goto unlock;
+	}
+	else{
+		/* Bytes past the end of the old or the new size in the last kept
+		page may have been written through a mapping, they must read back
+		as zero. A snapshot sharing the page keeps its bytes */
+		if(offset_in_page(keep_size) && pcdev_data->pages[keep_size >> PAGE_SHIFT]){
+			page = pcd_buf_get_page_write(pcdev_data, keep_size >> PAGE_SHIFT);
+			if(page == NULL){
+				ret = -ENOMEM;
+				goto unlock;
+			}
+			zero_user_segment(page, offset_in_page(keep_size), PAGE_SIZE);
+		}
+
+		old = pcdev_data->pages;
+
+		/* Growing only extends the array, the new pages come on first write */
+		memcpy(pages, old, keep * sizeof(*pages));
+
+		while(old_pages > nr_pages){
+			old_pages--;
+			if(old[old_pages])
+				__free_page(old[old_pages]);
+		}
+
+		pcdev_data->pages = pages;
+		pages = old;
+	}
+
+	/* The backing file may still hold data of a larger earlier size, the
+	part of it that is back inside the buffer has to be zeroed as well */
+	if(dirty){
+		bitmap_copy(dirty, pcdev_data->dirty, keep);
+		if(nr_pages > (keep_size >> PAGE_SHIFT))
+			bitmap_set(dirty, keep_size >> PAGE_SHIFT, nr_pages - (keep_size >> PAGE_SHIFT));
+		swap(dirty, pcdev_data->dirty);
+	}
+
+	/* The last kept page may just have been zeroed in part */
+	if(crcs){
+		memcpy(crcs, pcdev_data->crcs, keep * sizeof(*crcs));
+		swap(crcs, pcdev_data->crcs);
+		if(offset_in_page(keep_size))
+			pcd_integrity_update(pcdev_data, keep_size, 1);
+	}
+
+	pcdev_data->nr_pages = nr_pages;
+	WRITE_ONCE(pcdev_data->pdata.size, new_size);
+	pcdev_data->core.size = new_size;
+	if(pcdev_data->core.data_len > new_size)
+		WRITE_ONCE(pcdev_data->core.data_len, new_size);
+
+unlock:
+	up_write(&pcdev_data->core.lock);
+	kvfree(pages);
+	bitmap_free(dirty);
+	kvfree(crcs);
+
+	trace_pcd_resize(pcdev_data->core.devt, new_size, ret);
+	return ret;
+}
+
+/* Remember that [pos, pos + count) has to go to the backing file. Page
+faults get here without the device lock, hence the atomic set_bit() */
+static void pcd_mark_dirty(struct pcdev_private_data *pcdev_data, size_t pos, size_t count){
+	unsigned long idx, last;
+
+	if(!pcdev_data->dirty || !count)
+		return;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for(idx = pos >> PAGE_SHIFT; idx <= last; idx++)
+		set_bit(idx, pcdev_data->dirty);
+}
+
+/* Write the pages changed since the last checkpoint to the backing file.
+A page is copied to a bounce page under the read lock and written out
+after the lock is dropped, so readers never wait for the file system and
+writers only for the copy of one page. A page written again while it is
+on its way out is marked dirty again and goes with the next checkpoint */
+static int pcd_checkpoint(struct pcdev_private_data *pcdev_data){
+	unsigned long idx = 0, next;
+	void *bounce;
+	size_t len;
+	loff_t pos;
+	ssize_t n;
+	int ret = 0;
+
+	if(pcdev_data->backing == NULL)
+		return -ENODEV;
+
+	bounce = (void *)__get_free_page(GFP_KERNEL);
+	if(bounce == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&pcdev_data->persist_lock);
+
+	for(;; idx++){
+		down_read(&pcdev_data->core.lock);
+
+		next = find_next_bit(pcdev_data->dirty, pcdev_data->nr_pages, idx);
+
+		/* Pages that are mapped or exported change without a write(),
+		as long as there are users every present page goes out */
+		if(atomic_read(&pcdev_data->map_count)){
+			while((idx < next) && !READ_ONCE(pcdev_data->pages[idx]))
+				idx++;
+			next = idx;
+		}
+
+		idx = next;
+		if(idx >= pcdev_data->nr_pages){
+			up_read(&pcdev_data->core.lock);
+			break;
+		}
+
+		clear_bit(idx, pcdev_data->dirty);
+		ret = pcd_buf_copy_page(pcdev_data, idx, bounce);
+		if(ret){
+			set_bit(idx, pcdev_data->dirty);
+			up_read(&pcdev_data->core.lock);
+			break;
+		}
+		pos = (loff_t)idx << PAGE_SHIFT;
+		len = min_t(size_t, PAGE_SIZE, pcdev_data->pdata.size - pos);
+
+		up_read(&pcdev_data->core.lock);
+
+		n = kernel_write(pcdev_data->backing, bounce, len, &pos);
+		if(n != len){
+			/* Try again with the next checkpoint. A resize in between
+			has marked everything it kept dirty anyway */
+			down_read(&pcdev_data->core.lock);
+			if(idx < pcdev_data->nr_pages)
+				set_bit(idx, pcdev_data->dirty);
+			up_read(&pcdev_data->core.lock);
+			ret = (n < 0) ? n : -EIO;
+			break;
+		}
+	}
+
+	if(!ret)
+		ret = vfs_fsync(pcdev_data->backing, 0);
+
+	mutex_unlock(&pcdev_data->persist_lock);
+	free_page((unsigned long)bounce);
+	return ret;
+}
+
+/* Background checkpoint, rearms itself every pdata.checkpoint_ms */
+static void pcd_checkpoint_work(struct work_struct *work){
+	struct pcdev_private_data *pcdev_data = container_of(to_delayed_work(work), struct pcdev_private_data, checkpoint_work);
+	int ret;
+
+	ret = pcd_checkpoint(pcdev_data);
+	if(ret)
+		pr_err("pcdev-%d checkpoint failed %d\n", pcdev_data->id, ret);
+
+	queue_delayed_work(system_unbound_wq, &pcdev_data->checkpoint_work, msecs_to_jiffies(pcdev_data->pdata.checkpoint_ms));
+}
+
+/* Load the buffer from the backing file, the device isn't live yet. Pages
+that are all zeros in the file stay unallocated */
+static int pcd_restore(struct pcdev_private_data *pcdev_data){
+	unsigned long idx;
+	void *bounce;
+	size_t len;
+	loff_t pos;
+	ssize_t n;
+	int ret = 0;
+
+	bounce = (void *)__get_free_page(GFP_KERNEL);
+	if(bounce == NULL)
+		return -ENOMEM;
+
+	for(idx = 0; idx < pcdev_data->nr_pages; idx++){
+		pos = (loff_t)idx << PAGE_SHIFT;
+		len = min_t(size_t, PAGE_SIZE, pcdev_data->pdata.size - pos);
+
+		n = kernel_read(pcdev_data->backing, bounce, len, &pos);
+		if(n <= 0){
+			ret = n;
+			break;
+		}
+
+		if(memchr_inv(bounce, 0, n)){
+			ret = pcd_buf_fill_page(pcdev_data, idx, bounce, n);
+			if(ret)
+				break;
+			pcdev_data->core.data_len = ((size_t)idx << PAGE_SHIFT) + n;
+		}
+
+		/* End of the file */
+		if(n < len)
+			break;
+	}
+
+	free_page((unsigned long)bounce);
+	return ret;
+}
+
+/* Open the backing file of a flat device and restore the buffer from it */
+static int pcd_persist_init(struct pcdev_private_data *pcdev_data){
+	int ret;
+
+	pcdev_data->dirty = bitmap_zalloc(pcdev_data->nr_pages, GFP_KERNEL);
+	if(pcdev_data->dirty == NULL)
+		return -ENOMEM;
+
+	pcdev_data->backing = filp_open(pcdev_data->pdata.backing_file, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if(IS_ERR(pcdev_data->backing)){
+		ret = PTR_ERR(pcdev_data->backing);
+		goto dirty_free;
+	}
+
+	ret = pcd_restore(pcdev_data);
+	if(ret)
+		goto file_close;
+	return 0;
+
+file_close:
+	filp_close(pcdev_data->backing, NULL);
+dirty_free:
+	pcdev_data->backing = NULL;
+	bitmap_free(pcdev_data->dirty);
+	pcdev_data->dirty = NULL;
+	return ret;
+}
+
+/* Stop the background checkpoint, write out what is left and close the
+backing file. No new I/O can reach the device any more */
+static void pcd_persist_exit(struct pcdev_private_data *pcdev_data){
+	int ret;
+
+	if(pcdev_data->backing == NULL)
+		return;
+
+	cancel_delayed_work_sync(&pcdev_data->checkpoint_work);
+
+	ret = pcd_checkpoint(pcdev_data);
+	if(ret)
+		pr_err("pcdev-%d final checkpoint failed %d\n", pcdev_data->id, ret);
+
+	filp_close(pcdev_data->backing, NULL);
+	pcdev_data->backing = NULL;
+	bitmap_free(pcdev_data->dirty);
+	pcdev_data->dirty = NULL;
+}
+
+/* Storage of a flat device behind the pcd core. The core has done the
+bounds checks and holds the device lock */
+static ssize_t pcd_backend_read(struct pcd_core_dev *core, size_t pos, size_t count, struct iov_iter *to){
+	struct pcdev_private_data *pcdev_data = container_of(core, struct pcdev_private_data, core);
+	int ret;
+
+	ret = pcd_integrity_check(pcdev_data, pos, count);
+	if(ret)
+		return ret;
+	return pcd_buf_read(pcdev_data, pos, count, to);
+}
+
+static ssize_t pcd_backend_write(struct pcd_core_dev *core, size_t pos, size_t count, struct iov_iter *from){
+	struct pcdev_private_data *pcdev_data = container_of(core, struct pcdev_private_data, core);
+	ssize_t ret;
+
+	ret = pcd_buf_write(pcdev_data, pos, count, from);
+	if(ret > 0){
+		pcd_mark_dirty(pcdev_data, pos, ret);
+		pcd_integrity_update(pcdev_data, pos, ret);
+	}
+	return ret;
+}
+
+/* SEEK_DATA and SEEK_HOLE report the pages that were ever written */
+static bool pcd_backend_present(struct pcd_core_dev *core, unsigned long idx){
+	struct pcdev_private_data *pcdev_data = container_of(core, struct pcdev_private_data, core);
+
+	return (idx < pcdev_data->nr_pages) && pcd_buf_present(pcdev_data, idx);
+}
+
+static void pcd_backend_account(struct pcd_core_dev *core, int dir, size_t count, ssize_t ret, u64 start){
+	struct pcdev_private_data *pcdev_data = container_of(core, struct pcdev_private_data, core);
+
+	pcd_stats_account_io(pcdev_data, (dir == PCD_DIR_WRITE) ? PCD_STAT_WRITE : PCD_STAT_READ, count, ret, start);
+}
+
+static const struct pcd_backend_ops pcd_backend_ops = {
+	.read = pcd_backend_read,
+	.write = pcd_backend_write,
+	.present = pcd_backend_present,
+	.account = pcd_backend_account,
+};
+
+/* The last reference is gone, the platform device was removed before.
+Open files, dma-bufs and snapshots can outlive it, the buffer and what
+belongs to it stay until they are closed. The final checkpoint is taken
+here too, the buffer may have been written through them until now */
+static void pcd_dev_free(struct kref *ref){
+	struct pcdev_private_data *pcdev_data = container_of(ref, struct pcdev_private_data, ref);
+
+	pcd_persist_exit(pcdev_data);
+	pcd_integrity_exit(pcdev_data);
+	free_percpu(pcdev_data->stats);
+	pcd_buf_free(pcdev_data);
+	kfree(pcdev_data);
+}
+
+static void pcd_dev_get(struct pcdev_private_data *pcdev_data){
+	kref_get(&pcdev_data->ref);
+}
+
+static void pcd_dev_put(struct pcdev_private_data *pcdev_data){
+	kref_put(&pcdev_data->ref, pcd_dev_free);
+}
+
+static int pcd_open(struct inode *p_inode, struct file *filep){
+	int ret, minor_n;
+	struct pcdev_private_data* pcdev_data;
+
+	/* Find out which device file open was attempted by the uer space */
+	minor_n = MINOR(p_inode->i_rdev);
+	
+	/* Get device's private data structure */
+	pcdev_data = container_of(p_inode->i_cdev, struct pcdev_private_data, core.cdev);
+
+	/* To supply device private data to other methods of the driver, the
+	pcd core finds its part of it there */
+	filep->private_data = &pcdev_data->core;
+
+	/* check permissions */
+	ret = pcd_core_check_permission(pcdev_data->pdata.perm, filep->f_mode);
+	if(ret){
+		pr_debug("Minor %d refused f_mode 0x%x, permission is %x\n", minor_n, filep->f_mode, pcdev_data->pdata.perm);
+		pcd_stats_inc(pcdev_data, err_perm);
+	}
+	else{
+		if((pcdev_data->pdata.mode != PCD_MODE_FLAT) && (pcdev_data->pdata.mode != PCD_MODE_LOG))
+			nonseekable_open(p_inode, filep);
+		pcd_stats_inc(pcdev_data, opens);
+		/* Mappings hold the file, this covers them as well */
+		pcd_dev_get(pcdev_data);
+	}
+
+	trace_pcd_open(pcdev_data->core.devt, filep->f_mode, ret);
+	
+	return ret;
+}
+
+static int pcd_release(struct inode *p_inode, struct file *filep){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+
+	trace_pcd_release(pcdev_data->core.devt);
+	pcd_stats_inc(pcdev_data, releases);
+	pcd_dev_put(pcdev_data);
+	return 0;
+}
+
+/* A mapping holds on to the pages it maps, count it so that a resize
+can't free them. The first reference is taken in pcd_mmap() */
+static void pcd_vm_open(struct vm_area_struct *vma){
+	struct pcdev_private_data* pcdev_data = vma->vm_private_data;
+
+	atomic_inc(&pcdev_data->map_count);
+}
+
+static void pcd_vm_close(struct vm_area_struct *vma){
+	struct pcdev_private_data* pcdev_data = vma->vm_private_data;
+
+	atomic_dec(&pcdev_data->map_count);
+}
+
+/* Pages are handed to the mapping one at a time as they are touched */
+static vm_fault_t pcd_vm_fault(struct vm_fault *vmf){
+	struct pcdev_private_data* pcdev_data = vmf->vma->vm_private_data;
+	struct page *page;
+
+	if(vmf->pgoff >= pcdev_data->nr_pages)
+		return VM_FAULT_SIGBUS;
+
+	page = pcd_buf_get_page(pcdev_data, vmf->pgoff);
+	if(page == NULL)
+		return VM_FAULT_OOM;
+	get_page(page);
+
+	/* Writes through the mapping aren't seen one by one, a page of a
+	writable mapping counts as written as soon as it is mapped */
+	if(vmf->vma->vm_flags & VM_WRITE){
+		pcd_core_data_len_extend(&pcdev_data->core, min_t(size_t, pcdev_data->pdata.size, (size_t)(vmf->pgoff + 1) << PAGE_SHIFT));
+		pcd_mark_dirty(pcdev_data, (size_t)vmf->pgoff << PAGE_SHIFT, PAGE_SIZE);
+	}
+	vmf->page = page;
+	return 0;
+}
+
+static struct vm_operations_struct pcd_vm_ops = {
+	.open = pcd_vm_open,
+	.close = pcd_vm_close,
+	.fault = pcd_vm_fault,
+};
+
+static int pcd_mmap(struct file *filep, struct vm_area_struct *vma){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int ret = 0;
+
+	/* A compressed buffer has no pages that could be mapped, and stores
+	through a mapping would go past the CRCs of integrity mode */
+	if(pcdev_data->zs || pcdev_data->crcs)
+		return -ENODEV;
+
+	/* Buffer is shared device memory, private copies make no sense */
+	if(!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	/* Read only devices can't be mapped writable, not even later with mprotect */
+	if(pcdev_data->pdata.perm == RDONLY){
+		if(vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	/* The mapping must lie completely inside the device buffer. The check
+	and the map count go together under the lock, a resize either sees
+	the mapping or runs before the check */
+	down_read(&pcdev_data->core.lock);
+	if((vma->vm_pgoff >= pcdev_data->nr_pages) || ((len >> PAGE_SHIFT) > (pcdev_data->nr_pages - vma->vm_pgoff))){
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	/* Stores through a mapping can't be copied on write */
+	if(atomic_read(&pcdev_data->snapshots)){
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = pcdev_data;
+	vma->vm_ops = &pcd_vm_ops;
+	pcd_vm_open(vma);
+
+unlock:
+	up_read(&pcdev_data->core.lock);
+	return ret;
+}
+
+static ssize_t pcd_fifo_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_fifo *fifo = &pcdev_data->fifo;
+	
+	size_t max_data = pcdev_data->pdata.size;
+	size_t req = iov_iter_count(to);
+	size_t count = req;
+	size_t tail = 0, chunk;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if(!count)
+		return 0;
+
+	if(mutex_lock_interruptible(&fifo->lock)){
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	/* Sleep until a writer has put something in */
+	while(!fifo->fill){
+		mutex_unlock(&fifo->lock);
+
+		if(nonblock){
+			ret = -EAGAIN;
+			goto out;
+		}
+		if(wait_event_interruptible(fifo->readq, READ_ONCE(fifo->fill)) ||
+		   mutex_lock_interruptible(&fifo->lock)){
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+
+	/* Adjust the count, a short read returns what is stored right now */
+	tail = fifo->tail;
+	count = min(count, fifo->fill);
+
+	/* The data may wrap around the end of the buffer */
+	chunk = min(count, max_data - tail);
+	ret = pcd_buf_read(pcdev_data, tail, chunk, to);
+	if(ret == chunk)
+		ret += pcd_buf_read(pcdev_data, 0, count - chunk, to);
+
+	if(!ret){
+		mutex_unlock(&fifo->lock);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	/* Only what reached user space is consumed */
+	fifo->tail = (tail + ret) % max_data;
+	fifo->fill -= ret;
+
+	mutex_unlock(&fifo->lock);
+
+	/* Space was freed up, let the writers in */
+	wake_up_interruptible(&fifo->writeq);
+
+out:
+	trace_pcd_read(pcdev_data->core.devt, tail, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_READ, req, ret, start);
+	return ret;
+}
+
+static ssize_t pcd_fifo_write_iter(struct kiocb *iocb, struct iov_iter *from){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_fifo *fifo = &pcdev_data->fifo;
+	
+	size_t max_data = pcdev_data->pdata.size;
+	size_t req = iov_iter_count(from);
+	size_t count = req;
+	size_t head = 0, chunk;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if(!count)
+		return 0;
+
+	if(mutex_lock_interruptible(&fifo->lock)){
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	/* Sleep until a reader has made some room */
+	while(fifo->fill == max_data){
+		mutex_unlock(&fifo->lock);
+
+		if(nonblock){
+			ret = -EAGAIN;
+			goto out;
+		}
+		if(wait_event_interruptible(fifo->writeq, READ_ONCE(fifo->fill) != max_data) ||
+		   mutex_lock_interruptible(&fifo->lock)){
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+
+	/* Adjust the count, a short write stores what fits right now */
+	head = fifo->head;
+	count = min(count, max_data - fifo->fill);
+
+	/* The free space may wrap around the end of the buffer */
+	chunk = min(count, max_data - head);
+	ret = pcd_buf_write(pcdev_data, head, chunk, from);
+	if(ret == chunk && count > chunk){
+		ssize_t wrapped = pcd_buf_write(pcdev_data, 0, count - chunk, from);
+
+		if(wrapped > 0)
+			ret += wrapped;
+	}
+
+	if(ret <= 0){
+		mutex_unlock(&fifo->lock);
+		if(!ret)
+			ret = -EFAULT;
+		goto out;
+	}
+
+	fifo->head = (head + ret) % max_data;
+	fifo->fill += ret;
+
+	mutex_unlock(&fifo->lock);
+
+	/* New data is available, wake up the readers */
+	wake_up_interruptible(&fifo->readq);
+
+out:
+	trace_pcd_write(pcdev_data->core.devt, head, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_WRITE, req, ret, start);
+	return ret;
+}
+
+static __poll_t pcd_fifo_poll(struct file *filep, poll_table *wait){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_fifo *fifo = &pcdev_data->fifo;
+	
+	size_t fill;
+	__poll_t mask = 0;
+
+	poll_wait(filep, &fifo->readq, wait);
+	poll_wait(filep, &fifo->writeq, wait);
+
+	fill = READ_ONCE(fifo->fill);
+	if(fill)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if(fill < pcdev_data->pdata.size)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+/* PCD_MODE_SPSC: the buffer starts with a control page followed by the
+ring data. Producer and consumer normally both live in user space and
+only touch the mmap'ed pages. read() and write() are a consumer and a
+producer of the same protocol for processes that don't map the device.
+head and tail come from user space, they are only ever used masked and
+clamped to the ring size */
+static int pcd_spsc_init(struct pcdev_private_data *pcdev_data){
+	struct page *page;
+
+	/* The driver reads and writes the control page itself, it must have
+	a permanent kernel mapping */
+	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if(page == NULL)
+		return -ENOMEM;
+
+	pcdev_data->pages[0] = page;
+	pcdev_data->spsc = page_address(page);
+	pcdev_data->spsc->size = pcdev_data->pdata.size;
+	pcdev_data->spsc->data_offset = PAGE_SIZE;
+	return 0;
+}
+
+/* Bytes the consumer can take */
+static u32 pcd_spsc_avail(struct pcd_spsc_ctrl *ctrl, u32 size){
+	return min(smp_load_acquire(&ctrl->head) - READ_ONCE(ctrl->tail), size);
+}
+
+/* Bytes the producer can put in */
+static u32 pcd_spsc_space(struct pcd_spsc_ctrl *ctrl, u32 size){
+	return size - min(READ_ONCE(ctrl->head) - smp_load_acquire(&ctrl->tail), size);
+}
+
+static ssize_t pcd_spsc_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_spsc_ctrl *ctrl = pcdev_data->spsc;
+	struct pcd_fifo *fifo = &pcdev_data->fifo;
+	
+	u32 size = pcdev_data->pdata.size;
+	u32 tail = 0, off;
+	size_t req = iov_iter_count(to);
+	size_t count = req, chunk;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if(!count)
+		return 0;
+
+	if(mutex_lock_interruptible(&fifo->lock)){
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	/* Sleep until the producer has published something. The flag tells a
+	user space producer that it has to kick us with PCD_IOC_SPSC_WAKE */
+	while(!pcd_spsc_avail(ctrl, size)){
+		if(nonblock){
+			mutex_unlock(&fifo->lock);
+			ret = -EAGAIN;
+			goto out;
+		}
+		WRITE_ONCE(ctrl->consumer_waiting, 1);
+		smp_mb();
+		ret = wait_event_interruptible(fifo->readq, pcd_spsc_avail(ctrl, size));
+		WRITE_ONCE(ctrl->consumer_waiting, 0);
+		if(ret){
+			mutex_unlock(&fifo->lock);
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+
+	tail = READ_ONCE(ctrl->tail);
+	count = min_t(size_t, count, pcd_spsc_avail(ctrl, size));
+
+	/* The data may wrap around the end of the ring */
+	off = tail & (size - 1);
+	chunk = min_t(size_t, count, size - off);
+	ret = pcd_buf_read(pcdev_data, PAGE_SIZE + off, chunk, to);
+	if(ret == chunk && count > chunk)
+		ret += pcd_buf_read(pcdev_data, PAGE_SIZE, count - chunk, to);
+
+	/* The data is out before its space is handed back to the producer */
+	if(ret)
+		smp_store_release(&ctrl->tail, tail + ret);
+	mutex_unlock(&fifo->lock);
+
+	if(!ret){
+		ret = -EFAULT;
+		goto out;
+	}
+
+	wake_up_interruptible(&fifo->writeq);
+
+out:
+	trace_pcd_read(pcdev_data->core.devt, tail, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_READ, req, ret, start);
+	return ret;
+}
+
+static ssize_t pcd_spsc_write_iter(struct kiocb *iocb, struct iov_iter *from){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_spsc_ctrl *ctrl = pcdev_data->spsc;
+	struct pcd_fifo *fifo = &pcdev_data->fifo;
+	
+	u32 size = pcdev_data->pdata.size;
+	u32 head = 0, off;
+	size_t req = iov_iter_count(from);
+	size_t count = req, chunk;
+	bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if(!count)
+		return 0;
+
+	if(mutex_lock_interruptible(&pcdev_data->spsc_write_lock)){
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	/* Sleep until the consumer has made some room */
+	while(!pcd_spsc_space(ctrl, size)){
+		if(nonblock){
+			mutex_unlock(&pcdev_data->spsc_write_lock);
+			ret = -EAGAIN;
+			goto out;
+		}
+		WRITE_ONCE(ctrl->producer_waiting, 1);
+		smp_mb();
+		ret = wait_event_interruptible(fifo->writeq, pcd_spsc_space(ctrl, size));
+		WRITE_ONCE(ctrl->producer_waiting, 0);
+		if(ret){
+			mutex_unlock(&pcdev_data->spsc_write_lock);
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+	}
+
+	head = READ_ONCE(ctrl->head);
+	count = min_t(size_t, count, pcd_spsc_space(ctrl, size));
+
+	/* The free space may wrap around the end of the ring */
+	off = head & (size - 1);
+	chunk = min_t(size_t, count, size - off);
+	ret = pcd_buf_write(pcdev_data, PAGE_SIZE + off, chunk, from);
+	if(ret == chunk && count > chunk){
+		ssize_t wrapped = pcd_buf_write(pcdev_data, PAGE_SIZE, count - chunk, from);
+
+		if(wrapped > 0)
+			ret += wrapped;
+	}
+
+	/* The data is in before the consumer gets to see it */
+	if(ret > 0)
+		smp_store_release(&ctrl->head, head + ret);
+	mutex_unlock(&pcdev_data->spsc_write_lock);
+
+	if(ret <= 0){
+		if(!ret)
+			ret = -EFAULT;
+		goto out;
+	}
+
+	wake_up_interruptible(&fifo->readq);
+
+out:
+	trace_pcd_write(pcdev_data->core.devt, head, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_WRITE, req, ret, start);
+	return ret;
+}
+
+/* An mmap consumer goes to sleep here after setting consumer_waiting and
+finding the ring still empty, same for a producer and a full ring */
+static __poll_t pcd_spsc_poll(struct file *filep, poll_table *wait){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_spsc_ctrl *ctrl = pcdev_data->spsc;
+	
+	u32 size = pcdev_data->pdata.size;
+	__poll_t mask = 0;
+
+	poll_wait(filep, &pcdev_data->fifo.readq, wait);
+	poll_wait(filep, &pcdev_data->fifo.writeq, wait);
+
+	if(pcd_spsc_avail(ctrl, size))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if(pcd_spsc_space(ctrl, size))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+/* PCD_MODE_LOG: an append only log of records in a ring. The writer owns
+core.lock, readers share it and never change the log, so any number of
+them can follow it from their own position */
+
+/* Bytes a record of len bytes takes up in the ring and in the read buffer */
+static size_t pcd_log_reclen(size_t len){
+	return ALIGN(sizeof(struct pcd_log_rec) + len, PCD_LOG_ALIGN);
+}
+
+/* The smallest record is a one byte write, that bounds the number of
+records the ring can hold */
+static int pcd_log_init(struct pcdev_private_data *pcdev_data){
+	struct pcd_log *log = &pcdev_data->log;
+
+	log->nr_slots = pcdev_data->pdata.size / pcd_log_reclen(1);
+	log->index = kvcalloc(log->nr_slots, sizeof(*log->index), GFP_KERNEL);
+	if(log->index == NULL)
+		return -ENOMEM;
+	return 0;
+}
+
+/* Index slot of a sequence number, a plain % of the u64 needs a libgcc
+helper on 32 bit ARM */
+static struct pcd_log_slot* pcd_log_slot(struct pcd_log *log, u64 seq){
+	u32 idx;
+
+	div_u64_rem(seq, log->nr_slots, &idx);
+	return &log->index[idx];
+}
+
+/* Copies in and out of the ring, wrapping at its end */
+static ssize_t pcd_log_put(struct pcdev_private_data *pcdev_data, size_t off, size_t len, struct iov_iter *from){
+	size_t chunk = min_t(size_t, len, pcdev_data->pdata.size - off);
+	ssize_t ret, wrapped;
+
+	ret = pcd_buf_write(pcdev_data, off, chunk, from);
+	if(ret == chunk && len > chunk){
+		wrapped = pcd_buf_write(pcdev_data, 0, len - chunk, from);
+		if(wrapped < 0)
+			return wrapped;
+		ret += wrapped;
+	}
+	return ret;
+}
+
+static size_t pcd_log_get(struct pcdev_private_data *pcdev_data, size_t off, size_t len, struct iov_iter *to){
+	size_t chunk = min_t(size_t, len, pcdev_data->pdata.size - off);
+	size_t ret;
+
+	ret = pcd_buf_read(pcdev_data, off, chunk, to);
+	if(ret == chunk && len > chunk)
+		ret += pcd_buf_read(pcdev_data, 0, len - chunk, to);
+	return ret;
+}
+
+static ssize_t pcd_log_write_iter(struct kiocb *iocb, struct iov_iter *from){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_log *log = &pcdev_data->log;
+	static const char zeros[PCD_LOG_ALIGN];
+	struct pcd_log_slot *slot;
+	struct pcd_log_rec rec;
+	struct kvec kv;
+	struct iov_iter kiter;
+
+	size_t size = pcdev_data->pdata.size;
+	size_t req = iov_iter_count(from);
+	size_t reclen = pcd_log_reclen(req);
+	size_t head, pad;
+	u64 start = ktime_get_ns();
+	u64 seq = 0;
+	ssize_t ret;
+
+	if(!req)
+		return 0;
+
+	/* A record is never split, it has to fit into an empty ring */
+	if(reclen > size){
+		ret = -EMSGSIZE;
+		goto out;
+	}
+
+	down_write(&pcdev_data->core.lock);
+
+	/* Trim the oldest records until the new one fits. They are gone even
+	if the copy below faults, it may have overwritten them already */
+	while(size - log->fill < reclen){
+		slot = pcd_log_slot(log, log->first_seq);
+		log->fill -= slot->reclen;
+		log->first_seq++;
+	}
+
+	head = log->head;
+	seq = log->next_seq;
+	rec.seq = seq;
+	rec.len = req;
+	rec.reserved = 0;
+	kv.iov_base = &rec;
+	kv.iov_len = sizeof(rec);
+	iov_iter_kvec(&kiter, WRITE, &kv, 1, sizeof(rec));
+	ret = pcd_log_put(pcdev_data, head, sizeof(rec), &kiter);
+	if(ret == sizeof(rec))
+		ret = pcd_log_put(pcdev_data, (head + sizeof(rec)) % size, req, from);
+	if(ret != req){
+		if(ret >= 0)
+			ret = -EFAULT;
+		goto unlock;
+	}
+
+	/* Stale bytes of the ring must not show up in the padding */
+	pad = reclen - sizeof(rec) - req;
+	if(pad){
+		kv.iov_base = (void *)zeros;
+		kv.iov_len = pad;
+		iov_iter_kvec(&kiter, WRITE, &kv, 1, pad);
+		if(pcd_log_put(pcdev_data, (head + sizeof(rec) + req) % size, pad, &kiter) != pad){
+			ret = -ENOMEM;
+			goto unlock;
+		}
+	}
+
+	slot = pcd_log_slot(log, seq);
+	slot->off = head;
+	slot->reclen = reclen;
+	log->head = (head + reclen) % size;
+	log->fill += reclen;
+	log->next_seq = seq + 1;
+
+unlock:
+	up_write(&pcdev_data->core.lock);
+
+out:
+	trace_pcd_write(pcdev_data->core.devt, seq, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_WRITE, req, ret, start);
+	return ret;
+}
+
+/* Whole records from the sequence number at ki_pos on, as many as fit */
+static ssize_t pcd_log_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(iocb->ki_filp);
+	struct pcd_log *log = &pcdev_data->log;
+	struct pcd_log_slot *slot;
+
+	size_t req = iov_iter_count(to);
+	size_t done = 0;
+	loff_t pos = iocb->ki_pos;
+	u64 seq = pos;
+	u64 start = ktime_get_ns();
+	ssize_t ret = 0;
+
+	if(!req)
+		return 0;
+
+	down_read(&pcdev_data->core.lock);
+
+	if(seq < log->first_seq)
+		seq = log->first_seq;
+
+	for(; seq < log->next_seq; seq++){
+		slot = pcd_log_slot(log, seq);
+		if(slot->reclen > iov_iter_count(to)){
+			if(!done)
+				ret = -EINVAL;
+			break;
+		}
+		if(pcd_log_get(pcdev_data, slot->off, slot->reclen, to) != slot->reclen){
+			if(!done)
+				ret = -EFAULT;
+			break;
+		}
+		done += slot->reclen;
+	}
+
+	up_read(&pcdev_data->core.lock);
+
+	if(done){
+		ret = done;
+		iocb->ki_pos = seq;
+	}
+
+	trace_pcd_read(pcdev_data->core.devt, pos, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_READ, req, ret, start);
+	return ret;
+}
+
+/* The position is a sequence number. SEEK_DATA goes to the oldest record
+kept from off on, SEEK_HOLE and SEEK_END are relative to the next
+sequence number to be written */
+static loff_t pcd_log_lseek(struct file *filep, loff_t off, int whence){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_log *log = &pcdev_data->log;
+	loff_t first, next, tmp;
+
+	down_read(&pcdev_data->core.lock);
+	first = log->first_seq;
+	next = log->next_seq;
+	up_read(&pcdev_data->core.lock);
+
+	switch(whence){
+		case SEEK_SET:
+			tmp = off;
+			break;
+		case SEEK_CUR:
+			tmp = filep->f_pos + off;
+			break;
+		case SEEK_END:
+			tmp = next + off;
+			break;
+		case SEEK_DATA:
+			tmp = max(off, first);
+			if((off < 0) || (tmp >= next))
+				tmp = -ENXIO;
+			break;
+		case SEEK_HOLE:
+			tmp = ((off < 0) || (off >= next)) ? -ENXIO : next;
+			break;
+		default:
+			tmp = -EINVAL;
+	};
+
+	if(tmp >= 0)
+		filep->f_pos = tmp;
+	else if(tmp != -ENXIO)
+		tmp = -EINVAL;
+
+	trace_pcd_lseek(pcdev_data->core.devt, off, whence, tmp);
+	return tmp;
+}
+
+/* PCD_MODE_KV: a key-value store in the device buffer. All pages are
+allocated up front and mapped in one piece, the table is probed and the
+entries are copied without going through the page array. Lookups and
+walks share core.lock, puts and deletes own it */
+
+/* Heap bytes an entry of a key and a value takes */
+static size_t pcd_kv_entlen(u32 key_len, u32 val_len){
+	return ALIGN((size_t)key_len + val_len, 8);
+}
+
+/* One slot per 64 bytes of buffer puts a quarter of it into the table,
+the 16 byte slots pack four to a cache line so a probe seldom touches
+more than one line */
+static int pcd_kv_init(struct pcdev_private_data *pcdev_data){
+	struct pcd_kv_store *kv = &pcdev_data->kv;
+	unsigned long i;
+
+	for(i = 0; i < pcdev_data->nr_pages; i++){
+		pcdev_data->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if(pcdev_data->pages[i] == NULL)
+			return -ENOMEM;
+	}
+
+	kv->base = vmap(pcdev_data->pages, pcdev_data->nr_pages, VM_MAP, PAGE_KERNEL);
+	if(kv->base == NULL)
+		return -ENOMEM;
+
+	kv->slots = kv->base;
+	kv->nr_slots = rounddown_pow_of_two(pcdev_data->pdata.size / 64);
+	kv->heap = kv->nr_slots * sizeof(struct pcd_kv_slot);
+	kv->end = kv->heap;
+	kv->live = 0;
+	kv->count = 0;
+	kv->seed = get_random_u32();
+	return 0;
+}
+
+/* Keys are picked by user space, the seed keeps them from all landing on
+the same slot. 0 marks a free slot and is never a hash */
+static u32 pcd_kv_hash(struct pcd_kv_store *kv, const void *key, u32 len){
+	return jhash(key, len, kv->seed) ?: 1;
+}
+
+/* Slot holding key, or the free slot it would go to. The probe compares
+the hashes in the table, a key in the heap is only looked at when its
+hash and length match. The table is never more than 3/4 full, there is
+always a free slot to stop at */
+static struct pcd_kv_slot* pcd_kv_find(struct pcd_kv_store *kv, const void *key, u32 len, u32 hash){
+	u32 mask = kv->nr_slots - 1;
+	struct pcd_kv_slot *slot;
+	u32 i;
+
+	for(i = hash & mask; ; i = (i + 1) & mask){
+		slot = &kv->slots[i];
+		if(!slot->hash)
+			return slot;
+		if((slot->hash == hash) && (slot->key_len == len) && !memcmp(kv->base + slot->off, key, len))
+			return slot;
+	}
+}
+
+/* Move the entries down to the start of the heap, leaving the garbage of
+replaced and deleted ones behind them */
+static int pcd_kv_compact(struct pcd_kv_store *kv){
+	struct pcd_kv_slot *slot;
+	size_t pos = 0, len;
+	char *tmp;
+	u32 i;
+
+	if(kv->live){
+		tmp = kvmalloc(kv->live, GFP_KERNEL);
+		if(tmp == NULL)
+			return -ENOMEM;
+
+		for(i = 0; i < kv->nr_slots; i++){
+			slot = &kv->slots[i];
+			if(!slot->hash)
+				continue;
+			len = pcd_kv_entlen(slot->key_len, slot->val_len);
+			memcpy(tmp + pos, kv->base + slot->off, len);
+			slot->off = kv->heap + pos;
+			pos += len;
+		}
+		memcpy(kv->base + kv->heap, tmp, pos);
+		kvfree(tmp);
+	}
+
+	kv->end = kv->heap + pos;
+	return 0;
+}
+
+/* The new value always goes to fresh heap space and the slot is only
+switched over once it is copied in, so a fault keeps the old one */
+static ssize_t pcd_kv_put(struct pcdev_private_data *pcdev_data, const void *key, u32 key_len, const void __user *value, u32 val_len){
+	struct pcd_kv_store *kv = &pcdev_data->kv;
+	size_t size = pcdev_data->pdata.size;
+	u32 hash = pcd_kv_hash(kv, key, key_len);
+	struct pcd_kv_slot *slot;
+	size_t len, old = 0;
+	ssize_t ret = val_len;
+
+	/* Checked on its own first, the sum could wrap on 32 bit */
+	if((val_len > size - kv->heap) || (pcd_kv_entlen(key_len, val_len) > size - kv->heap))
+		return -ENOSPC;
+	len = pcd_kv_entlen(key_len, val_len);
+
+	down_write(&pcdev_data->core.lock);
+
+	slot = pcd_kv_find(kv, key, key_len, hash);
+	if(slot->hash)
+		old = pcd_kv_entlen(slot->key_len, slot->val_len);
+	else if(kv->count >= kv->nr_slots / 4 * 3){
+		ret = -ENOSPC;
+		goto unlock;
+	}
+
+	if(size - kv->end < len){
+		if(size - kv->heap - kv->live < len){
+			ret = -ENOSPC;
+			goto unlock;
+		}
+		ret = pcd_kv_compact(kv);
+		if(ret)
+			goto unlock;
+		ret = val_len;
+	}
+
+	memcpy(kv->base + kv->end, key, key_len);
+	if(copy_from_user(kv->base + kv->end + key_len, value, val_len)){
+		ret = -EFAULT;
+		goto unlock;
+	}
+
+	if(!slot->hash){
+		slot->hash = hash;
+		slot->key_len = key_len;
+		kv->count++;
+	}
+	slot->off = kv->end;
+	slot->val_len = val_len;
+	kv->end += len;
+	kv->live += len - old;
+
+unlock:
+	up_write(&pcdev_data->core.lock);
+	return ret;
+}
+
+/* Linear probing without tombstones: the keys behind the removed one are
+moved up into the hole as long as that doesn't put them before their
+home slot, so no probe ever has to step over deleted slots */
+static int pcd_kv_del(struct pcdev_private_data *pcdev_data, const void *key, u32 key_len){
+	struct pcd_kv_store *kv = &pcdev_data->kv;
+	u32 hash = pcd_kv_hash(kv, key, key_len);
+	u32 mask = kv->nr_slots - 1;
+	struct pcd_kv_slot *slot;
+	u32 i, j, home;
+	int ret = 0;
+
+	down_write(&pcdev_data->core.lock);
+
+	slot = pcd_kv_find(kv, key, key_len, hash);
+	if(!slot->hash){
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	kv->live -= pcd_kv_entlen(slot->key_len, slot->val_len);
+	kv->count--;
+
+	i = slot - kv->slots;
+	for(j = (i + 1) & mask; kv->slots[j].hash; j = (j + 1) & mask){
+		home = kv->slots[j].hash & mask;
+		if(((j - home) & mask) >= ((j - i) & mask)){
+			kv->slots[i] = kv->slots[j];
+			i = j;
+		}
+	}
+	memset(&kv->slots[i], 0, sizeof(kv->slots[i]));
+
+	/* Nothing left to keep, the heap starts over */
+	if(!kv->count)
+		kv->end = kv->heap;
+
+unlock:
+	up_write(&pcdev_data->core.lock);
+	return ret;
+}
+
+/* Copy only the value, size is the room at value. *val_len is set to the
+length of the value whenever the key is there, also when it doesn't fit */
+static ssize_t pcd_kv_get(struct pcdev_private_data *pcdev_data, const void *key, u32 key_len, void __user *value, u32 size, u32 *val_len){
+	struct pcd_kv_store *kv = &pcdev_data->kv;
+	u32 hash = pcd_kv_hash(kv, key, key_len);
+	struct pcd_kv_slot *slot;
+	ssize_t ret;
+
+	down_read(&pcdev_data->core.lock);
+
+	slot = pcd_kv_find(kv, key, key_len, hash);
+	if(!slot->hash){
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	*val_len = slot->val_len;
+	if(slot->val_len > size)
+		ret = -ENOSPC;
+	else if(copy_to_user(value, kv->base + slot->off + key_len, slot->val_len))
+		ret = -EFAULT;
+	else
+		ret = slot->val_len;
+
+unlock:
+	up_read(&pcdev_data->core.lock);
+	return ret;
+}
+
+/* Next key of a walk from slot it->cookie on */
+static int pcd_kv_iter(struct pcdev_private_data *pcdev_data, struct pcd_kv_iter *it){
+	struct pcd_kv_store *kv = &pcdev_data->kv;
+	struct pcd_kv_slot *slot = NULL;
+	u64 i;
+	int ret = 0;
+
+	down_read(&pcdev_data->core.lock);
+
+	for(i = it->cookie; i < kv->nr_slots; i++){
+		if(kv->slots[i].hash){
+			slot = &kv->slots[i];
+			break;
+		}
+	}
+	if(slot == NULL){
+		ret = -ENOENT;
+		goto unlock;
+	}
+
+	if(slot->key_len > it->key_len)
+		ret = -ENOSPC;
+	else if(copy_to_user(u64_to_user_ptr(it->key), kv->base + slot->off, slot->key_len))
+		ret = -EFAULT;
+	else
+		it->cookie = i + 1;
+	it->key_len = slot->key_len;
+	it->value_len = slot->val_len;
+
+unlock:
+	up_read(&pcdev_data->core.lock);
+	return ret;
+}
+
+/* PCD_IOC_KV_* of pcd_ioctl(). Lookups are accounted as reads of the
+value, puts as writes of it */
+static long pcd_kv_ioctl(struct file *filep, unsigned int cmd, void __user *argp){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_kv __user *uarg = argp;
+	u8 key[PCD_KV_KEY_MAX];
+	struct pcd_kv_iter it;
+	struct pcd_kv arg;
+	u64 start = ktime_get_ns();
+	u32 val_len = 0;
+	ssize_t ret;
+
+	if(pcdev_data->pdata.mode != PCD_MODE_KV)
+		return -EINVAL;
+
+	if(((cmd == PCD_IOC_KV_GET) || (cmd == PCD_IOC_KV_ITER)) && !(filep->f_mode & FMODE_READ))
+		return -EBADF;
+	if(((cmd == PCD_IOC_KV_PUT) || (cmd == PCD_IOC_KV_DEL)) && !(filep->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if(cmd == PCD_IOC_KV_ITER){
+		if(copy_from_user(&it, argp, sizeof(it)))
+			return -EFAULT;
+		ret = pcd_kv_iter(pcdev_data, &it);
+		if((ret == 0) || (ret == -ENOSPC))
+			if(copy_to_user(argp, &it, sizeof(it)))
+				return -EFAULT;
+		return ret;
+	}
+
+	if(copy_from_user(&arg, argp, sizeof(arg)))
+		return -EFAULT;
+	if(!arg.key_len || (arg.key_len > PCD_KV_KEY_MAX))
+		return -EINVAL;
+	if(copy_from_user(key, u64_to_user_ptr(arg.key), arg.key_len))
+		return -EFAULT;
+
+	switch(cmd){
+		case PCD_IOC_KV_GET:
+			ret = pcd_kv_get(pcdev_data, key, arg.key_len, u64_to_user_ptr(arg.value), arg.value_len, &val_len);
+			pcd_stats_account_io(pcdev_data, PCD_STAT_READ, arg.value_len, ret, start);
+			if((ret >= 0) || (ret == -ENOSPC))
+				if(put_user(val_len, &uarg->value_len))
+					return -EFAULT;
+			return ret < 0 ? ret : 0;
+		case PCD_IOC_KV_PUT:
+			ret = pcd_kv_put(pcdev_data, key, arg.key_len, u64_to_user_ptr(arg.value), arg.value_len);
+			pcd_stats_account_io(pcdev_data, PCD_STAT_WRITE, arg.value_len, ret, start);
+			return ret < 0 ? ret : 0;
+		default:
+			return pcd_kv_del(pcdev_data, key, arg.key_len);
+	};
+}
+
+static int pcd_dmabuf_attach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+	struct pcd_dmabuf_attachment *a;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if(a == NULL)
+		return -ENOMEM;
+
+	a->dev = attach->dev;
+	attach->priv = a;
+
+	mutex_lock(&buf->lock);
+	list_add(&a->node, &buf->attachments);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+static void pcd_dmabuf_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+	struct pcd_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	list_del(&a->node);
+	mutex_unlock(&buf->lock);
+	kfree(a);
+}
+
+static struct sg_table* pcd_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir){
+	struct pcd_dmabuf *buf = attach->dmabuf->priv;
+	struct pcd_dmabuf_attachment *a = attach->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if(sgt == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table_from_pages(sgt, buf->pages, buf->nr_pages, 0, buf->nr_pages << PAGE_SHIFT, GFP_KERNEL);
+	if(ret)
+		goto free;
+
+	sgt->nents = dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+	if(!sgt->nents){
+		ret = -EIO;
+		goto sg_free;
+	}
+
+	/* Remembered for the cache maintenance in begin/end_cpu_access */
+	mutex_lock(&buf->lock);
+	a->sgt = sgt;
+	a->dir = dir;
+	mutex_unlock(&buf->lock);
+	return sgt;
+
+sg_free:
+	sg_free_table(sgt);
+free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void pcd_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt, enum dma_data_direction dir){
+	struct pcd_dmabuf *buf = attach->dmabuf->priv;
+	struct pcd_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	a->sgt = NULL;
+	mutex_unlock(&buf->lock);
+
+	dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void pcd_dmabuf_release(struct dma_buf *dmabuf){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+	unsigned long i;
+
+	for(i = 0; i < buf->nr_pages; i++)
+		put_page(buf->pages[i]);
+	kvfree(buf->pages);
+
+	atomic_dec(&buf->pcdev_data->map_count);
+	pcd_dev_put(buf->pcdev_data);
+	kfree(buf);
+}
+
+/* The CPU is about to access the pages, pull in what the devices wrote */
+static int pcd_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+	struct pcd_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node)
+		if(a->sgt)
+			dma_sync_sg_for_cpu(a->dev, a->sgt->sgl, a->sgt->orig_nents, a->dir);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+/* The CPU is done, push its writes out to the devices */
+static int pcd_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+	struct pcd_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node)
+		if(a->sgt)
+			dma_sync_sg_for_device(a->dev, a->sgt->sgl, a->sgt->orig_nents, a->dir);
+	mutex_unlock(&buf->lock);
+	return 0;
+}
+
+static int pcd_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+
+	return vm_map_pages(vma, buf->pages, buf->nr_pages);
+}
+
+static void* pcd_dmabuf_vmap(struct dma_buf *dmabuf){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+
+	return vmap(buf->pages, buf->nr_pages, VM_MAP, PAGE_KERNEL);
+}
+
+static void pcd_dmabuf_vunmap(struct dma_buf *dmabuf, void *vaddr){
+	vunmap(vaddr);
+}
+
+static void* pcd_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page_num){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+
+	return kmap(buf->pages[page_num]);
+}
+
+static void pcd_dmabuf_kunmap(struct dma_buf *dmabuf, unsigned long page_num, void *vaddr){
+	struct pcd_dmabuf *buf = dmabuf->priv;
+
+	kunmap(buf->pages[page_num]);
+}
+
+static struct dma_buf_ops pcd_dmabuf_ops = {
+	.attach = pcd_dmabuf_attach,
+	.detach = pcd_dmabuf_detach,
+	.map_dma_buf = pcd_dmabuf_map,
+	.unmap_dma_buf = pcd_dmabuf_unmap,
+	.release = pcd_dmabuf_release,
+	.begin_cpu_access = pcd_dmabuf_begin_cpu_access,
+	.end_cpu_access = pcd_dmabuf_end_cpu_access,
+	.mmap = pcd_dmabuf_mmap,
+	.vmap = pcd_dmabuf_vmap,
+	.vunmap = pcd_dmabuf_vunmap,
+	.map = pcd_dmabuf_kmap,
+	.unmap = pcd_dmabuf_kunmap,
+};
+
+/* Export the buffer of a flat device as a dma-buf and return its fd. All
+pages are allocated up front, an importer needs real pages to map */
+static int pcd_export_dmabuf(struct file *filep, struct pcd_dmabuf_export *exp){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct pcd_dmabuf *buf;
+	struct dma_buf *dmabuf;
+	struct page *page;
+	unsigned long i = 0;
+	int ret;
+
+	if((pcdev_data->pdata.mode != PCD_MODE_FLAT) || pcdev_data->zs || pcdev_data->crcs)
+		return -EINVAL;
+
+	if(exp->flags & ~(O_CLOEXEC | O_ACCMODE))
+		return -EINVAL;
+
+	/* The dma-buf can't grant more than the fd it comes from */
+	if((exp->flags & O_ACCMODE) != O_RDONLY){
+		if(((exp->flags & O_ACCMODE) != O_RDWR) || !(filep->f_mode & FMODE_WRITE))
+			return -EACCES;
+	}
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if(buf == NULL)
+		return -ENOMEM;
+
+	buf->pcdev_data = pcdev_data;
+	mutex_init(&buf->lock);
+	INIT_LIST_HEAD(&buf->attachments);
+
+	/* Holding the lock keeps a resize from swapping the page array while
+	the pages are collected, the map count then keeps it away for as long
+	as the dma-buf exists */
+	down_write(&pcdev_data->core.lock);
+
+	/* Importers write without going through the driver either */
+	if(atomic_read(&pcdev_data->snapshots)){
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	buf->nr_pages = pcdev_data->nr_pages;
+	buf->pages = kvcalloc(buf->nr_pages, sizeof(*buf->pages), GFP_KERNEL);
+	if(buf->pages == NULL){
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	for(i = 0; i < buf->nr_pages; i++){
+		page = pcd_buf_get_page(pcdev_data, i);
+		if(page == NULL){
+			ret = -ENOMEM;
+			goto put_pages;
+		}
+		get_page(page);
+		buf->pages[i] = page;
+	}
+
+	exp_info.ops = &pcd_dmabuf_ops;
+	exp_info.size = buf->nr_pages << PAGE_SHIFT;
+	exp_info.flags = exp->flags & O_ACCMODE;
+	exp_info.priv = buf;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if(IS_ERR(dmabuf)){
+		ret = PTR_ERR(dmabuf);
+		goto put_pages;
+	}
+
+	/* From here on pcd_dmabuf_release() cleans up. The dma-buf can
+	outlive the platform device, it holds a reference on the device data */
+	atomic_inc(&pcdev_data->map_count);
+	pcd_dev_get(pcdev_data);
+	up_write(&pcdev_data->core.lock);
+
+	ret = dma_buf_fd(dmabuf, exp->flags & O_CLOEXEC);
+	if(ret < 0){
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+
+	exp->fd = ret;
+	return 0;
+
+put_pages:
+	while(i--)
+		put_page(buf->pages[i]);
+	kvfree(buf->pages);
+unlock:
+	up_write(&pcdev_data->core.lock);
+	kfree(buf);
+	return ret;
+}
+
+/* Check the pages of [pos, pos + count) of a snapshot of a device in
+integrity mode. The device's CRCs move on with its writes, the snapshot
+checks against its own copy */
+static int pcd_snapshot_check(struct pcd_snapshot *snap, size_t pos, size_t count){
+	struct pcdev_private_data *pcdev_data = snap->pcdev_data;
+	unsigned long idx, last;
+	struct page *page;
+
+	if(!snap->crcs || !count)
+		return 0;
+
+	last = (pos + count - 1) >> PAGE_SHIFT;
+	for(idx = pos >> PAGE_SHIFT; idx <= last; idx++){
+		page = snap->pages[idx];
+		if(page && (pcd_crc_page(pcdev_data, page) != snap->crcs[idx])){
+			pcd_stats_inc(pcdev_data, err_integrity);
+			pr_err_ratelimited("pcdev-%d snapshot CRC mismatch in the block at %lu\n", pcdev_data->id, idx << PAGE_SHIFT);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+/* Reads of a snapshot fd, the same rules as pcd_read_iter() against the
+size the device had when the snapshot was taken. No lock is needed, the
+snapshot's pages never change */
+static ssize_t pcd_snapshot_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	struct pcd_snapshot *snap = iocb->ki_filp->private_data;
+	struct pcdev_private_data *pcdev_data = snap->pcdev_data;
+	loff_t pos = iocb->ki_pos;
+	size_t req = iov_iter_count(to);
+	size_t count = req;
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if(pos >= snap->size){
+		ret = 0;
+		goto out;
+	}
+
+	if(count > snap->size - pos)
+		count = snap->size - pos;
+
+	ret = pcd_snapshot_check(snap, pos, count);
+	if(ret)
+		goto out;
+
+	ret = pcd_pages_read(snap->pages, pos, count, to);
+	if(!ret && count){
+		ret = -EFAULT;
+		goto out;
+	}
+	iocb->ki_pos += ret;
+
+out:
+	trace_pcd_read(pcdev_data->core.devt, pos, req, ret);
+	pcd_stats_account_io(pcdev_data, PCD_STAT_READ, req, ret, start);
+	return ret;
+}
+
+static loff_t pcd_snapshot_lseek(struct file *filep, loff_t off, int whence){
+	struct pcd_snapshot *snap = filep->private_data;
+
+	return generic_file_llseek_size(filep, off, whence, snap->size, snap->data_len);
+}
+
+static void pcd_snapshot_free(struct pcd_snapshot *snap){
+	unsigned long i;
+
+	for(i = 0; i < snap->nr_pages; i++)
+		if(snap->pages[i])
+			put_page(snap->pages[i]);
+	kvfree(snap->pages);
+	kvfree(snap->crcs);
+	kfree(snap);
+}
+
+static int pcd_snapshot_release(struct inode *p_inode, struct file *filep){
+	struct pcd_snapshot *snap = filep->private_data;
+	struct pcdev_private_data *pcdev_data = snap->pcdev_data;
+
+	pcd_snapshot_free(snap);
+	atomic_dec(&pcdev_data->snapshots);
+	pcd_dev_put(pcdev_data);
+	return 0;
+}
+
+/* file operations of a snapshot fd */
+static struct file_operations pcd_snapshot_fops = {
+	.owner = THIS_MODULE,
+	.read_iter = pcd_snapshot_read_iter,
+	.llseek = pcd_snapshot_lseek,
+	.release = pcd_snapshot_release,
+};
+
+/* PCD_IOC_SNAPSHOT, a read only fd on the buffer as it is right now.
+Taking it only takes a reference on every present page, writers copy a
+page the first time they change it after that */
+static int pcd_snapshot(struct file *filep){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_snapshot *snap;
+	unsigned long i;
+	int ret;
+
+	if((pcdev_data->pdata.mode != PCD_MODE_FLAT) || pcdev_data->zs)
+		return -EINVAL;
+
+	if(!(filep->f_mode & FMODE_READ))
+		return -EBADF;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if(snap == NULL)
+		return -ENOMEM;
+	snap->pcdev_data = pcdev_data;
+
+	/* Writers are out while the pages are collected, so the snapshot
+	never has half of a write */
+	down_write(&pcdev_data->core.lock);
+
+	/* Pages written through a mapping can't be copied on write */
+	if(atomic_read(&pcdev_data->map_count)){
+		up_write(&pcdev_data->core.lock);
+		kfree(snap);
+		return -EBUSY;
+	}
+
+	snap->pages = kvcalloc(pcdev_data->nr_pages, sizeof(*snap->pages), GFP_KERNEL);
+	if(snap->pages == NULL){
+		up_write(&pcdev_data->core.lock);
+		kfree(snap);
+		return -ENOMEM;
+	}
+	snap->nr_pages = pcdev_data->nr_pages;
+	snap->size = pcdev_data->pdata.size;
+	snap->data_len = pcdev_data->core.data_len;
+
+	if(pcdev_data->crcs){
+		snap->crcs = kvmalloc_array(snap->nr_pages, sizeof(*snap->crcs), GFP_KERNEL);
+		if(snap->crcs == NULL){
+			up_write(&pcdev_data->core.lock);
+			kvfree(snap->pages);
+			kfree(snap);
+			return -ENOMEM;
+		}
+		memcpy(snap->crcs, pcdev_data->crcs, snap->nr_pages * sizeof(*snap->crcs));
+	}
+
+	for(i = 0; i < snap->nr_pages; i++){
+		snap->pages[i] = pcdev_data->pages[i];
+		if(snap->pages[i])
+			get_page(snap->pages[i]);
+	}
+	atomic_inc(&pcdev_data->snapshots);
+
+	up_write(&pcdev_data->core.lock);
+
+	/* The fd can outlive the device */
+	pcd_dev_get(pcdev_data);
+	ret = anon_inode_getfd("[pcd-snapshot]", &pcd_snapshot_fops, snap, O_RDONLY | O_CLOEXEC);
+	if(ret < 0){
+		pcd_snapshot_free(snap);
+		atomic_dec(&pcdev_data->snapshots);
+		pcd_dev_put(pcdev_data);
+	}
+	return ret;
+}
+
+/* Descriptors are copied in and out this many at a time */
+#define PCD_BATCH_CHUNK 16
+
+/* Run one batch descriptor, the caller holds the device lock. Same rules
+as a pread/pwrite of the flat device */
+static ssize_t pcd_batch_op_locked(struct file *filep, struct pcd_batch_op *op){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	size_t max_data = pcdev_data->pdata.size;
+	struct iovec iov;
+	struct iov_iter iter;
+	size_t count;
+	ssize_t ret;
+
+	if(op->reserved)
+		return -EINVAL;
+
+	if(op->op == PCD_BATCH_READ){
+		if(!(filep->f_mode & FMODE_READ))
+			return -EBADF;
+		ret = import_single_range(READ, u64_to_user_ptr(op->buf), op->len, &iov, &iter);
+	}
+	else if(op->op == PCD_BATCH_WRITE){
+		if(!(filep->f_mode & FMODE_WRITE))
+			return -EBADF;
+		ret = import_single_range(WRITE, u64_to_user_ptr(op->buf), op->len, &iov, &iter);
+	}
+	else
+		return -EINVAL;
+	if(ret)
+		return ret;
+
+	count = iov_iter_count(&iter);
+	if(!count)
+		return 0;
+
+	if(op->offset >= max_data)
+		return (op->op == PCD_BATCH_WRITE) ? -ENOMEM : 0;
+
+	if(count > max_data - op->offset)
+		count = max_data - op->offset;
+
+	if(op->op == PCD_BATCH_READ){
+		ret = pcd_integrity_check(pcdev_data, op->offset, count);
+		if(ret)
+			return ret;
+		ret = pcd_buf_read(pcdev_data, op->offset, count, &iter);
+	}
+	else{
+		ret = pcd_buf_write(pcdev_data, op->offset, count, &iter);
+		if(ret > 0){
+			pcd_core_data_len_extend(&pcdev_data->core, op->offset + ret);
+			pcd_mark_dirty(pcdev_data, op->offset, ret);
+			pcd_integrity_update(pcdev_data, op->offset, ret);
+		}
+	}
+
+	if(!ret)
+		ret = -EFAULT;
+	return ret;
+}
+
+/* Run one descriptor, taking the lock for it unless the whole batch holds it */
+static void pcd_batch_run_op(struct file *filep, struct pcd_batch_op *op, bool locked){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	int dir = (op->op == PCD_BATCH_WRITE) ? PCD_STAT_WRITE : PCD_STAT_READ;
+	u64 start = ktime_get_ns();
+
+	if(locked)
+		op->result = pcd_batch_op_locked(filep, op);
+	else if(dir == PCD_STAT_WRITE){
+		down_write(&pcdev_data->core.lock);
+		op->result = pcd_batch_op_locked(filep, op);
+		up_write(&pcdev_data->core.lock);
+	}
+	else{
+		down_read(&pcdev_data->core.lock);
+		op->result = pcd_batch_op_locked(filep, op);
+		up_read(&pcdev_data->core.lock);
+	}
+
+	if(dir == PCD_STAT_WRITE)
+		trace_pcd_write(pcdev_data->core.devt, op->offset, op->len, op->result);
+	else
+		trace_pcd_read(pcdev_data->core.devt, op->offset, op->len, op->result);
+	pcd_stats_account_io(pcdev_data, dir, op->len, op->result, start);
+}
+
+/* PCD_IOC_BATCH, the descriptors and their results go through a small
+array on the stack so a batch of any length needs no allocation */
+static int pcd_batch(struct file *filep, void __user *argp){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_batch_op ops[PCD_BATCH_CHUNK];
+	struct pcd_batch_op __user *uops;
+	struct pcd_batch batch;
+	bool atomic;
+	u32 i, n, done;
+	int ret = 0;
+
+	if(pcdev_data->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+
+	if(copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+
+	if(batch.flags & ~PCD_BATCH_ATOMIC)
+		return -EINVAL;
+
+	if(batch.count > PCD_BATCH_MAX)
+		return -E2BIG;
+
+	uops = u64_to_user_ptr(batch.ops);
+	atomic = batch.flags & PCD_BATCH_ATOMIC;
+
+	/* Readers are locked out as well, they must not see the batch half
+	applied either */
+	if(atomic)
+		down_write(&pcdev_data->core.lock);
+
+	for(done = 0; done < batch.count; done += n){
+		n = min_t(u32, batch.count - done, PCD_BATCH_CHUNK);
+
+		if(copy_from_user(ops, uops + done, n * sizeof(ops[0]))){
+			ret = -EFAULT;
+			break;
+		}
+
+		for(i = 0; i < n; i++)
+			pcd_batch_run_op(filep, &ops[i], atomic);
+
+		if(copy_to_user(uops + done, ops, n * sizeof(ops[0]))){
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	if(atomic)
+		up_write(&pcdev_data->core.lock);
+
+	return ret;
+}
+
+/* Offsets found by PCD_IOC_SEARCH are copied out this many at a time */
+#define PCD_SEARCH_CHUNK 32
+
+/* State of a PCD_IOC_SEARCH. Two pages are kept mapped, idx & 1 picks
+the slot so a page and the one after it are there together for matches
+that cross into the next page */
+struct pcd_scan{
+	struct pcdev_private_data *pcdev_data;
+	struct page *page[2];	/* kmapped, NULL for unpacked pages */
+	void *vaddr[2];	/* NULL if the slot is empty */
+	unsigned long idx[2];
+	void *buf[2];	/* compressed devices unpack the pages here */
+	u64 __user *results;
+	u64 hits[PCD_SEARCH_CHUNK];
+	u32 nr_hits;	/* in hits, not copied out yet */
+	u32 done;	/* copied out */
+	u32 max;
+};
+
+static void pcd_scan_put(struct pcd_scan *scan, int s){
+	if(scan->page[s])
+		kunmap(scan->page[s]);
+	scan->page[s] = NULL;
+	scan->vaddr[s] = NULL;
+}
+
+/* Page idx in place, the zero page for pages never written. Returns NULL
+if a compressed page can't be unpacked */
+static const u8* pcd_scan_page(struct pcd_scan *scan, unsigned long idx){
+	struct pcdev_private_data *pcdev_data = scan->pcdev_data;
+	struct page *page;
+	int s = idx & 1;
+
+	if(scan->vaddr[s] && (scan->idx[s] == idx))
+		return scan->vaddr[s];
+
+	pcd_scan_put(scan, s);
+	cond_resched();
+
+	if(pcdev_data->zs){
+		if(pcd_z_copy_page(pcdev_data->zs, idx, scan->buf[s]))
+			return NULL;
+		scan->vaddr[s] = scan->buf[s];
+	}
+	else{
+		page = READ_ONCE(pcdev_data->pages[idx]);
+		scan->page[s] = page ? page : ZERO_PAGE(0);
+		scan->vaddr[s] = kmap(scan->page[s]);
+	}
+	scan->idx[s] = idx;
+	return scan->vaddr[s];
+}
+
+static int pcd_scan_flush(struct pcd_scan *scan){
+	if(copy_to_user(scan->results + scan->done, scan->hits, scan->nr_hits * sizeof(scan->hits[0])))
+		return -EFAULT;
+	scan->done += scan->nr_hits;
+	scan->nr_hits = 0;
+	return 0;
+}
+
+/* Record a match, returns 1 once max matches are found */
+static int pcd_scan_hit(struct pcd_scan *scan, u64 off){
+	int ret;
+
+	scan->hits[scan->nr_hits++] = off;
+	if((scan->nr_hits < PCD_SEARCH_CHUNK) && (scan->done + scan->nr_hits < scan->max))
+		return 0;
+	ret = pcd_scan_flush(scan);
+	if(ret)
+		return ret;
+	return scan->done == scan->max;
+}
+
+/* Matches of pattern starting in [pos, end - len]. memchr() finds the
+candidates for the first byte a word at a time, the rest of the pattern
+is only compared at those */
+static int pcd_scan_bytes(struct pcd_scan *scan, u64 pos, u64 end, const u8 *pattern, u32 len, u64 *next){
+	u64 last = end - len;
+	const u8 *vaddr, *p, *nv;
+	size_t off, n, in_page;
+	int ret;
+
+	for(; pos <= last; pos++){
+		vaddr = pcd_scan_page(scan, pos >> PAGE_SHIFT);
+		if(vaddr == NULL)
+			return -EIO;
+		off = offset_in_page(pos);
+		n = min_t(u64, PAGE_SIZE - off, last - pos + 1);
+		p = memchr(vaddr + off, pattern[0], n);
+		if(p == NULL){
+			/* The loop adds the last one */
+			pos += n - 1;
+			continue;
+		}
+		pos += p - (vaddr + off);
+
+		in_page = min_t(size_t, len, PAGE_SIZE - offset_in_page(pos));
+		if(memcmp(p, pattern, in_page))
+			continue;
+		if(in_page < len){
+			nv = pcd_scan_page(scan, (pos >> PAGE_SHIFT) + 1);
+			if(nv == NULL)
+				return -EIO;
+			if(memcmp(nv, pattern + in_page, len - in_page))
+				continue;
+		}
+
+		ret = pcd_scan_hit(scan, pos);
+		if(ret){
+			*next = pos + 1;
+			return ret < 0 ? ret : 0;
+		}
+	}
+	*next = end;
+	return 0;
+}
+
+/* Fields of width bytes at pos, pos + stride and so on that equal value.
+They are aligned to their width, none of them crosses a page */
+static int pcd_scan_fields(struct pcd_scan *scan, u64 pos, u64 end, u32 width, u32 stride, u32 value, u64 *next){
+	const u8 *vaddr;
+	u32 v;
+	int ret;
+
+	for(; (pos < end) && (end - pos >= width); pos += stride){
+		vaddr = pcd_scan_page(scan, pos >> PAGE_SHIFT);
+		if(vaddr == NULL)
+			return -EIO;
+		vaddr += offset_in_page(pos);
+
+		if(width == 1)
+			v = *vaddr;
+		else if(width == 2)
+			v = *(const u16 *)vaddr;
+		else
+			v = *(const u32 *)vaddr;
+		if(v != value)
+			continue;
+
+		ret = pcd_scan_hit(scan, pos);
+		if(ret){
+			*next = pos + stride;
+			return ret < 0 ? ret : 0;
+		}
+	}
+	*next = end;
+	return 0;
+}
+
+/* PCD_IOC_SEARCH: nothing but the offsets of the matches leaves the
+kernel. Readers share the lock with the search, a write waits for it */
+static int pcd_search(struct file *filep, void __user *argp){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_scan scan = { .pcdev_data = pcdev_data };
+	u8 pattern[PCD_SEARCH_PATTERN_MAX];
+	struct pcd_search req;
+	u32 width = 0;
+	u64 end, next;
+	int ret;
+
+	if(pcdev_data->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+
+	if(!(filep->f_mode & FMODE_READ))
+		return -EBADF;
+
+	if(copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	if(!req.max_results)
+		return -EINVAL;
+
+	switch(req.type){
+		case PCD_SEARCH_BYTES:
+			if(!req.pattern_len || (req.pattern_len > PCD_SEARCH_PATTERN_MAX))
+				return -EINVAL;
+			if(copy_from_user(pattern, u64_to_user_ptr(req.pattern), req.pattern_len))
+				return -EFAULT;
+			break;
+		case PCD_SEARCH_U8:
+			width = 1;
+			break;
+		case PCD_SEARCH_U16:
+			width = 2;
+			break;
+		case PCD_SEARCH_U32:
+			width = 4;
+			break;
+		default:
+			return -EINVAL;
+	};
+
+	if(width){
+		/* width is a power of two, a u64 % is a libgcc call on 32 bit ARM */
+		if(!req.stride || (req.stride & (width - 1)) || (req.offset & (width - 1)) ||
+		   ((width < 4) && (req.value >> (width * 8))))
+			return -EINVAL;
+
+		/* Every byte is a field, that is a one byte pattern */
+		if(req.stride == 1){
+			pattern[0] = req.value;
+			req.pattern_len = 1;
+			width = 0;
+		}
+	}
+
+	if(pcdev_data->zs){
+		scan.buf[0] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		scan.buf[1] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if(!scan.buf[0] || !scan.buf[1]){
+			ret = -ENOMEM;
+			goto free;
+		}
+	}
+	scan.results = u64_to_user_ptr(req.results);
+	scan.max = req.max_results;
+
+	down_read(&pcdev_data->core.lock);
+
+	end = pcdev_data->core.size;
+	if(req.offset > end)
+		req.offset = end;
+	if(req.length && (req.length < end - req.offset))
+		end = req.offset + req.length;
+	next = end;
+
+	ret = pcd_integrity_check(pcdev_data, req.offset, end - req.offset);
+	if(ret)
+		goto unlock;
+
+	if(width)
+		ret = pcd_scan_fields(&scan, req.offset, end, width, req.stride, req.value, &next);
+	else if(end - req.offset >= req.pattern_len)
+		ret = pcd_scan_bytes(&scan, req.offset, end, pattern, req.pattern_len, &next);
+	if(!ret && scan.nr_hits)
+		ret = pcd_scan_flush(&scan);
+
+unlock:
+	pcd_scan_put(&scan, 0);
+	pcd_scan_put(&scan, 1);
+	up_read(&pcdev_data->core.lock);
+
+	if(!ret){
+		req.nr_results = scan.done;
+		req.next = next;
+		if(copy_to_user(argp, &req, sizeof(req)))
+			ret = -EFAULT;
+	}
+
+free:
+	kfree(scan.buf[0]);
+	kfree(scan.buf[1]);
+	return ret;
+}
+
+/* Check that [off, off + len) is inside the buffer, the caller holds the
+lock so the size can't change */
+static int pcd_bulk_range(struct pcdev_private_data *pcdev_data, u64 off, u64 len){
+	size_t size = pcdev_data->core.size;
+
+	if((off > size) || (len > size - off))
+		return -EINVAL;
 	return 0;
 }
 
-ssize_t pcd_read(struct file *filep, char __user *buffer, size_t count, loff_t *f_pos){
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data *)filep->private_data;
-	
-	int max_data = pcdev_data->pdata.size;
-	pr_info("Read requested for %zu bytes\n", count);
-	pr_info("Initial file position = %lld\n", *f_pos);
-	
-	/* Adjust the count */
-	if((*f_pos + count) > max_data)
-		count = max_data - *f_pos;
+/* Write len bytes at pos of dst the way write() would, keeping the dirty
+bits, the CRCs and the end of the data up to date */
+static int pcd_bulk_write(struct pcdev_private_data *dst, size_t pos, size_t len, struct iov_iter *from){
+	ssize_t ret;
 
-	/* Copy to user */
-	if(copy_to_user(buffer, &pcdev_data->buffer[*f_pos], count)){
-		return -EFAULT;
+	ret = pcd_backend_write(&dst->core, pos, len, from);
+	if(ret > 0)
+		pcd_core_data_len_extend(&dst->core, pos + ret);
+	if(ret < 0)
+		return ret;
+	return ret == len ? 0 : -ENOMEM;
+}
+
+/* Copy len bytes at spos of src to dpos of dst, the source range is
+within one page. An uncompressed source page is written to dst straight
+from where it is, otherwise the bytes go through bounce. Within a device
+the ranges may overlap, that always takes the bounce buffer */
+static int pcd_bulk_copy_chunk(struct pcdev_private_data *dst, size_t dpos, struct pcdev_private_data *src, size_t spos, size_t len, void *bounce){
+	struct iov_iter iter;
+	struct bio_vec bv;
+	struct page *page;
+	struct kvec kv;
+	int ret;
+
+	ret = pcd_integrity_check(src, spos, len);
+	if(ret)
+		return ret;
+
+	if((src != dst) && !src->zs){
+		page = READ_ONCE(src->pages[spos >> PAGE_SHIFT]);
+		bv.bv_page = page ? page : ZERO_PAGE(0);
+		bv.bv_offset = offset_in_page(spos);
+		bv.bv_len = len;
+		iov_iter_bvec(&iter, WRITE, &bv, 1, len);
 	}
-	
-	/* Uodate the current file position */
-	*f_pos += count;
-	
-	pr_info("Number of bytes successfully read is %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
-	
-	/* Return numbe rof bytes successfully read */
-	return count;
+	else{
+		kv.iov_base = bounce;
+		kv.iov_len = len;
+		iov_iter_kvec(&iter, READ, &kv, 1, len);
+		ret = pcd_buf_read(src, spos, len, &iter);
+		if(ret < 0)
+			return ret;
+		if(ret != len)
+			return -EIO;
+		iov_iter_kvec(&iter, WRITE, &kv, 1, len);
+	}
+
+	return pcd_bulk_write(dst, dpos, len, &iter);
 }
 
-ssize_t pcd_write(struct file *filep, const char __user *buffer, size_t count, loff_t *f_pos){
-	struct pcdev_private_data* pcdev_data = (struct pcdev_private_data *)filep->private_data;
-	
-	int max_data = pcdev_data->pdata.size;
-	
-	pr_info("Write requested for %zu bytes\n", count);
-	pr_info("Initial file position = %lld\n", *f_pos); 
+/* memmove() from src to dst. The chunks follow the source pages, when
+the destination is above an overlapping source the copy runs from the
+end down so no byte is overwritten before it is copied */
+static int pcd_bulk_copy(struct pcdev_private_data *dst, u64 dpos, struct pcdev_private_data *src, u64 spos, u64 len, void *bounce){
+	bool down = (src == dst) && (dpos > spos) && (dpos - spos < len);
+	size_t chunk;
+	u64 done;
+	int ret = 0;
 
-	if((*f_pos + count) > max_data || (count < 0)){
-		count = max_data - *f_pos;
+	for(done = 0; !ret && (done < len); done += chunk){
+		if(down){
+			chunk = min_t(u64, len - done, offset_in_page(spos + len - done - 1) + 1);
+			ret = pcd_bulk_copy_chunk(dst, dpos + len - done - chunk, src, spos + len - done - chunk, chunk, bounce);
+		}
+		else{
+			chunk = min_t(u64, len - done, PAGE_SIZE - offset_in_page(spos + done));
+			ret = pcd_bulk_copy_chunk(dst, dpos + done, src, spos + done, chunk, bounce);
+		}
+		cond_resched();
 	}
+	return ret;
+}
+
+/* PCD_IOC_FILL. Pages that were never written already read as zeros, a
+zero fill leaves them alone instead of allocating them */
+static int pcd_fill(struct file *filep, void __user *argp){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_fill req;
+	struct iov_iter iter;
+	struct kvec kv;
+	size_t chunk;
+	u64 start = ktime_get_ns();
+	u64 pos;
+	void *buf;
+	int ret;
+
+	if(pcdev_data->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+	if(!(filep->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if(req.reserved)
+		return -EINVAL;
+	if(req.value > 0xff)
+		return -EINVAL;
 
-	if(!count){
-		pr_warning("No space remaining on device to write new bytes\n");
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if(buf == NULL)
 		return -ENOMEM;
+	memset(buf, req.value, PAGE_SIZE);
+
+	down_write(&pcdev_data->core.lock);
+
+	ret = pcd_bulk_range(pcdev_data, req.offset, req.length);
+	for(pos = req.offset; !ret && (pos < req.offset + req.length); pos += chunk){
+		chunk = min_t(u64, req.offset + req.length - pos, PAGE_SIZE - offset_in_page(pos));
+		if(!req.value && !pcdev_data->zs && !READ_ONCE(pcdev_data->pages[pos >> PAGE_SHIFT]))
+			continue;
+		kv.iov_base = buf;
+		kv.iov_len = chunk;
+		iov_iter_kvec(&iter, WRITE, &kv, 1, chunk);
+		ret = pcd_bulk_write(pcdev_data, pos, chunk, &iter);
+		cond_resched();
 	}
-	
-	if(copy_from_user(&pcdev_data->buffer[*f_pos], buffer, count)){
+
+	up_write(&pcdev_data->core.lock);
+	kfree(buf);
+
+	pcd_stats_account_io(pcdev_data, PCD_STAT_WRITE, req.length, ret ? ret : req.length, start);
+	return ret;
+}
+
+/* PCD_IOC_MOVE, within the device */
+static int pcd_move(struct file *filep, void __user *argp){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	struct pcd_move req;
+	u64 start = ktime_get_ns();
+	void *bounce;
+	int ret;
+
+	if(pcdev_data->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+	if((filep->f_mode & (FMODE_READ | FMODE_WRITE)) != (FMODE_READ | FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&req, argp, sizeof(req)))
 		return -EFAULT;
-	}
-	*f_pos += count;
 
-	pr_info("Number of bytes successfully written = %zu\n", count);
-	pr_info("Updated file position = %lld\n", *f_pos);
+	bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if(bounce == NULL)
+		return -ENOMEM;
 
-	return count;
+	down_write(&pcdev_data->core.lock);
+	ret = pcd_bulk_range(pcdev_data, req.src_offset, req.length);
+	if(!ret)
+		ret = pcd_bulk_range(pcdev_data, req.dst_offset, req.length);
+	if(!ret && (req.src_offset != req.dst_offset))
+		ret = pcd_bulk_copy(pcdev_data, req.dst_offset, pcdev_data, req.src_offset, req.length, bounce);
+	up_write(&pcdev_data->core.lock);
+	kfree(bounce);
+
+	pcd_stats_account_io(pcdev_data, PCD_STAT_WRITE, req.length, ret ? ret : req.length, start);
+	return ret;
 }
 
-int check_permission(int perm, int mode){
-	if(perm == RDWR){
-		return 0;
+/* PCD_IOC_COPY, from the device of src_fd into this one. Two copies
+running in opposite directions take the locks of the same two devices,
+they are always taken in the order of the devices' addresses so the
+copies can't deadlock. Lockdep sees both in one class, the second one is
+taken nested */
+static int pcd_copy(struct file *filep, void __user *argp){
+	struct pcdev_private_data* dst = pcd_file_data(filep);
+	struct pcdev_private_data* src;
+	struct pcd_copy req;
+	u64 start = ktime_get_ns();
+	void *bounce = NULL;
+	struct fd f;
+	int ret;
+
+	if(dst->pdata.mode != PCD_MODE_FLAT)
+		return -EINVAL;
+	if(!(filep->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if(copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if(req.reserved)
+		return -EINVAL;
+
+	f = fdget(req.src_fd);
+	if(!f.file)
+		return -EBADF;
+
+	/* Only devices of this driver, flat ones, opened for reading */
+	if(f.file->f_op->open != pcd_open){
+		ret = -EINVAL;
+		goto put;
 	}
-	else if(perm == RDONLY){
-		if((mode & FMODE_READ) && !(mode & FMODE_WRITE)){
-			return 0;
-		}
+	src = pcd_file_data(f.file);
+	if(src->pdata.mode != PCD_MODE_FLAT){
+		ret = -EINVAL;
+		goto put;
 	}
-	else if(perm == WRONLY){
-		if(!(mode & FMODE_READ) && (mode & FMODE_WRITE)){
-			return 0;
-		}
+	if(!(f.file->f_mode & FMODE_READ)){
+		ret = -EBADF;
+		goto put;
 	}
-	return -EPERM;
-}
 
-int pcd_open(struct inode *p_inode, struct file *filep){
-	int ret, minor_n;
-	struct pcdev_private_data* pcdev_data;
+	if((src == dst) || src->zs){
+		bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if(bounce == NULL){
+			ret = -ENOMEM;
+			goto put;
+		}
+	}
 
-	/* Find out which device file open was attempted by the uer space */
-	minor_n = MINOR(p_inode->i_rdev);
-	pr_info("Minor access = %d\n", minor_n);
-	
-	/* Get device's private data structure */
-	pcdev_data = container_of(p_inode->i_cdev, struct pcdev_private_data, cdev);
+	if(src == dst)
+		down_write(&dst->core.lock);
+	else if(dst < src){
+		down_write(&dst->core.lock);
+		down_read_nested(&src->core.lock, SINGLE_DEPTH_NESTING);
+	}
+	else{
+		down_read(&src->core.lock);
+		down_write_nested(&dst->core.lock, SINGLE_DEPTH_NESTING);
+	}
 
-	/* To supply device private data to other methods of the driver */
-	filep->private_data = pcdev_data;
+	ret = pcd_bulk_range(src, req.src_offset, req.length);
+	if(!ret)
+		ret = pcd_bulk_range(dst, req.dst_offset, req.length);
+	if(!ret && ((src != dst) || (req.src_offset != req.dst_offset)))
+		ret = pcd_bulk_copy(dst, req.dst_offset, src, req.src_offset, req.length, bounce);
 
-	pr_info("permission is %x\n", pcdev_data->pdata.perm);
-	/* check permissions */
-	ret = check_permission(pcdev_data->pdata.perm, filep->f_mode);
+	up_write(&dst->core.lock);
+	if(src != dst)
+		up_read(&src->core.lock);
 
-	(!ret) ? pr_info("Open was successful\n") : pr_info("Open was unsuccessfull\n");
-	
+	pcd_stats_account_io(dst, PCD_STAT_WRITE, req.length, ret ? ret : req.length, start);
+	kfree(bounce);
+put:
+	fdput(f);
 	return ret;
 }
 
-int pcd_release(struct inode *p_inode, struct file *filep){
-	pr_info("Close was successful\n");
-	return 0;
+static long pcd_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+	struct pcdev_private_data* pcdev_data = pcd_file_data(filep);
+	void __user *argp = (void __user *)arg;
+	struct pcd_dmabuf_export exp;
+	struct pcd_verify verify;
+	u64 size;
+	int ret;
+
+	switch(cmd){
+		case PCD_IOC_GET_SIZE:
+			size = READ_ONCE(pcdev_data->pdata.size);
+			if(copy_to_user(argp, &size, sizeof(size)))
+				return -EFAULT;
+			return 0;
+		case PCD_IOC_RESIZE:
+			if(!(filep->f_mode & FMODE_WRITE))
+				return -EBADF;
+			if(copy_from_user(&size, argp, sizeof(size)))
+				return -EFAULT;
+			return pcd_resize(pcdev_data, size);
+		case PCD_IOC_EXPORT_DMABUF:
+			if(copy_from_user(&exp, argp, sizeof(exp)))
+				return -EFAULT;
+			ret = pcd_export_dmabuf(filep, &exp);
+			if(ret)
+				return ret;
+			/* The fd is already installed, user space owns it now */
+			if(copy_to_user(argp, &exp, sizeof(exp)))
+				return -EFAULT;
+			return 0;
+		case PCD_IOC_BATCH:
+			return pcd_batch(filep, argp);
+		case PCD_IOC_SNAPSHOT:
+			return pcd_snapshot(filep);
+		case PCD_IOC_VERIFY:
+			ret = pcd_integrity_verify(pcdev_data, &verify);
+			if(ret)
+				return ret;
+			if(copy_to_user(argp, &verify, sizeof(verify)))
+				return -EFAULT;
+			return 0;
+		case PCD_IOC_CHECKPOINT:
+			return pcd_checkpoint(pcdev_data);
+		case PCD_IOC_SPSC_WAKE:
+			if(pcdev_data->pdata.mode != PCD_MODE_SPSC)
+				return -EINVAL;
+			wake_up_interruptible(&pcdev_data->fifo.readq);
+			wake_up_interruptible(&pcdev_data->fifo.writeq);
+			return 0;
+		case PCD_IOC_SEARCH:
+			return pcd_search(filep, argp);
+		case PCD_IOC_FILL:
+			return pcd_fill(filep, argp);
+		case PCD_IOC_MOVE:
+			return pcd_move(filep, argp);
+		case PCD_IOC_COPY:
+			return pcd_copy(filep, argp);
+		case PCD_IOC_KV_GET:
+		case PCD_IOC_KV_PUT:
+		case PCD_IOC_KV_DEL:
+		case PCD_IOC_KV_ITER:
+			return pcd_kv_ioctl(filep, cmd, argp);
+		default:
+			return -ENOTTY;
+	};
+}
+
+#ifdef CONFIG_COMPAT
+/* All commands take a pointer to fixed size data, only the pointer needs
+to be converted */
+static long pcd_compat_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+	return pcd_ioctl(filep, cmd, (unsigned long)compat_ptr(arg));
 }
+#else
+#define pcd_compat_ioctl NULL
+#endif
 
 /* struct to hold the file operations of the driver */
-struct file_operations pcd_fops = {
+static struct file_operations pcd_fops = {
+	.open = pcd_open,
+	.write_iter = pcd_core_write_iter,
+	.read_iter = pcd_core_read_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.release = pcd_release,
+	.llseek = pcd_core_lseek,
+	.mmap = pcd_mmap,
+	.unlocked_ioctl = pcd_ioctl,
+	.compat_ioctl = pcd_compat_ioctl,
+};
+
+/* file operations of a device in PCD_MODE_FIFO */
+static struct file_operations pcd_fifo_fops = {
+	.open = pcd_open,
+	.write_iter = pcd_fifo_write_iter,
+	.read_iter = pcd_fifo_read_iter,
+	.poll = pcd_fifo_poll,
+	.release = pcd_release,
+	.llseek = no_llseek,
+	.unlocked_ioctl = pcd_ioctl,
+	.compat_ioctl = pcd_compat_ioctl,
+};
+
+/* file operations of a device in PCD_MODE_SHARD */
+static struct file_operations pcd_shard_fops = {
+	.open = pcd_open,
+	.write_iter = pcd_shard_write_iter,
+	.read_iter = pcd_shard_read_iter,
+	.poll = pcd_shard_poll,
+	.release = pcd_release,
+	.llseek = no_llseek,
+	.unlocked_ioctl = pcd_ioctl,
+	.compat_ioctl = pcd_compat_ioctl,
+};
+
+/* file operations of a device in PCD_MODE_LOG */
+static struct file_operations pcd_log_fops = {
+	.open = pcd_open,
+	.write_iter = pcd_log_write_iter,
+	.read_iter = pcd_log_read_iter,
+	.release = pcd_release,
+	.llseek = pcd_log_lseek,
+	.unlocked_ioctl = pcd_ioctl,
+	.compat_ioctl = pcd_compat_ioctl,
+};
+
+/* file operations of a device in PCD_MODE_KV, it has no byte stream to
+read or write */
+static struct file_operations pcd_kv_fops = {
+	.open = pcd_open,
+	.release = pcd_release,
+	.llseek = no_llseek,
+	.unlocked_ioctl = pcd_ioctl,
+	.compat_ioctl = pcd_compat_ioctl,
+};
+
+/* file operations of a device in PCD_MODE_SPSC */
+static struct file_operations pcd_spsc_fops = {
 	.open = pcd_open,
-	.write = pcd_write,
-	.read = pcd_read,
+	.write_iter = pcd_spsc_write_iter,
+	.read_iter = pcd_spsc_read_iter,
+	.poll = pcd_spsc_poll,
 	.release = pcd_release,
-	.llseek = pcd_lseek,
+	.llseek = no_llseek,
+	.mmap = pcd_mmap,
+	.unlocked_ioctl = pcd_ioctl,
+	.compat_ioctl = pcd_compat_ioctl,
+};
+
+/* sysfs attributes of the pcdev-N devices, one usage counter per file */
+#define PCD_STAT_ATTR(_name, _value)							\
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf){	\
+	struct pcdev_private_data *pcdev_data = dev_get_drvdata(dev);			\
+	struct pcd_counters cnt;							\
+	u64 open_handles;								\
+											\
+	pcd_stats_get(pcdev_data, &cnt, &open_handles);				\
+	return sprintf(buf, "%llu\n", (unsigned long long)(_value));			\
+}											\
+DEVICE_ATTR_RO(_name)
+
+PCD_STAT_ATTR(bytes_read, cnt.bytes[PCD_STAT_READ]);
+PCD_STAT_ATTR(bytes_written, cnt.bytes[PCD_STAT_WRITE]);
+PCD_STAT_ATTR(reads, cnt.ops[PCD_STAT_READ]);
+PCD_STAT_ATTR(writes, cnt.ops[PCD_STAT_WRITE]);
+PCD_STAT_ATTR(short_reads, cnt.short_ops[PCD_STAT_READ]);
+PCD_STAT_ATTR(short_writes, cnt.short_ops[PCD_STAT_WRITE]);
+PCD_STAT_ATTR(err_nomem, cnt.err_nomem);
+PCD_STAT_ATTR(err_fault, cnt.err_fault);
+PCD_STAT_ATTR(err_perm, cnt.err_perm);
+PCD_STAT_ATTR(err_integrity, cnt.err_integrity);
+PCD_STAT_ATTR(open_handles, open_handles);
+
+/* Buffer size, writing it resizes the buffer like PCD_IOC_RESIZE */
+static ssize_t size_show(struct device *dev, struct device_attribute *attr, char *buf){
+	struct pcdev_private_data *pcdev_data = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(pcdev_data->pdata.size));
+}
+
+static ssize_t size_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+	struct pcdev_private_data *pcdev_data = dev_get_drvdata(dev);
+	u64 size;
+	int ret;
+
+	ret = kstrtou64(buf, 0, &size);
+	if(ret)
+		return ret;
+
+	ret = pcd_resize(pcdev_data, size);
+	return ret ? ret : count;
+}
+
+DEVICE_ATTR_RW(size);
+
+/* How long the probe of the device took */
+static ssize_t probe_time_ns_show(struct device *dev, struct device_attribute *attr, char *buf){
+	struct pcdev_private_data *pcdev_data = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%llu\n", (unsigned long long)pcdev_data->probe_ns);
+}
+
+DEVICE_ATTR_RO(probe_time_ns);
+
+/* Memory the buffer contents take up, whole pages or compressed chunks */
+static ssize_t stored_bytes_show(struct device *dev, struct device_attribute *attr, char *buf){
+	struct pcdev_private_data *pcdev_data = dev_get_drvdata(dev);
+	size_t stored = 0;
+	unsigned long i;
+
+	down_read(&pcdev_data->core.lock);
+	if(pcdev_data->shards)
+		stored = (size_t)pcdev_data->pdata.size * num_possible_cpus();
+	else if(pcdev_data->zs){
+		mutex_lock(&pcdev_data->zs->lock);
+		stored = pcdev_data->zs->stored_bytes;
+		mutex_unlock(&pcdev_data->zs->lock);
+	}
+	else{
+		for(i = 0; i < pcdev_data->nr_pages; i++)
+			if(READ_ONCE(pcdev_data->pages[i]))
+				stored += PAGE_SIZE;
+	}
+	up_read(&pcdev_data->core.lock);
+
+	return sprintf(buf, "%zu\n", stored);
+}
+
+DEVICE_ATTR_RO(stored_bytes);
+
+/* Any write checkpoints the device like PCD_IOC_CHECKPOINT */
+static ssize_t checkpoint_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+	struct pcdev_private_data *pcdev_data = dev_get_drvdata(dev);
+	int ret;
+
+	ret = pcd_checkpoint(pcdev_data);
+	return ret ? ret : count;
+}
+
+DEVICE_ATTR_WO(checkpoint);
+
+/* Pages that go to the backing file with the next checkpoint */
+static ssize_t dirty_pages_show(struct device *dev, struct device_attribute *attr, char *buf){
+	struct pcdev_private_data *pcdev_data = dev_get_drvdata(dev);
+	unsigned long dirty = 0;
+
+	down_read(&pcdev_data->core.lock);
+	if(pcdev_data->dirty)
+		dirty = bitmap_weight(pcdev_data->dirty, pcdev_data->nr_pages);
+	up_read(&pcdev_data->core.lock);
+
+	return sprintf(buf, "%lu\n", dirty);
+}
+
+DEVICE_ATTR_RO(dirty_pages);
+
+static struct attribute *pcd_dev_attrs[] = {
+	&dev_attr_bytes_read.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_reads.attr,
+	&dev_attr_writes.attr,
+	&dev_attr_short_reads.attr,
+	&dev_attr_short_writes.attr,
+	&dev_attr_err_nomem.attr,
+	&dev_attr_err_fault.attr,
+	&dev_attr_err_perm.attr,
+	&dev_attr_err_integrity.attr,
+	&dev_attr_open_handles.attr,
+	&dev_attr_size.attr,
+	&dev_attr_probe_time_ns.attr,
+	&dev_attr_stored_bytes.attr,
+	&dev_attr_checkpoint.attr,
+	&dev_attr_dirty_pages.attr,
+	NULL
+};
+
+ATTRIBUTE_GROUPS(pcd_dev);
+
+/* debugfs <root>/pcd/pcdev-N/stats, everything including the histograms */
+static int pcd_stats_show(struct seq_file *s, void *unused){
+	struct pcdev_private_data *pcdev_data = s->private;
+	struct pcd_counters cnt;
+	u64 open_handles;
+	int i;
+
+	pcd_stats_get(pcdev_data, &cnt, &open_handles);
+
+	seq_printf(s, "bytes_read: %llu\n", cnt.bytes[PCD_STAT_READ]);
+	seq_printf(s, "bytes_written: %llu\n", cnt.bytes[PCD_STAT_WRITE]);
+	seq_printf(s, "reads: %llu\n", cnt.ops[PCD_STAT_READ]);
+	seq_printf(s, "writes: %llu\n", cnt.ops[PCD_STAT_WRITE]);
+	seq_printf(s, "short_reads: %llu\n", cnt.short_ops[PCD_STAT_READ]);
+	seq_printf(s, "short_writes: %llu\n", cnt.short_ops[PCD_STAT_WRITE]);
+	seq_printf(s, "err_nomem: %llu\n", cnt.err_nomem);
+	seq_printf(s, "err_fault: %llu\n", cnt.err_fault);
+	seq_printf(s, "err_perm: %llu\n", cnt.err_perm);
+	seq_printf(s, "err_integrity: %llu\n", cnt.err_integrity);
+	seq_printf(s, "opens: %llu\n", cnt.opens);
+	seq_printf(s, "open_handles: %llu\n", open_handles);
+
+	seq_puts(s, "\nlatency_ns\treads\twrites\n");
+	for(i = 0; i < PCD_LAT_BUCKETS; i++){
+		if(!cnt.lat_hist[PCD_STAT_READ][i] && !cnt.lat_hist[PCD_STAT_WRITE][i])
+			continue;
+		seq_printf(s, "<%llu\t%llu\t%llu\n", 1ULL << i,
+			cnt.lat_hist[PCD_STAT_READ][i], cnt.lat_hist[PCD_STAT_WRITE][i]);
+	}
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(pcd_stats);
+
+/* debugfs <root>/pcd/pcdev-N/reset, any write starts the counters over */
+static ssize_t pcd_stats_reset_write(struct file *filep, const char __user *buffer, size_t count, loff_t *f_pos){
+	pcd_stats_reset(filep->private_data);
+	return count;
+}
+
+static struct file_operations pcd_stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = pcd_stats_reset_write,
+	.llseek = noop_llseek,
+};
+
+/* debugfs <root>/pcd/pcdev-N/corrupt of a device in integrity mode,
+writing an offset flips the lowest bit of the byte there behind the
+back of the CRCs. The next read of that block fails with EIO */
+static ssize_t pcd_corrupt_write(struct file *filep, const char __user *buffer, size_t count, loff_t *f_pos){
+	struct pcdev_private_data *pcdev_data = filep->private_data;
+	struct page *page;
+	u8 *vaddr;
+	u64 off;
+	int ret;
+
+	ret = kstrtou64_from_user(buffer, count, 0, &off);
+	if(ret)
+		return ret;
+
+	down_write(&pcdev_data->core.lock);
+	if(off >= pcdev_data->pdata.size){
+		ret = -EINVAL;
+		goto unlock;
+	}
+	page = pcdev_data->pages[off >> PAGE_SHIFT];
+	if(page == NULL){
+		ret = -ENXIO;
+		goto unlock;
+	}
+	vaddr = kmap_atomic(page);
+	vaddr[offset_in_page(off)] ^= 1;
+	kunmap_atomic(vaddr);
+
+unlock:
+	up_write(&pcdev_data->core.lock);
+	return ret ? ret : count;
+}
+
+static struct file_operations pcd_corrupt_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = pcd_corrupt_write,
+	.llseek = noop_llseek,
 };
 
 /* Gets called when the device is removed from the platform */
-int pcd_platform_driver_remove(struct platform_device* pdev){
+static int pcd_platform_driver_remove(struct platform_device* pdev){
         struct pcdev_private_data* dev_data = dev_get_drvdata(&pdev->dev);
+
+	debugfs_remove_recursive(dev_data->debugfs_dir);
 	
 	/* Remove device that was created with device_create() */
-	device_destroy(pcdrv_data.class_pcd, dev_data->dev_num);
+	device_destroy(pcdrv_data.class_pcd, dev_data->core.devt);
 
 	/* Remove cdev entry from the system */
-	cdev_del(&dev_data->cdev);
-	
-	pcdrv_data.total_devices--;
+	pcd_core_del(&dev_data->core);
+
+	ida_free(&pcdrv_data.minor_ida, dev_data->id);
+
+	atomic_dec(&pcdrv_data.total_devices);
+
+	/* Nothing can reach the device any more, but open files, mappings,
+	dma-bufs and snapshots still use its buffer. It is freed with the
+	last of them */
+	if(kref_read(&dev_data->ref) > 1)
+		pr_info("pcdev-%d is still in use, its buffer is freed when the last user is gone\n", dev_data->id);
+	pcd_dev_put(dev_data);
 	
 	pr_info("A device is removed\n");
 	return 0;
 }
 
+/* Platform data of a device instantiated from a device tree node, e.g.
+
+	pcdev-a {
+		compatible = "pcd,pseudo-char-device";
+		pcd,size = <1048576>;
+		pcd,perm = <0x11>;	(RDWR, RDONLY or WRONLY of platform.h)
+		pcd,serial-number = "PCDEVDT0001";
+		pcd,mode = <0>;	(optional, PCD_MODE_FLAT by default, 1 FIFO, 2 SPSC, 3 SHARD, 4 LOG, 5 KV)
+		pcd,backing-file = "/var/lib/pcdev-a.img";	(optional, flat only)
+		pcd,checkpoint-ms = <5000>;	(optional, 0 by default)
+		pcd,compress;	(optional, flat only, keep the buffer lz4 compressed)
+		pcd,integrity;	(optional, flat only, CRC32C checked reads)
+	};
+*/
+static struct pcdev_platform_data* pcd_get_platdata_from_dt(struct device *dev){
+	struct device_node *np = dev->of_node;
+	struct pcdev_platform_data *pdata;
+	u32 val;
+
+	pdata = devm_kzalloc(dev, sizeof(*pdata), GFP_KERNEL);
+	if(pdata == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	if(of_property_read_u32(np, "pcd,size", &val) || (val > INT_MAX)){
+		pr_info("%pOF: missing or invalid pcd,size\n", np);
+		return ERR_PTR(-EINVAL);
+	}
+	pdata->size = val;
+
+	if(of_property_read_u32(np, "pcd,perm", &val)){
+		pr_info("%pOF: missing pcd,perm\n", np);
+		return ERR_PTR(-EINVAL);
+	}
+	pdata->perm = val;
+
+	if(of_property_read_string(np, "pcd,serial-number", &pdata->serial_number)){
+		pr_info("%pOF: missing pcd,serial-number\n", np);
+		return ERR_PTR(-EINVAL);
+	}
+
+	if(of_property_read_u32(np, "pcd,mode", &val))
+		val = PCD_MODE_FLAT;
+	pdata->mode = val;
+
+	if(of_property_read_string(np, "pcd,backing-file", &pdata->backing_file))
+		pdata->backing_file = NULL;
+	of_property_read_u32(np, "pcd,checkpoint-ms", &pdata->checkpoint_ms);
+	pdata->compress = of_property_read_bool(np, "pcd,compress");
+	pdata->integrity = of_property_read_bool(np, "pcd,integrity");
+
+	return pdata;
+}
+
 /* Gets called when the matched platform device is found */
-int pcd_platform_driver_probe(struct platform_device* pdev){
+static int pcd_platform_driver_probe(struct platform_device* pdev){
 	
-	int ret;
+	int ret, cpu;
 	struct pcdev_private_data *dev_data;
 	struct pcdev_platform_data *pdata;
+	const struct file_operations *fops;
+	u64 start = ktime_get_ns();
 	
-	pr_info("A device is detected\n");
+	pr_debug("A device is detected\n");
 	
-	/* 1. Get the platform data */
-	pdata = (struct pcdev_platform_data*)dev_get_platdata(&pdev->dev);
+	/* 1. Get the platform data, from the device tree node if the device
+	was instantiated from one */
+	if(pdev->dev.of_node){
+		pdata = pcd_get_platdata_from_dt(&pdev->dev);
+		if(IS_ERR(pdata)){
+			ret = PTR_ERR(pdata);
+			goto out;
+		}
+	}
+	else
+		pdata = (struct pcdev_platform_data*)dev_get_platdata(&pdev->dev);
 	if(!pdata){
 		pr_info("No platform data available\n");
 		ret = -EINVAL;
 		goto out;
 	}
 	
-	/* Dynamically allocate memory for the device private data */
-	dev_data = devm_kzalloc(&pdev->dev, sizeof(*dev_data), GFP_KERNEL);
+	/* Dynamically allocate memory for the device private data. It isn't
+	devm managed, users of the buffer may keep it after the device is
+	removed, see pcd_dev_free() */
+	dev_data = kzalloc(sizeof(*dev_data), GFP_KERNEL);
 	if(dev_data == NULL){
 		pr_info("Cannot allocate memory for device data structure\n");
 		ret = -ENOMEM;
@@ -215,62 +4148,273 @@ int pcd_platform_driver_probe(struct platform_device* pdev){
 	dev_data->pdata.size = pdata->size;
 	dev_data->pdata.perm = pdata->perm;
 	dev_data->pdata.serial_number = pdata->serial_number;
+	dev_data->pdata.mode = pdata->mode;
+	dev_data->pdata.backing_file = pdata->backing_file;
+	dev_data->pdata.checkpoint_ms = pdata->checkpoint_ms;
+	dev_data->pdata.compress = pdata->compress;
+	dev_data->pdata.integrity = pdata->integrity;
+
+	if((dev_data->pdata.size <= 0) || (dev_data->pdata.size > PCD_MAX_SIZE)){
+		pr_info("Invalid device size %d\n", dev_data->pdata.size);
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
 
-	pr_info("Device serial number = %s\n", dev_data->pdata.serial_number);
-	pr_info("Device size = %d\n", dev_data->pdata.size);
-	pr_info("Device permission = %d\n", dev_data->pdata.perm);
+	if((dev_data->pdata.mode != PCD_MODE_FLAT) && (dev_data->pdata.mode != PCD_MODE_FIFO) &&
+	   (dev_data->pdata.mode != PCD_MODE_SPSC) && (dev_data->pdata.mode != PCD_MODE_SHARD) &&
+	   (dev_data->pdata.mode != PCD_MODE_LOG) && (dev_data->pdata.mode != PCD_MODE_KV)){
+		pr_info("Unknown device mode %d\n", dev_data->pdata.mode);
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	/* SPSC indices are masked with size - 1, the ring is whole pages */
+	if((dev_data->pdata.mode == PCD_MODE_SPSC) &&
+	   (!is_power_of_2(dev_data->pdata.size) || (dev_data->pdata.size < PAGE_SIZE))){
+		pr_info("SPSC ring size %d is not a power of two of at least a page\n", dev_data->pdata.size);
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	/* Records start aligned, a ring holds at least a one byte record */
+	if((dev_data->pdata.mode == PCD_MODE_LOG) &&
+	   (!IS_ALIGNED(dev_data->pdata.size, PCD_LOG_ALIGN) || (dev_data->pdata.size < pcd_log_reclen(1)))){
+		pr_info("Log size %d is not a multiple of %d of at least %zu bytes\n",
+			dev_data->pdata.size, PCD_LOG_ALIGN, pcd_log_reclen(1));
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	/* The table takes a quarter of the buffer, the rest holds the keys
+	and values */
+	if((dev_data->pdata.mode == PCD_MODE_KV) && (dev_data->pdata.size < PAGE_SIZE)){
+		pr_info("Key-value size %d is less than a page\n", dev_data->pdata.size);
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	if((dev_data->pdata.mode == PCD_MODE_SHARD) &&
+	   (!IS_ALIGNED(dev_data->pdata.size, PCD_SHARD_ALIGN) || (dev_data->pdata.size < pcd_shard_reclen(1)))){
+		pr_info("Shard size %d is not a multiple of %d of at least %zu bytes\n",
+			dev_data->pdata.size, PCD_SHARD_ALIGN, pcd_shard_reclen(1));
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	if((dev_data->pdata.perm != RDWR) && (dev_data->pdata.perm != RDONLY) && (dev_data->pdata.perm != WRONLY)){
+		pr_info("Invalid device permission %x\n", dev_data->pdata.perm);
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	/* Rings are consumed as they are read, there is nothing worth keeping */
+	if(dev_data->pdata.backing_file && (dev_data->pdata.mode != PCD_MODE_FLAT)){
+		pr_info("Only flat devices can have a backing file\n");
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	if(dev_data->pdata.compress && (dev_data->pdata.mode != PCD_MODE_FLAT)){
+		pr_info("Only flat devices can be compressed\n");
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	/* The CRCs are over the pages, a compressed buffer has none */
+	if(dev_data->pdata.integrity && ((dev_data->pdata.mode != PCD_MODE_FLAT) || dev_data->pdata.compress)){
+		pr_info("Only flat uncompressed devices can have integrity mode\n");
+		ret = -EINVAL;
+		goto dev_data_free;
+	}
+
+	/* Console output is slow and adds up over many devices at boot, the
+	details are only printed for debug builds */
+	pr_debug("Device serial number = %s size = %d permission = %x mode = %d\n",
+		dev_data->pdata.serial_number, dev_data->pdata.size, dev_data->pdata.perm, dev_data->pdata.mode);
 
 	/* Dynamically allocate memory for the device buffer using size
-	information from the platform data */
-	dev_data->buffer = devm_kzalloc(&pdev->dev, sizeof(dev_data->pdata.size), GFP_KERNEL);
-        if(dev_data->buffer == NULL){
-                pr_info("Cannot allocate memory for device buffer\n");
-                ret = -ENOMEM;
-                goto dev_data_free;
-        }
+	information from the platform data. The buffer is an array of single
+	pages, so large devices don't need physically contiguous memory and
+	pcd_mmap() can hand out the pages as they are. Only the array is
+	allocated here, pages come with the first write to them. Compressed
+	devices keep lz4 chunks instead of pages, see pcd_z_alloc() */
+	if(dev_data->pdata.mode == PCD_MODE_SPSC){
+		ret = pcd_buf_alloc(dev_data, PAGE_SIZE + dev_data->pdata.size);
+		if(!ret){
+			ret = pcd_spsc_init(dev_data);
+			if(ret)
+				pcd_buf_free(dev_data);
+		}
+	}
+	else if(dev_data->pdata.mode == PCD_MODE_SHARD)
+		ret = pcd_shard_alloc(dev_data);
+	else if(dev_data->pdata.mode == PCD_MODE_LOG){
+		ret = pcd_buf_alloc(dev_data, dev_data->pdata.size);
+		if(!ret){
+			ret = pcd_log_init(dev_data);
+			if(ret)
+				pcd_buf_free(dev_data);
+		}
+	}
+	else if(dev_data->pdata.mode == PCD_MODE_KV){
+		ret = pcd_buf_alloc(dev_data, dev_data->pdata.size);
+		if(!ret){
+			ret = pcd_kv_init(dev_data);
+			if(ret)
+				pcd_buf_free(dev_data);
+		}
+	}
+	else if(dev_data->pdata.compress)
+		ret = pcd_z_alloc(dev_data, dev_data->pdata.size);
+	else
+		ret = pcd_buf_alloc(dev_data, dev_data->pdata.size);
+	if(ret){
+		pr_info("Cannot allocate memory for device buffer\n");
+		goto dev_data_free;
+	}
+	kref_init(&dev_data->ref);
+	atomic_set(&dev_data->map_count, 0);
+	atomic_set(&dev_data->snapshots, 0);
+
+	/* Get the device number. Devices registered with an id keep it as
+	their minor offset, device tree ones get the lowest free one */
+	if(pdev->id >= MAX_DEVICES){
+		pr_info("Device id %d out of range\n", pdev->id);
+		ret = -EINVAL;
+		goto buffer_free;
+	}
+	if(pdev->id >= 0)
+		ret = ida_alloc_range(&pcdrv_data.minor_ida, pdev->id, pdev->id, GFP_KERNEL);
+	else
+		ret = ida_alloc_max(&pcdrv_data.minor_ida, MAX_DEVICES - 1, GFP_KERNEL);
+	if(ret < 0){
+		pr_info("Cannot get a minor number for the device\n");
+		goto buffer_free;
+	}
+	dev_data->id = ret;
+
+	/* Usage counters, one copy per CPU keeps the I/O paths contention free */
+	dev_data->stats = alloc_percpu(struct pcd_stats);
+	if(dev_data->stats == NULL){
+		pr_info("Cannot allocate memory for device statistics\n");
+		ret = -ENOMEM;
+		goto minor_free;
+	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(dev_data->stats, cpu)->syncp);
+	mutex_init(&dev_data->stats_lock);
+
+	pcd_core_init(&dev_data->core, &pcd_backend_ops, NULL, dev_data->pdata.size, dev_data->pdata.perm);
+	mutex_init(&dev_data->fifo.lock);
+	init_waitqueue_head(&dev_data->fifo.readq);
+	init_waitqueue_head(&dev_data->fifo.writeq);
+	mutex_init(&dev_data->spsc_write_lock);
+	mutex_init(&dev_data->persist_lock);
+	INIT_DELAYED_WORK(&dev_data->checkpoint_work, pcd_checkpoint_work);
+
+	/* Bring back the contents the buffer had at the last checkpoint. A
+	device that can't be restored doesn't come up, the next checkpoint
+	would overwrite the good copy with an empty buffer */
+	if(dev_data->pdata.backing_file){
+		ret = pcd_persist_init(dev_data);
+		if(ret){
+			pr_err("Cannot restore device from %s: %d\n", dev_data->pdata.backing_file, ret);
+			goto stats_free;
+		}
+	}
 
-	/* Get the device number */
-	dev_data->dev_num = pcdrv_data.device_num_base + pdev->id;
+	if(dev_data->pdata.integrity){
+		ret = pcd_integrity_init(dev_data);
+		if(ret){
+			pr_err("Cannot set up integrity mode: %d\n", ret);
+			goto persist_exit;
+		}
+	}
 
 	/* Do cdev init and cdev add */
-	cdev_init(&dev_data->cdev, &pcd_fops);
+	if(dev_data->pdata.mode == PCD_MODE_FIFO)
+		fops = &pcd_fifo_fops;
+	else if(dev_data->pdata.mode == PCD_MODE_SPSC)
+		fops = &pcd_spsc_fops;
+	else if(dev_data->pdata.mode == PCD_MODE_SHARD)
+		fops = &pcd_shard_fops;
+	else if(dev_data->pdata.mode == PCD_MODE_LOG)
+		fops = &pcd_log_fops;
+	else if(dev_data->pdata.mode == PCD_MODE_KV)
+		fops = &pcd_kv_fops;
+	else
+		fops = &pcd_fops;
 
-	dev_data->cdev.owner = THIS_MODULE;
-	ret = cdev_add(&dev_data->cdev, dev_data->dev_num, 1);
+	ret = pcd_core_add(&dev_data->core, fops, THIS_MODULE, pcdrv_data.device_num_base + dev_data->id);
 	if(ret < 0 ){
 		pr_err("Cdev add failed\n");
-		goto buffer_free;
+		goto integrity_exit;
 	}
 
-	/* Create device file for the detected platform device */
-	pcdrv_data.device_pcd = device_create(pcdrv_data.class_pcd, NULL, dev_data->dev_num, NULL, "pcdev-%d", pdev->id);
-	if(IS_ERR(pcdrv_data.device_pcd)){
+	/* Create device file for the detected platform device, along with
+	the sysfs statistics attributes */
+	dev_data->device = device_create_with_groups(pcdrv_data.class_pcd, &pdev->dev, dev_data->core.devt, dev_data, pcd_dev_groups, "pcdev-%d", dev_data->id);
+	if(IS_ERR(dev_data->device)){
 		pr_err("Device create failed \n");
-		ret = PTR_ERR(pcdrv_data.device_pcd);
+		ret = PTR_ERR(dev_data->device);
 		goto cdev_del;
 	}
 
-	pcdrv_data.total_devices++;
-	
-	pr_info("The probe is successful\n");
+	/* debugfs failures are not fatal, the device just has no debug files */
+	dev_data->debugfs_dir = debugfs_create_dir(dev_name(dev_data->device), pcdrv_data.debugfs_root);
+	debugfs_create_file("stats", 0444, dev_data->debugfs_dir, dev_data, &pcd_stats_fops);
+	debugfs_create_file("reset", 0200, dev_data->debugfs_dir, dev_data, &pcd_stats_reset_fops);
+	if(dev_data->crcs)
+		debugfs_create_file("corrupt", 0200, dev_data->debugfs_dir, dev_data, &pcd_corrupt_fops);
+
+	if(dev_data->backing && dev_data->pdata.checkpoint_ms)
+		queue_delayed_work(system_unbound_wq, &dev_data->checkpoint_work, msecs_to_jiffies(dev_data->pdata.checkpoint_ms));
+
+	atomic_inc(&pcdrv_data.total_devices);
+
+	dev_data->probe_ns = ktime_get_ns() - start;
+	dev_dbg(dev_data->device, "The probe is successful, took %llu ns\n", dev_data->probe_ns);
 	return 0;
 
 cdev_del:
-	cdev_del(&dev_data->cdev);;
+	/* The cdev was live, an open() may have raced in and hold a reference.
+	The last put tears down the rest, as after a remove */
+	pcd_core_del(&dev_data->core);
+	ida_free(&pcdrv_data.minor_ida, dev_data->id);
+	pcd_dev_put(dev_data);
+	goto out;
+integrity_exit:
+	pcd_integrity_exit(dev_data);
+persist_exit:
+	pcd_persist_exit(dev_data);
+stats_free:
+	free_percpu(dev_data->stats);
+minor_free:
+	ida_free(&pcdrv_data.minor_ida, dev_data->id);
 buffer_free:
-	devm_kfree(&pdev->dev, dev_data->buffer);
+	pcd_buf_free(dev_data);
 dev_data_free:
-	devm_kfree(&pdev->dev, dev_data);
+	kfree(dev_data);
 out:
 	pr_info("Device probe failed\n");
 	return ret;
 }
 
-struct platform_driver pcd_platform_driver = {
+/* Device tree nodes the driver binds to, see pcd_get_platdata_from_dt() */
+static struct of_device_id pcd_of_match[] = {
+	{ .compatible = "pcd,pseudo-char-device" },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, pcd_of_match);
+
+static struct platform_driver pcd_platform_driver = {
 	.probe = pcd_platform_driver_probe,
 	.remove = pcd_platform_driver_remove,
 	.driver = {
-		.name = "pseudo-char-device"
+		.name = "pseudo-char-device",
+		.of_match_table = pcd_of_match,
+		/* Devices don't depend on each other, let them probe in parallel */
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	}
 };
 
@@ -291,10 +4435,24 @@ static int __init pcd_platform_driver_init(void){
 		pr_err("Class creation failed\n");
 		ret = PTR_ERR(pcdrv_data.class_pcd);
 		unregister_chrdev_region(pcdrv_data.device_num_base, MAX_DEVICES);
+		return ret;
 	}	
+
+	ida_init(&pcdrv_data.minor_ida);
+
+	/* Root of the per device debugfs directories */
+	pcdrv_data.debugfs_root = debugfs_create_dir("pcd", NULL);
 	
 	/* Register a platform driver */
-	platform_driver_register(&pcd_platform_driver);
+	ret = platform_driver_register(&pcd_platform_driver);
+	if(ret < 0){
+		pr_err("Platform driver registration failed\n");
+		debugfs_remove_recursive(pcdrv_data.debugfs_root);
+		ida_destroy(&pcdrv_data.minor_ida);
+		class_destroy(pcdrv_data.class_pcd);
+		unregister_chrdev_region(pcdrv_data.device_num_base, MAX_DEVICES);
+		return ret;
+	}
 	pr_info("PCD platform driver loaded\n");
 
 	return 0;
@@ -303,6 +4461,8 @@ static int __init pcd_platform_driver_init(void){
 
 static void __exit pcd_platform_driver_exit(void){
 	platform_driver_unregister(&pcd_platform_driver);
+	debugfs_remove_recursive(pcdrv_data.debugfs_root);
+	ida_destroy(&pcdrv_data.minor_ida);
         class_destroy(pcdrv_data.class_pcd);
 	unregister_chrdev_region(pcdrv_data.device_num_base, MAX_DEVICES);
 
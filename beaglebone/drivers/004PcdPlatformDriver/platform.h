@@ -1,3 +1,5 @@
+#include "pcd_core.h"
+
 
 #undef pr_fmt
 #define pr_fmt(fmt) "%s:" fmt, __func__
@@ -6,8 +8,17 @@ struct pcdev_platform_data{
 	int size;
 	int perm;
 	const char* serial_number;
+	int mode;
+	const char* backing_file;	/* flat devices only, NULL for no persistence */
+	unsigned int checkpoint_ms;	/* period of the background checkpoint, 0 for on demand only */
+	int compress;	/* flat devices only, keep the buffer lz4 compressed */
+	int integrity;	/* flat devices only, CRC32C every page and check it on read */
 };
 
-#define RDWR 0x11
-#define RDONLY 0x01
-#define WRONLY 0x10
+/* Device modes */
+#define PCD_MODE_FLAT 0	/* seekable byte array (default) */
+#define PCD_MODE_FIFO 1	/* ring buffer, write appends and read consumes */
+#define PCD_MODE_SPSC 2	/* single producer/consumer ring shared through mmap */
+#define PCD_MODE_SHARD 3	/* ring of records per CPU, read merges them in time order */
+#define PCD_MODE_LOG 4	/* append only records addressed by sequence number */
+#define PCD_MODE_KV 5	/* key-value store, hash table in the buffer, ioctls only */
@@ -0,0 +1,91 @@
+/*
+ * Shared core of the pseudo character device drivers.
+ *
+ * pcd, pcd_n and pcd_platform_driver all expose a byte array through
+ * read/write/lseek with the same rules. The core does that part once:
+ * bounds checks, locking, f_pos and ki_pos handling, the end of data for
+ * SEEK_END/SEEK_DATA/SEEK_HOLE and tracing. A driver only supplies the
+ * storage through a struct pcd_backend_ops and gets every improvement of
+ * the I/O path with it.
+ *
+ * Rules of the flat devices:
+ *	- reads at or past the end of the device return 0, reads across it
+ *	  are cut short
+ *	- writes at or past the end fail with ENOMEM, writes across it are
+ *	  cut short
+ *	- SEEK_END is relative to the end of the highest byte written
+ *	- opening is refused with EPERM when the f_mode doesn't match the
+ *	  device permission
+ */
+#ifndef _PCD_CORE_H
+#define _PCD_CORE_H
+
+#include<linux/cdev.h>
+#include<linux/fs.h>
+#include<linux/rwsem.h>
+#include<linux/uio.h>
+
+/* Device permissions */
+#define RDWR 0x11
+#define RDONLY 0x01
+#define WRONLY 0x10
+
+/* Directions passed to pcd_backend_ops.account */
+enum{
+	PCD_DIR_READ,
+	PCD_DIR_WRITE,
+};
+
+struct pcd_core_dev;
+
+/* Storage behind a flat device */
+struct pcd_backend_ops{
+	/* Copy count bytes at pos to user space. The range is inside the
+	device and the lock is held for reading. Returns the number of bytes
+	copied, less than count if user memory faulted, or -errno */
+	ssize_t (*read)(struct pcd_core_dev *dev, size_t pos, size_t count, struct iov_iter *to);
+
+	/* Counterpart of read, the lock is held for writing */
+	ssize_t (*write)(struct pcd_core_dev *dev, size_t pos, size_t count, struct iov_iter *from);
+
+	/* Optional, whether page idx of the device holds data. Without it
+	everything below data_len counts as data for SEEK_DATA/SEEK_HOLE */
+	bool (*present)(struct pcd_core_dev *dev, unsigned long idx);
+
+	/* Optional, called after every read and write with the number of
+	bytes asked for, the result and the ktime_get_ns() it started at */
+	void (*account)(struct pcd_core_dev *dev, int dir, size_t count, ssize_t ret, u64 start);
+};
+
+/* One flat device, embedded in the driver's device structure */
+struct pcd_core_dev{
+	const struct pcd_backend_ops *ops;
+	void *priv;	/* backend data */
+	size_t size;	/* may change under the lock held for writing */
+	size_t data_len;	/* end of the highest byte written */
+	int perm;	/* RDWR, RDONLY or WRONLY */
+	dev_t devt;
+	struct rw_semaphore lock;	/* readers share the buffer, writers own it */
+	struct cdev cdev;
+};
+
+void pcd_core_init(struct pcd_core_dev *dev, const struct pcd_backend_ops *ops, void *priv, size_t size, int perm);
+int pcd_core_add(struct pcd_core_dev *dev, const struct file_operations *fops, struct module *owner, dev_t devt);
+void pcd_core_del(struct pcd_core_dev *dev);
+
+void pcd_core_data_len_extend(struct pcd_core_dev *dev, size_t end);
+int pcd_core_check_permission(int perm, int mode);
+
+int pcd_core_open(struct inode *p_inode, struct file *filep);
+int pcd_core_release(struct inode *p_inode, struct file *filep);
+ssize_t pcd_core_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t pcd_core_write_iter(struct kiocb *iocb, struct iov_iter *from);
+loff_t pcd_core_lseek(struct file *filep, loff_t off, int whence);
+
+/* open, read, write, lseek, splice and release of a flat device */
+extern const struct file_operations pcd_core_fops;
+
+/* Backend for a buffer in kernel memory, priv points to it */
+extern const struct pcd_backend_ops pcd_core_array_ops;
+
+#endif /* _PCD_CORE_H */
@@ -0,0 +1,33 @@
+/*
+ * ioctl interface of the pcd_importer test module, /dev/pcd_importer.
+ *
+ * The module imports a dma-buf the way a device driver would: it
+ * attaches, maps the attachment for DMA and accesses the pages with the
+ * CPU between dma_buf_begin_cpu_access() and dma_buf_end_cpu_access().
+ */
+#ifndef _PCD_IMPORTER_H
+#define _PCD_IMPORTER_H
+
+#include<linux/ioctl.h>
+#include<linux/types.h>
+
+#define PCD_IMPORTER_IOC_MAGIC 'q'
+
+/* Flags of struct pcd_import_check */
+#define PCD_IMPORT_FILL	0x1	/* write fill over the whole buffer after the check */
+
+struct pcd_import_check{
+	__s32 fd;	/* in: dma-buf */
+	__u32 flags;	/* in: PCD_IMPORT_* */
+	__u32 fill;	/* in: byte written with PCD_IMPORT_FILL */
+	__u32 crc;	/* out: CRC-32 (as zlib's crc32()) of the buffer before the fill */
+	__u64 size;	/* out: size of the dma-buf */
+	__u32 nents;	/* out: scatterlist entries of the DMA mapping */
+	__u32 reserved;
+};
+
+/* Import fd, check it and optionally fill it. Fails with EACCES if a
+fill is asked for and the dma-buf was exported read only */
+#define PCD_IMPORTER_IOC_CHECK	_IOWR(PCD_IMPORTER_IOC_MAGIC, 1, struct pcd_import_check)
+
+#endif /* _PCD_IMPORTER_H */
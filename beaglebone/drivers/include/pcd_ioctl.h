@@ -0,0 +1,259 @@
+/*
+ * ioctl interface of the pseudo character device platform driver.
+ *
+ * Shared between the driver and user space programs, so only fixed size
+ * types are used and user pointers are passed as __u64.
+ */
+#ifndef _PCD_IOCTL_H
+#define _PCD_IOCTL_H
+
+#include<linux/ioctl.h>
+#include<linux/types.h>
+
+#define PCD_IOC_MAGIC 'p'
+
+/* Current size of the device buffer in bytes */
+#define PCD_IOC_GET_SIZE	_IOR(PCD_IOC_MAGIC, 1, __u64)
+
+/* Grow or shrink the device buffer, existing contents are kept up to the
+   smaller of the two sizes. Needs a writable fd, fails with EBUSY while
+   the buffer is mapped */
+#define PCD_IOC_RESIZE		_IOW(PCD_IOC_MAGIC, 2, __u64)
+
+/* Export the buffer of a flat device as a dma-buf */
+struct pcd_dmabuf_export{
+	__u32 flags;	/* in: O_RDONLY or O_RDWR, optionally O_CLOEXEC */
+	__s32 fd;	/* out: dma-buf file descriptor */
+};
+
+/* The dma-buf shares the device pages, nothing is copied. The buffer
+can't be resized while an exported dma-buf is alive, and it stays
+allocated until the dma-buf is released even if the device is removed */
+#define PCD_IOC_EXPORT_DMABUF	_IOWR(PCD_IOC_MAGIC, 3, struct pcd_dmabuf_export)
+
+/* Operations of a batch descriptor */
+#define PCD_BATCH_READ		0
+#define PCD_BATCH_WRITE		1
+
+/* One read or write of a batch, at an absolute offset like pread/pwrite */
+struct pcd_batch_op{
+	__u32 op;	/* PCD_BATCH_READ or PCD_BATCH_WRITE */
+	__u32 reserved;	/* must be 0 */
+	__u64 offset;
+	__u64 len;
+	__u64 buf;	/* user buffer */
+	__s64 result;	/* out: bytes transferred or -errno */
+};
+
+/* Apply the whole batch under the device lock, no other reader or writer
+sees it half done. Descriptors that fail are not rolled back */
+#define PCD_BATCH_ATOMIC	0x1
+
+/* Longest batch accepted */
+#define PCD_BATCH_MAX		4096
+
+struct pcd_batch{
+	__u64 ops;	/* array of struct pcd_batch_op */
+	__u32 count;	/* number of descriptors in ops */
+	__u32 flags;	/* PCD_BATCH_* */
+};
+
+/* Run count descriptors in one call. Every descriptor is run and gets its
+own result, a failing one doesn't stop the batch */
+#define PCD_IOC_BATCH		_IOW(PCD_IOC_MAGIC, 4, struct pcd_batch)
+
+/* Cache line size the control page of a PCD_MODE_SPSC device is laid out
+for, head and tail never share a line */
+#define PCD_SPSC_CACHELINE	64
+
+/* Control page of a PCD_MODE_SPSC device, at mmap offset 0. The ring data
+follows at data_offset. head and tail are free running byte counts, the
+ring holds head - tail bytes starting at tail & (size - 1). See pcd_spsc.h
+for the user space side of the protocol */
+struct pcd_spsc_ctrl{
+	/* written by the producer only */
+	__u32 head;
+	__u32 producer_waiting;	/* producer sleeps in poll() for space */
+	__u8 pad0[PCD_SPSC_CACHELINE - 8];
+
+	/* written by the consumer only */
+	__u32 tail;
+	__u32 consumer_waiting;	/* consumer sleeps in poll() for data */
+	__u8 pad1[PCD_SPSC_CACHELINE - 8];
+
+	/* set up by the driver, read only */
+	__u32 size;		/* ring size in bytes, a power of two */
+	__u32 data_offset;	/* mmap offset of the ring data */
+};
+
+/* Wake up a consumer or producer of a PCD_MODE_SPSC device sleeping in
+poll(), read() or write(). Only needed when the other side has set its
+waiting flag */
+#define PCD_IOC_SPSC_WAKE	_IO(PCD_IOC_MAGIC, 5)
+
+/* Record of a PCD_MODE_SHARD device as read() returns it. Every write()
+to the device becomes one record, the header is followed by the len
+bytes written and zero padding up to a multiple of PCD_SHARD_ALIGN, so
+the next header is aligned again. read() only returns whole records and
+fails with EINVAL if the buffer can't hold the next one */
+struct pcd_shard_rec{
+	__u64 ts_ns;	/* CLOCK_MONOTONIC time of the write */
+	__u32 len;	/* bytes written, without the header and the padding */
+	__u16 cpu;	/* shard the record was written to */
+	__u16 reserved;
+};
+
+#define PCD_SHARD_ALIGN 8
+
+/* Record of a PCD_MODE_LOG device. Every write() appends one record with
+the next sequence number, the oldest records are trimmed to make room.
+The file position is a sequence number rather than a byte offset: read()
+returns whole records from the one at the file position on, each padded
+to a multiple of PCD_LOG_ALIGN, and leaves the position at the sequence
+number following the last one returned. A position older than the
+oldest record left reads from that record on, the seq of the first
+header shows what was lost. lseek() SEEK_DATA finds the oldest record,
+SEEK_END is the next sequence number to be written */
+struct pcd_log_rec{
+	__u64 seq;
+	__u32 len;	/* bytes written, without the header and the padding */
+	__u32 reserved;
+};
+
+#define PCD_LOG_ALIGN 8
+
+/* Write the pages changed since the last checkpoint to the backing file
+of a flat device and wait until they are on stable storage. Fails with
+ENODEV if the device has no backing file */
+#define PCD_IOC_CHECKPOINT	_IO(PCD_IOC_MAGIC, 6)
+
+/* Take a point in time snapshot of a flat device. Returns a new read only
+fd (O_CLOEXEC) that reads, preads and seeks like the device did at the
+time of the call, no matter what is written to the device afterwards.
+Pages are shared until the device writes to them. Fails with EBUSY while
+the device is mmapped or exported, and mmap and PCD_IOC_EXPORT_DMABUF
+fail with EBUSY while snapshots are open */
+#define PCD_IOC_SNAPSHOT	_IO(PCD_IOC_MAGIC, 7)
+
+/* Result of PCD_IOC_VERIFY on a device in integrity mode. Every block of
+block_size bytes has a CRC32C that is checked against its contents */
+struct pcd_verify{
+	__u64 bad_blocks;	/* blocks whose contents don't match their CRC */
+	__u64 first_bad;	/* offset of the first of them, 0 if there are none */
+	__u32 block_size;
+	__u32 reserved;
+};
+
+/* Check the whole buffer of a device in integrity mode. Reads check the
+blocks they touch on their own and fail with EIO on a mismatch */
+#define PCD_IOC_VERIFY		_IOR(PCD_IOC_MAGIC, 8, struct pcd_verify)
+
+/* Key and value of PCD_IOC_KV_GET, PCD_IOC_KV_PUT and PCD_IOC_KV_DEL on a
+device in PCD_MODE_KV. key and value are user pointers, value is not
+used by PCD_IOC_KV_DEL */
+struct pcd_kv{
+	__u64 key;
+	__u64 value;
+	__u32 key_len;	/* 1 to PCD_KV_KEY_MAX bytes */
+	__u32 value_len;	/* size of the value buffer, see PCD_IOC_KV_GET */
+};
+
+#define PCD_KV_KEY_MAX 255
+
+/* Copy the value stored under key to value and set value_len to its
+length. Nothing else is copied, a lookup is this one call. Fails with
+ENOENT if the key isn't there, and with ENOSPC if value_len is smaller
+than the value, value_len is set to the length needed then */
+#define PCD_IOC_KV_GET		_IOWR(PCD_IOC_MAGIC, 9, struct pcd_kv)
+
+/* Store value_len bytes at value under key, replacing the value the key
+had. Fails with ENOSPC if the table or the space for the values is full.
+A put that fails leaves the old value in place */
+#define PCD_IOC_KV_PUT		_IOW(PCD_IOC_MAGIC, 10, struct pcd_kv)
+
+/* Remove key and its value, fails with ENOENT if it isn't there */
+#define PCD_IOC_KV_DEL		_IOW(PCD_IOC_MAGIC, 11, struct pcd_kv)
+
+/* Walk over the keys of a PCD_MODE_KV device. Start with cookie 0 and
+pass the cookie each call returns to the next one */
+struct pcd_kv_iter{
+	__u64 cookie;
+	__u64 key;	/* user pointer to the key buffer */
+	__u32 key_len;	/* size of the key buffer, set to the length of the key */
+	__u32 value_len;	/* set to the length of the value */
+};
+
+/* Return the next key of the walk. Fails with ENOENT at the end and with
+ENOSPC, key_len set to the length needed, if the key buffer is too small.
+Keys are returned in table order, every key that is there during the
+whole walk is returned once as long as no key is removed. A removal can
+move other keys across the cookie, they are skipped or returned twice */
+#define PCD_IOC_KV_ITER		_IOWR(PCD_IOC_MAGIC, 12, struct pcd_kv_iter)
+
+/* What PCD_IOC_SEARCH looks for */
+#define PCD_SEARCH_BYTES	0	/* pattern_len bytes at pattern, at any offset */
+#define PCD_SEARCH_U8		1	/* value in the u8 fields at offset + n * stride */
+#define PCD_SEARCH_U16		2	/* same for u16 fields */
+#define PCD_SEARCH_U32		3	/* same for u32 fields */
+
+/* Longest byte pattern accepted */
+#define PCD_SEARCH_PATTERN_MAX	256
+
+struct pcd_search{
+	__u64 offset;	/* start of the range searched */
+	__u64 length;	/* bytes from offset on, 0 for up to the end of the device */
+	__u64 pattern;	/* user pointer to the bytes searched for */
+	__u64 results;	/* user pointer to an array of max_results __u64 */
+	__u32 type;	/* PCD_SEARCH_* */
+	__u32 pattern_len;	/* PCD_SEARCH_BYTES only */
+	__u32 stride;	/* field types only, a multiple of the field size */
+	__u32 value;	/* field types only, in CPU byte order */
+	__u32 max_results;
+	__u32 nr_results;	/* set to the number of offsets stored */
+	__u64 next;	/* set to where to continue once results is full */
+};
+
+/* Search the buffer of a flat device in place and store the offsets of
+the matches in results, in ascending order. Only matches that lie within
+the range count. The search stops once max_results are found, next is
+then the offset to continue from, otherwise it is the end of the range.
+Field types need offset and stride to be multiples of the field size and
+value to fit into it. Fails with EIO in integrity mode if a page of the
+range doesn't match its CRC */
+#define PCD_IOC_SEARCH		_IOWR(PCD_IOC_MAGIC, 13, struct pcd_search)
+
+/* Set length bytes of a flat device from offset on to value, a byte */
+struct pcd_fill{
+	__u64 offset;
+	__u64 length;
+	__u32 value;
+	__u32 reserved;	/* must be 0 */
+};
+
+/* Copy length bytes from src_offset to dst_offset. PCD_IOC_MOVE stays
+within the device and works like memmove(), the ranges may overlap.
+PCD_IOC_COPY copies from the flat pcd device open as src_fd, which needs
+to be open for reading. The data never leaves the kernel */
+struct pcd_move{
+	__u64 src_offset;
+	__u64 dst_offset;
+	__u64 length;
+};
+
+struct pcd_copy{
+	__s32 src_fd;
+	__u32 reserved;	/* must be 0 */
+	__u64 src_offset;
+	__u64 dst_offset;
+	__u64 length;
+};
+
+/* Bulk operations on flat devices, done under the device lock like a
+write(), readers see all of it or none. Ranges must be inside the
+devices, EINVAL otherwise. A failing operation can leave part of the
+range written */
+#define PCD_IOC_FILL		_IOW(PCD_IOC_MAGIC, 14, struct pcd_fill)
+#define PCD_IOC_MOVE		_IOW(PCD_IOC_MAGIC, 15, struct pcd_move)
+#define PCD_IOC_COPY		_IOW(PCD_IOC_MAGIC, 16, struct pcd_copy)
+
+#endif /* _PCD_IOCTL_H */
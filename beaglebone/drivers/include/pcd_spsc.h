@@ -0,0 +1,165 @@
+/*
+ * pcd_spsc.h - user space side of a PCD_MODE_SPSC pcd device
+ *
+ * One producer and one consumer exchange bytes through the mmap'ed ring
+ * of the device without any system call while both are busy:
+ *
+ *	producer				consumer
+ *	copy data at head			load head (acquire)
+ *	store head (release)	------>		copy data at tail
+ *	load tail (acquire)	<------		store tail (release)
+ *
+ * Only when one side finds nothing to do and wants to sleep does the
+ * kernel get involved. It sets its waiting flag, checks the ring once
+ * more and sleeps in poll(). The other side sees the flag after its next
+ * publish and kicks it with PCD_IOC_SPSC_WAKE. Both sides put a full
+ * barrier between their store and the load of the other side's flag, so
+ * a wakeup can't get lost.
+ *
+ * Header only, include it and call pcd_spsc_open() from both processes
+ * (or threads). The same device can be used with read() and write()
+ * from the other side as well, the driver plays the same protocol.
+ */
+#ifndef _PCD_SPSC_H
+#define _PCD_SPSC_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "pcd_ioctl.h"
+
+struct pcd_spsc{
+	int fd;
+	struct pcd_spsc_ctrl *ctrl;
+	unsigned char *data;
+	uint32_t size;
+	size_t map_len;
+};
+
+static inline int pcd_spsc_open(struct pcd_spsc *ch, const char *path){
+	long page = sysconf(_SC_PAGESIZE);
+	struct pcd_spsc_ctrl *ctrl;
+
+	memset(ch, 0, sizeof(*ch));
+	ch->fd = open(path, O_RDWR | O_CLOEXEC);
+	if(ch->fd < 0)
+		return -1;
+
+	/* The ring geometry is in the control page */
+	ctrl = mmap(NULL, page, PROT_READ, MAP_SHARED, ch->fd, 0);
+	if(ctrl == MAP_FAILED)
+		goto close;
+	ch->size = ctrl->size;
+	ch->map_len = ctrl->data_offset + ctrl->size;
+	munmap(ctrl, page);
+
+	ch->ctrl = mmap(NULL, ch->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ch->fd, 0);
+	if(ch->ctrl == MAP_FAILED)
+		goto close;
+	ch->data = (unsigned char *)ch->ctrl + ch->ctrl->data_offset;
+	return 0;
+
+close:
+	close(ch->fd);
+	ch->fd = -1;
+	return -1;
+}
+
+static inline void pcd_spsc_close(struct pcd_spsc *ch){
+	munmap(ch->ctrl, ch->map_len);
+	close(ch->fd);
+}
+
+/* Copy up to len bytes in, returns how many fit. Never blocks */
+static inline size_t pcd_spsc_write(struct pcd_spsc *ch, const void *buf, size_t len){
+	struct pcd_spsc_ctrl *ctrl = ch->ctrl;
+	uint32_t head = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+	uint32_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+	uint32_t off = head & (ch->size - 1);
+	size_t space = ch->size - (head - tail), chunk;
+
+	if(len > space)
+		len = space;
+	if(!len)
+		return 0;
+
+	chunk = len < ch->size - off ? len : ch->size - off;
+	memcpy(ch->data + off, buf, chunk);
+	memcpy(ch->data, (const unsigned char *)buf + chunk, len - chunk);
+
+	__atomic_store_n(&ctrl->head, head + (uint32_t)len, __ATOMIC_RELEASE);
+
+	/* Pairs with the barrier in pcd_spsc_wait_readable() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ctrl->consumer_waiting, __ATOMIC_RELAXED))
+		ioctl(ch->fd, PCD_IOC_SPSC_WAKE);
+	return len;
+}
+
+/* Copy up to len bytes out, returns how many there were. Never blocks */
+static inline size_t pcd_spsc_read(struct pcd_spsc *ch, void *buf, size_t len){
+	struct pcd_spsc_ctrl *ctrl = ch->ctrl;
+	uint32_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+	uint32_t off = tail & (ch->size - 1);
+	size_t avail = head - tail, chunk;
+
+	if(len > avail)
+		len = avail;
+	if(!len)
+		return 0;
+
+	chunk = len < ch->size - off ? len : ch->size - off;
+	memcpy(buf, ch->data + off, chunk);
+	memcpy((unsigned char *)buf + chunk, ch->data, len - chunk);
+
+	__atomic_store_n(&ctrl->tail, tail + (uint32_t)len, __ATOMIC_RELEASE);
+
+	/* Pairs with the barrier in pcd_spsc_wait_writable() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ctrl->producer_waiting, __ATOMIC_RELAXED))
+		ioctl(ch->fd, PCD_IOC_SPSC_WAKE);
+	return len;
+}
+
+static inline int pcd_spsc_sleep(struct pcd_spsc *ch, uint32_t *flag, short events, int timeout_ms){
+	struct pollfd pfd = { .fd = ch->fd, .events = events };
+	int ret;
+
+	__atomic_store_n(flag, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ret = poll(&pfd, 1, timeout_ms);
+	__atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+	return ret < 0 ? -errno : ret;
+}
+
+/* Sleep until there is data, after spinning spins times. Returns > 0 when
+data is there, 0 on timeout, -errno on error */
+static inline int pcd_spsc_wait_readable(struct pcd_spsc *ch, long spins, int timeout_ms){
+	struct pcd_spsc_ctrl *ctrl = ch->ctrl;
+
+	while(spins-- > 0){
+		if(__atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE) != ctrl->tail)
+			return 1;
+	}
+	return pcd_spsc_sleep(ch, &ctrl->consumer_waiting, POLLIN, timeout_ms);
+}
+
+/* Sleep until there is space, after spinning spins times */
+static inline int pcd_spsc_wait_writable(struct pcd_spsc *ch, long spins, int timeout_ms){
+	struct pcd_spsc_ctrl *ctrl = ch->ctrl;
+
+	while(spins-- > 0){
+		if(ctrl->head - __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE) != ch->size)
+			return 1;
+	}
+	return pcd_spsc_sleep(ch, &ctrl->producer_waiting, POLLOUT, timeout_ms);
+}
+
+#endif /* _PCD_SPSC_H */
@@ -0,0 +1,147 @@
+/*
+ * Tracepoints shared by the pseudo character device drivers.
+ *
+ * They show up under /sys/kernel/debug/tracing/events/pcd/ and cost a
+ * single static branch per call site while disabled, so the read/write
+ * paths no longer have to print anything to follow what user space does.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcd
+
+#if !defined(_PCD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCD_TRACE_H
+
+#include<linux/kdev_t.h>
+#include<linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(pcd_rw,
+
+	TP_PROTO(dev_t devt, loff_t pos, size_t count, ssize_t ret),
+
+	TP_ARGS(devt, pos, count, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev=%d:%d pos=%lld count=%zu ret=%zd",
+		MAJOR(__entry->devt), MINOR(__entry->devt),
+		__entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(pcd_rw, pcd_read,
+	TP_PROTO(dev_t devt, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(devt, pos, count, ret)
+);
+
+DEFINE_EVENT(pcd_rw, pcd_write,
+	TP_PROTO(dev_t devt, loff_t pos, size_t count, ssize_t ret),
+	TP_ARGS(devt, pos, count, ret)
+);
+
+TRACE_EVENT(pcd_lseek,
+
+	TP_PROTO(dev_t devt, loff_t off, int whence, loff_t ret),
+
+	TP_ARGS(devt, off, whence, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+		__field(loff_t, off)
+		__field(int, whence)
+		__field(loff_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+		__entry->off = off;
+		__entry->whence = whence;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev=%d:%d off=%lld whence=%d ret=%lld",
+		MAJOR(__entry->devt), MINOR(__entry->devt),
+		__entry->off, __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(pcd_open,
+
+	TP_PROTO(dev_t devt, unsigned int f_mode, int ret),
+
+	TP_ARGS(devt, f_mode, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+		__field(unsigned int, f_mode)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+		__entry->f_mode = f_mode;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev=%d:%d f_mode=0x%x ret=%d",
+		MAJOR(__entry->devt), MINOR(__entry->devt),
+		__entry->f_mode, __entry->ret)
+);
+
+TRACE_EVENT(pcd_release,
+
+	TP_PROTO(dev_t devt),
+
+	TP_ARGS(devt),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+	),
+
+	TP_printk("dev=%d:%d", MAJOR(__entry->devt), MINOR(__entry->devt))
+);
+
+TRACE_EVENT(pcd_resize,
+
+	TP_PROTO(dev_t devt, u64 size, int ret),
+
+	TP_ARGS(devt, size, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, devt)
+		__field(u64, size)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->devt = devt;
+		__entry->size = size;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev=%d:%d size=%llu ret=%d",
+		MAJOR(__entry->devt), MINOR(__entry->devt),
+		__entry->size, __entry->ret)
+);
+
+#endif /* _PCD_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pcd_trace
+#include <trace/define_trace.h>
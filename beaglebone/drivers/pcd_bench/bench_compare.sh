@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Compare a run_bench.sh report against a stored baseline report.
+#
+# usage: ./bench_compare.sh [-t pct] <baseline.json> <report.json>
+#
+#	-t pct	allowed throughput drop in percent (default: 10)
+#
+# Results are matched by driver, device, workload, I/O size and thread
+# count (mode for pcd_spsc_bench). A result is a regression when its
+# ops_per_sec (msgs_per_sec) fell by more than the threshold, or when it
+# has errors and the baseline had none. Results only one of the reports
+# has are listed but don't fail the comparison. The exit status is 1 if
+# there was a regression.
+#
+# Both reports should come from the same machine, the numbers of two
+# different boards say nothing about the drivers.
+
+THRESHOLD=10
+
+while getopts t: opt; do
+	case $opt in
+	t) THRESHOLD=$OPTARG ;;
+	*) echo "usage: $0 [-t pct] <baseline.json> <report.json>" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 2 ]; then
+	echo "usage: $0 [-t pct] <baseline.json> <report.json>" >&2
+	exit 2
+fi
+
+awk -v threshold="$THRESHOLD" '
+# value of "name": in a report line, up to the next , or }
+function field(line, name,    i, v){
+	i = index(line, "\"" name "\": ")
+	if(!i)
+		return ""
+	v = substr(line, i + length(name) + 4)
+	sub(/[,}].*/, "", v)
+	gsub(/"/, "", v)
+	return v
+}
+
+# run_bench.sh starts each driver with "<name>": {
+/^"[^"]*": \{/{
+	driver = $1
+	gsub(/[":]/, "", driver)
+}
+
+/"device": /{
+	device = field($0, "device")
+}
+
+/"workload": |"mode": /{
+	if(field($0, "workload") != "")
+		key = driver " " device " " field($0, "workload") " size=" field($0, "io_size") " threads=" field($0, "threads")
+	else
+		key = driver " " device " " field($0, "mode")
+	rate = field($0, "ops_per_sec")
+	if(rate == "")
+		rate = field($0, "msgs_per_sec")
+
+	if(FILENAME == ARGV[1]){
+		base[key] = rate
+		base_err[key] = field($0, "errors")
+		next
+	}
+
+	seen[key] = 1
+	if(!(key in base)){
+		printf("NEW         %s: %s/s\n", key, rate)
+		next
+	}
+	delta = base[key] > 0 ? (rate - base[key]) * 100 / base[key] : 0
+	status = "ok"
+	if(delta < -threshold)
+		status = "REGRESSION"
+	if(field($0, "errors") > 0 && base_err[key] == 0)
+		status = "ERRORS"
+	if(status != "ok")
+		failed++
+	printf("%-11s %s: %s/s -> %s/s (%+.1f%%)\n", status, key, base[key], rate, delta)
+}
+
+END{
+	for(key in base)
+		if(!(key in seen))
+			printf("MISSING     %s\n", key)
+	if(failed){
+		printf("%d result(s) regressed by more than %s%%\n", failed, threshold)
+		exit 1
+	}
+}
+' "$1" "$2"
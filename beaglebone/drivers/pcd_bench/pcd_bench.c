@@ -0,0 +1,495 @@
+/*
+ * pcd_bench - user space benchmark for the pseudo character device drivers
+ *
+ * Runs a set of workloads against one or more pcd device nodes and prints
+ * the results as a single JSON document on stdout, so that runs can be
+ * diffed or fed to a regression check.
+ *
+ * usage: pcd_bench [options] <device>[:<size>] ...
+ *
+ *	-w list		workloads to run (default: all), comma separated
+ *	-s list		I/O sizes in bytes (default: 1,64,512,4096)
+ *	-t list		thread counts (default: 1)
+ *	-n ops		operations per thread and run (default: 20000)
+ *	-r pct		percentage of reads in the mixed workload (default: 50)
+ *	-x		write random bytes instead of a repeated letter, data
+ *			that doesn't compress
+ *
+ * The buffer size of a device is probed by reading it to the end. Write
+ * only devices have to be given as <device>:<size>.
+ *
+ * The batch workloads only run on devices that support PCD_IOC_BATCH, one
+ * of their ops is a batch of BENCH_BATCH reads or writes.
+ *
+ * Devices of pcd_platform_driver report how much memory their buffer
+ * takes up in sysfs, each result carries that value as stored_bytes as
+ * of the end of the run (null for other drivers). Together with the
+ * throughput this shows what a compressed device saves and costs.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include "pcd_ioctl.h"
+
+#define MAX_LIST 16
+#define BENCH_BATCH 16
+
+struct bench_dev{
+	const char *path;
+	size_t size;
+	int readable;
+	int writable;
+	int seekable;
+	int batch;	/* PCD_IOC_BATCH works */
+	char stored_path[256];	/* sysfs stored_bytes attribute, may not exist */
+};
+
+struct thread_ctx;
+
+struct workload{
+	const char *name;
+	int need_read;
+	int need_write;
+	int need_seek;
+	int sized;	/* does the I/O size matter for this workload */
+	int (*op)(struct thread_ctx *ctx, long i);
+	int batch;	/* I/Os per op through PCD_IOC_BATCH, 0 for plain syscalls */
+};
+
+struct thread_ctx{
+	pthread_t tid;
+	pthread_barrier_t *barrier;
+	const struct workload *wl;
+	const struct bench_dev *dev;
+	int fd;
+	int open_flags;
+	size_t io_size;
+	long ops;
+	int read_pct;
+	uint64_t rnd;
+	char *buf;
+	uint64_t *lat;
+	long errors;
+};
+
+static long nr_ops = 20000;
+static int read_pct = 50;
+static int random_fill;
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64, rand() would serialize the threads on its lock */
+static uint64_t next_rand(struct thread_ctx *ctx){
+	ctx->rnd ^= ctx->rnd << 13;
+	ctx->rnd ^= ctx->rnd >> 7;
+	ctx->rnd ^= ctx->rnd << 17;
+	return ctx->rnd;
+}
+
+static off_t seq_off(struct thread_ctx *ctx, long i){
+	long slots = ctx->dev->size / ctx->io_size;
+
+	return (off_t)(i % slots) * ctx->io_size;
+}
+
+static off_t rand_off(struct thread_ctx *ctx){
+	return next_rand(ctx) % (ctx->dev->size - ctx->io_size + 1);
+}
+
+static int op_seqread(struct thread_ctx *ctx, long i){
+	return pread(ctx->fd, ctx->buf, ctx->io_size, seq_off(ctx, i)) < 0 ? -1 : 0;
+}
+
+static int op_seqwrite(struct thread_ctx *ctx, long i){
+	return pwrite(ctx->fd, ctx->buf, ctx->io_size, seq_off(ctx, i)) < 0 ? -1 : 0;
+}
+
+static int op_randread(struct thread_ctx *ctx, long i){
+	return pread(ctx->fd, ctx->buf, ctx->io_size, rand_off(ctx)) < 0 ? -1 : 0;
+}
+
+static int op_randwrite(struct thread_ctx *ctx, long i){
+	return pwrite(ctx->fd, ctx->buf, ctx->io_size, rand_off(ctx)) < 0 ? -1 : 0;
+}
+
+static int op_mixed(struct thread_ctx *ctx, long i){
+	if((int)(next_rand(ctx) % 100) < ctx->read_pct)
+		return op_randread(ctx, i);
+	return op_randwrite(ctx, i);
+}
+
+static int op_openclose(struct thread_ctx *ctx, long i){
+	int fd = open(ctx->dev->path, ctx->open_flags);
+
+	if(fd < 0)
+		return -1;
+	return close(fd);
+}
+
+/* lseek() to a random offset followed by a read, the pre pread() idiom */
+static int op_lseek(struct thread_ctx *ctx, long i){
+	if(lseek(ctx->fd, rand_off(ctx), SEEK_SET) < 0)
+		return -1;
+	return read(ctx->fd, ctx->buf, ctx->io_size) < 0 ? -1 : 0;
+}
+
+/* BENCH_BATCH random I/Os of io_size in one PCD_IOC_BATCH call */
+static int op_batch(struct thread_ctx *ctx, int op){
+	struct pcd_batch_op ops[BENCH_BATCH];
+	struct pcd_batch batch = {
+		.ops = (uintptr_t)ops,
+		.count = BENCH_BATCH,
+	};
+	int i;
+
+	for(i = 0; i < BENCH_BATCH; i++){
+		memset(&ops[i], 0, sizeof(ops[i]));
+		ops[i].op = op;
+		ops[i].offset = rand_off(ctx);
+		ops[i].len = ctx->io_size;
+		ops[i].buf = (uintptr_t)(ctx->buf + i * ctx->io_size);
+	}
+	if(ioctl(ctx->fd, PCD_IOC_BATCH, &batch) < 0)
+		return -1;
+	for(i = 0; i < BENCH_BATCH; i++)
+		if(ops[i].result < 0)
+			return -1;
+	return 0;
+}
+
+static int op_batchread(struct thread_ctx *ctx, long i){
+	return op_batch(ctx, PCD_BATCH_READ);
+}
+
+static int op_batchwrite(struct thread_ctx *ctx, long i){
+	return op_batch(ctx, PCD_BATCH_WRITE);
+}
+
+static const struct workload workloads[] = {
+	{ "seqread",   1, 0, 1, 1, op_seqread },
+	{ "seqwrite",  0, 1, 1, 1, op_seqwrite },
+	{ "randread",  1, 0, 1, 1, op_randread },
+	{ "randwrite", 0, 1, 1, 1, op_randwrite },
+	{ "mixed",     1, 1, 1, 1, op_mixed },
+	{ "openclose", 0, 0, 0, 0, op_openclose },
+	{ "lseek",     1, 0, 1, 1, op_lseek },
+	{ "batchread", 1, 0, 1, 1, op_batchread, BENCH_BATCH },
+	{ "batchwrite", 0, 1, 1, 1, op_batchwrite, BENCH_BATCH },
+};
+
+#define NR_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void *bench_thread(void *arg){
+	struct thread_ctx *ctx = arg;
+	uint64_t t0, t1;
+	long i;
+
+	pthread_barrier_wait(ctx->barrier);
+
+	for(i = 0; i < ctx->ops; i++){
+		t0 = now_ns();
+		if(ctx->wl->op(ctx, i))
+			ctx->errors++;
+		t1 = now_ns();
+		ctx->lat[i] = t1 - t0;
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, long n, double p){
+	long idx = (long)(p * (n - 1) + 0.5);
+
+	return sorted[idx];
+}
+
+/* Memory the device buffer takes up right now, -1 if it isn't known */
+static long long stored_bytes(const struct bench_dev *dev){
+	long long val = -1;
+	FILE *f = fopen(dev->stored_path, "r");
+
+	if(!f)
+		return -1;
+	if(fscanf(f, "%lld", &val) != 1)
+		val = -1;
+	fclose(f);
+	return val;
+}
+
+static int open_flags(const struct workload *wl, const struct bench_dev *dev){
+	if(wl->need_read && wl->need_write)
+		return O_RDWR;
+	if(wl->need_write)
+		return O_WRONLY;
+	if(wl->need_read || dev->readable)
+		return O_RDONLY;
+	return O_WRONLY;
+}
+
+/* Run one workload with one I/O size and thread count, print a JSON record */
+static int run_one(const struct workload *wl, const struct bench_dev *dev,
+		   size_t io_size, int threads, int *first){
+	struct thread_ctx *ctx;
+	pthread_barrier_t barrier;
+	uint64_t *lat, t0, t1;
+	long total, errors = 0;
+	size_t buf_size = io_size * (wl->batch ? wl->batch : 1);
+	long long stored;
+	char stored_str[32];
+	double secs;
+	size_t j;
+	int t, ret = -1;
+
+	ctx = calloc(threads, sizeof(*ctx));
+	lat = calloc((size_t)threads * nr_ops, sizeof(*lat));
+	if(!ctx || !lat)
+		goto out;
+	for(t = 0; t < threads; t++)
+		ctx[t].fd = -1;
+
+	/* Open everything up front, the clock starts once all threads are ready */
+	for(t = 0; t < threads; t++){
+		ctx[t].barrier = &barrier;
+		ctx[t].wl = wl;
+		ctx[t].dev = dev;
+		ctx[t].open_flags = open_flags(wl, dev);
+		ctx[t].io_size = io_size;
+		ctx[t].ops = nr_ops;
+		ctx[t].read_pct = read_pct;
+		ctx[t].rnd = 0x9e3779b97f4a7c15ull * (t + 1);
+		ctx[t].lat = lat + (size_t)t * nr_ops;
+		ctx[t].buf = aligned_alloc(4096, (buf_size + 4095) & ~(size_t)4095);
+		ctx[t].fd = open(dev->path, ctx[t].open_flags);
+		if(!ctx[t].buf || ctx[t].fd < 0){
+			fprintf(stderr, "%s: open: %s\n", dev->path, strerror(errno));
+			goto close;
+		}
+		if(random_fill){
+			for(j = 0; j < buf_size; j++)
+				ctx[t].buf[j] = next_rand(&ctx[t]);
+		}
+		else
+			memset(ctx[t].buf, 'a' + t % 26, buf_size);
+	}
+
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+	for(t = 0; t < threads; t++)
+		pthread_create(&ctx[t].tid, NULL, bench_thread, &ctx[t]);
+
+	t0 = now_ns();
+	pthread_barrier_wait(&barrier);
+	for(t = 0; t < threads; t++)
+		pthread_join(ctx[t].tid, NULL);
+	t1 = now_ns();
+	pthread_barrier_destroy(&barrier);
+
+	total = (long)threads * nr_ops;
+	for(t = 0; t < threads; t++)
+		errors += ctx[t].errors;
+	qsort(lat, total, sizeof(*lat), cmp_u64);
+	secs = (t1 - t0) / 1e9;
+
+	stored = stored_bytes(dev);
+	if(stored < 0)
+		strcpy(stored_str, "null");
+	else
+		snprintf(stored_str, sizeof(stored_str), "%lld", stored);
+
+	printf("%s\n\t\t\t{\"workload\": \"%s\", \"io_size\": %zu, \"threads\": %d, "
+	       "\"ops\": %ld, \"errors\": %ld, \"elapsed_s\": %.6f, "
+	       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, "
+	       "\"lat_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, "
+	       "\"stored_bytes\": %s}",
+	       *first ? "" : ",", wl->name, wl->sized ? io_size : 0, threads,
+	       total, errors, secs, total / secs,
+	       wl->sized ? (double)(total - errors) * buf_size / secs / 1e6 : 0.0,
+	       (unsigned long long)percentile(lat, total, 0.50),
+	       (unsigned long long)percentile(lat, total, 0.99),
+	       (unsigned long long)percentile(lat, total, 0.999),
+	       (unsigned long long)lat[total - 1], stored_str);
+	*first = 0;
+	ret = 0;
+
+close:
+	for(t = 0; t < threads; t++){
+		if(ctx[t].fd >= 0)
+			close(ctx[t].fd);
+		free(ctx[t].buf);
+	}
+out:
+	free(lat);
+	free(ctx);
+	return ret;
+}
+
+/* Work out size and access rights of a device node */
+static int probe_dev(struct bench_dev *dev, char *arg){
+	char *colon = strrchr(arg, ':');
+	char buf[65536];
+	ssize_t n;
+	int fd;
+
+	dev->path = arg;
+	if(colon){
+		*colon = '\0';
+		dev->size = strtoul(colon + 1, NULL, 0);
+	}
+	snprintf(dev->stored_path, sizeof(dev->stored_path), "/sys/class/pcd_class/%s/stored_bytes",
+		 strrchr(dev->path, '/') ? strrchr(dev->path, '/') + 1 : dev->path);
+
+	dev->readable = access(dev->path, R_OK) == 0;
+	dev->writable = access(dev->path, W_OK) == 0;
+
+	/* Permission checks of the drivers are stricter than the node mode */
+	fd = open(dev->path, O_RDONLY | O_NONBLOCK);
+	if(fd < 0){
+		dev->readable = 0;
+		fd = open(dev->path, O_WRONLY | O_NONBLOCK);
+		if(fd < 0){
+			fprintf(stderr, "%s: %s\n", dev->path, strerror(errno));
+			return -1;
+		}
+	}
+	else{
+		int wfd = open(dev->path, O_WRONLY | O_NONBLOCK);
+
+		if(wfd < 0)
+			dev->writable = 0;
+		else
+			close(wfd);
+	}
+
+	dev->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+
+	/* An empty batch is a no-op on devices that know the ioctl */
+	{
+		struct pcd_batch batch = { 0 };
+
+		dev->batch = ioctl(fd, PCD_IOC_BATCH, &batch) == 0;
+	}
+
+	if(!dev->size && dev->readable && dev->seekable){
+		while((n = pread(fd, buf, sizeof(buf), dev->size)) > 0)
+			dev->size += n;
+	}
+	close(fd);
+
+	if(dev->seekable && !dev->size){
+		fprintf(stderr, "%s: unknown size, pass it as %s:<size>\n", dev->path, dev->path);
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_list(const char *arg, long *out){
+	char *dup = strdup(arg), *tok, *save = NULL;
+	int n = 0;
+
+	for(tok = strtok_r(dup, ",", &save); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &save))
+		out[n++] = strtol(tok, NULL, 0);
+	free(dup);
+	return n;
+}
+
+static int workload_selected(const char *list, const char *name){
+	size_t len = strlen(name);
+	const char *p = list;
+
+	if(!list)
+		return 1;
+	while((p = strstr(p, name))){
+		if((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [-w workloads] [-s sizes] [-t threads] [-n ops] [-r read%%] [-x] <device>[:<size>] ...\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	long sizes[MAX_LIST] = { 1, 64, 512, 4096 }, threads[MAX_LIST] = { 1 };
+	int nr_sizes = 4, nr_threads = 1;
+	const char *wl_list = NULL;
+	struct bench_dev dev;
+	struct utsname uts;
+	int opt, d, s, t, first_dev = 1, ret = 0;
+	size_t w;
+
+	while((opt = getopt(argc, argv, "w:s:t:n:r:xh")) != -1){
+		switch(opt){
+		case 'w': wl_list = optarg; break;
+		case 's': nr_sizes = parse_list(optarg, sizes); break;
+		case 't': nr_threads = parse_list(optarg, threads); break;
+		case 'n': nr_ops = strtol(optarg, NULL, 0); break;
+		case 'r': read_pct = atoi(optarg); break;
+		case 'x': random_fill = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind >= argc || nr_ops <= 0)
+		usage(argv[0]);
+
+	uname(&uts);
+	printf("{\n\t\"kernel\": \"%s\",\n\t\"machine\": \"%s\",\n\t\"cpus\": %ld,\n"
+	       "\t\"ops_per_run\": %ld,\n\t\"timestamp\": %ld,\n\t\"devices\": [",
+	       uts.release, uts.machine, sysconf(_SC_NPROCESSORS_ONLN), nr_ops, (long)time(NULL));
+
+	for(d = optind; d < argc; d++){
+		int first = 1;
+
+		memset(&dev, 0, sizeof(dev));
+		if(probe_dev(&dev, argv[d])){
+			ret = 1;
+			continue;
+		}
+
+		printf("%s\n\t\t{\"device\": \"%s\", \"size\": %zu, \"results\": [",
+		       first_dev ? "" : ",", dev.path, dev.size);
+		first_dev = 0;
+
+		for(w = 0; w < NR_WORKLOADS; w++){
+			const struct workload *wl = &workloads[w];
+
+			if(!workload_selected(wl_list, wl->name))
+				continue;
+			if((wl->need_read && !dev.readable) || (wl->need_write && !dev.writable) ||
+			   (wl->need_seek && !dev.seekable) || (wl->batch && !dev.batch))
+				continue;
+
+			for(s = 0; s < (wl->sized ? nr_sizes : 1); s++){
+				if(wl->sized && (sizes[s] <= 0 || (size_t)sizes[s] > dev.size))
+					continue;
+				for(t = 0; t < nr_threads; t++){
+					if(run_one(wl, &dev, wl->sized ? sizes[s] : 0, threads[t], &first))
+						ret = 1;
+				}
+			}
+		}
+		printf("\n\t\t]}");
+	}
+	printf("\n\t]\n}\n");
+	return ret;
+}
@@ -0,0 +1,219 @@
+/*
+ * pcd_shard_bench - write throughput of many writers into one pcd device
+ *
+ * Writer threads, one per CPU, each write a fixed number of small records
+ * while one reader thread drains the device. The device is either in
+ * PCD_MODE_SHARD, where every CPU writes its own ring, or a
+ * PCD_MODE_FIFO device given with -f, the single shared buffer the shards
+ * are compared with. The writers are run with every thread count of -t
+ * and the results are printed as JSON, in the format of pcd_bench so that
+ * bench_compare.sh can check them against a baseline.
+ *
+ * usage: pcd_shard_bench [options] <device>
+ *
+ *	-t list		writer thread counts (default: 1,2,4,8)
+ *	-n recs		records per writer and run (default: 100000)
+ *	-s size		record size in bytes (default: 64)
+ *	-f		the device is a FIFO, read a byte stream instead of
+ *			pcd_shard_rec records
+ *
+ * Writer n is pinned to CPU n modulo the number of CPUs, the reader is
+ * left to the scheduler. For a shard device the reader also counts the
+ * records that came out older than the one before them.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "pcd_ioctl.h"
+
+#define MAX_LIST 16
+#define READ_BUF 65536
+
+static long nr_recs = 100000;
+static size_t rec_size = 64;
+static int stream;
+static long ncpus;
+
+struct run{
+	const char *path;
+	int threads;
+	pthread_barrier_t barrier;
+	long errors;	/* updated with __atomic builtins */
+	long out_of_order;
+	uint64_t w_start, w_end;	/* first writer started, last writer done */
+};
+
+struct writer{
+	pthread_t tid;
+	struct run *r;
+	int id;
+};
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *writer_thread(void *arg){
+	struct writer *w = arg;
+	struct run *r = w->r;
+	char *msg = malloc(rec_size);
+	cpu_set_t set;
+	uint64_t end, last;
+	long i, errors = 0;
+	int fd;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->id % ncpus, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	memset(msg, 'a' + w->id % 26, rec_size);
+	fd = open(r->path, O_WRONLY);
+	pthread_barrier_wait(&r->barrier);
+
+	for(i = 0; i < nr_recs; i++)
+		if(fd < 0 || write(fd, msg, rec_size) != (ssize_t)rec_size)
+			errors++;
+
+	end = now_ns();
+	__atomic_fetch_add(&r->errors, errors, __ATOMIC_RELAXED);
+	last = __atomic_load_n(&r->w_end, __ATOMIC_RELAXED);
+	while(last < end && !__atomic_compare_exchange_n(&r->w_end, &last, end, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	if(fd >= 0)
+		close(fd);
+	free(msg);
+	return NULL;
+}
+
+/* Drain everything the writers put in */
+static void *reader_thread(void *arg){
+	struct run *r = arg;
+	char *buf = malloc(READ_BUF);
+	uint64_t want, got = 0, last_ts = 0;
+	ssize_t n, off;
+	int fd = open(r->path, O_RDONLY);
+
+	want = stream ? (uint64_t)r->threads * nr_recs * rec_size : (uint64_t)r->threads * nr_recs;
+	pthread_barrier_wait(&r->barrier);
+
+	while(fd >= 0 && got < want){
+		n = read(fd, buf, READ_BUF);
+		if(n < 0){
+			__atomic_fetch_add(&r->errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		if(stream){
+			got += n;
+			continue;
+		}
+		for(off = 0; off + (ssize_t)sizeof(struct pcd_shard_rec) <= n; got++){
+			struct pcd_shard_rec rec;
+
+			memcpy(&rec, buf + off, sizeof(rec));
+			if(rec.ts_ns < last_ts)
+				r->out_of_order++;
+			last_ts = rec.ts_ns;
+			off += (sizeof(rec) + rec.len + PCD_SHARD_ALIGN - 1) & ~(size_t)(PCD_SHARD_ALIGN - 1);
+		}
+	}
+	if(fd >= 0)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int run(const char *path, int threads, int *first){
+	struct run r = { .path = path, .threads = threads };
+	struct writer *w = calloc(threads, sizeof(*w));
+	pthread_t reader;
+	double secs;
+	long total = (long)threads * nr_recs;
+	int t;
+
+	pthread_barrier_init(&r.barrier, NULL, threads + 2);
+	pthread_create(&reader, NULL, reader_thread, &r);
+	for(t = 0; t < threads; t++){
+		w[t].r = &r;
+		w[t].id = t;
+		pthread_create(&w[t].tid, NULL, writer_thread, &w[t]);
+	}
+
+	pthread_barrier_wait(&r.barrier);
+	r.w_start = now_ns();
+	for(t = 0; t < threads; t++)
+		pthread_join(w[t].tid, NULL);
+	pthread_join(reader, NULL);
+	pthread_barrier_destroy(&r.barrier);
+
+	secs = (r.w_end - r.w_start) / 1e9;
+	printf("%s\n\t\t\t{\"workload\": \"logwrite\", \"io_size\": %zu, \"threads\": %d, "
+	       "\"ops\": %ld, \"errors\": %ld, \"elapsed_s\": %.6f, "
+	       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"out_of_order\": %ld}",
+	       *first ? "" : ",", rec_size, threads, total, r.errors, secs,
+	       total / secs, (double)total * rec_size / secs / 1e6, r.out_of_order);
+	*first = 0;
+	free(w);
+	return r.errors ? -1 : 0;
+}
+
+static int parse_list(const char *arg, long *out){
+	char *dup = strdup(arg), *tok, *save = NULL;
+	int n = 0;
+
+	for(tok = strtok_r(dup, ",", &save); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &save))
+		out[n++] = strtol(tok, NULL, 0);
+	free(dup);
+	return n;
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [-t threads] [-n recs] [-s size] [-f] <device>\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	long threads[MAX_LIST] = { 1, 2, 4, 8 };
+	int nr_threads = 4, opt, t, first = 1, ret = 0;
+	const char *path;
+
+	while((opt = getopt(argc, argv, "t:n:s:fh")) != -1){
+		switch(opt){
+		case 't': nr_threads = parse_list(optarg, threads); break;
+		case 'n': nr_recs = strtol(optarg, NULL, 0); break;
+		case 's': rec_size = strtoul(optarg, NULL, 0); break;
+		case 'f': stream = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1 || nr_recs <= 0 || !rec_size)
+		usage(argv[0]);
+	path = argv[optind];
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(access(path, R_OK | W_OK)){
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	printf("{\n\t\"cpus\": %ld,\n\t\"devices\": [\n\t\t{\"device\": \"%s\", \"format\": \"%s\", \"results\": [",
+	       ncpus, path, stream ? "stream" : "shard");
+	for(t = 0; t < nr_threads; t++){
+		if(threads[t] <= 0)
+			continue;
+		if(run(path, threads[t], &first))
+			ret = 1;
+	}
+	printf("\n\t\t]}\n\t]\n}\n");
+	return ret;
+}
@@ -0,0 +1,236 @@
+/*
+ * pcd_spsc_bench - one way message latency through a PCD_MODE_SPSC device
+ *
+ * A producer thread sends fixed size messages stamped with CLOCK_MONOTONIC
+ * and a consumer thread records how long each one took to arrive. The same
+ * device is driven twice, once through the mmap ring (pcd_spsc.h) and once
+ * with plain write() and read(), and both results are printed as JSON.
+ *
+ * usage: pcd_spsc_bench [options] <device>
+ *
+ *	-n msgs		messages per run (default: 100000)
+ *	-s size		message size in bytes, at least 8 (default: 64)
+ *	-i ns		gap between two messages (default: 10000)
+ *	-p spins	times the mmap consumer polls the ring before it
+ *			goes to sleep in poll() (default: 1000)
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pcd_spsc.h"
+
+static long nr_msgs = 100000;
+static size_t msg_size = 64;
+static uint64_t gap_ns = 10000;
+static long spins = 1000;
+
+struct run{
+	const char *mode;
+	const char *path;
+	struct pcd_spsc ch;	/* mmap mode */
+	int wfd, rfd;		/* read/write mode */
+	uint64_t *lat;
+	long errors;
+};
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pace(uint64_t until){
+	while(now_ns() < until)
+		;
+}
+
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void *mmap_producer(void *arg){
+	struct run *r = arg;
+	unsigned char *msg = calloc(1, msg_size);
+	uint64_t next = now_ns();
+	size_t done;
+	long i;
+
+	for(i = 0; i < nr_msgs; i++){
+		uint64_t stamp;
+
+		pace(next);
+		next += gap_ns;
+		stamp = now_ns();
+		memcpy(msg, &stamp, sizeof(stamp));
+		for(done = 0; done < msg_size; ){
+			done += pcd_spsc_write(&r->ch, msg + done, msg_size - done);
+			if(done < msg_size && pcd_spsc_wait_writable(&r->ch, spins, -1) < 0)
+				r->errors++;
+		}
+	}
+	free(msg);
+	return NULL;
+}
+
+static void *mmap_consumer(void *arg){
+	struct run *r = arg;
+	unsigned char *msg = calloc(1, msg_size);
+	uint64_t stamp;
+	size_t done;
+	long i;
+
+	for(i = 0; i < nr_msgs; i++){
+		for(done = 0; done < msg_size; ){
+			done += pcd_spsc_read(&r->ch, msg + done, msg_size - done);
+			if(done < msg_size && pcd_spsc_wait_readable(&r->ch, spins, -1) < 0)
+				r->errors++;
+		}
+		memcpy(&stamp, msg, sizeof(stamp));
+		r->lat[i] = now_ns() - stamp;
+	}
+	free(msg);
+	return NULL;
+}
+
+static void *rw_producer(void *arg){
+	struct run *r = arg;
+	unsigned char *msg = calloc(1, msg_size);
+	uint64_t next = now_ns();
+	ssize_t n;
+	size_t done;
+	long i;
+
+	for(i = 0; i < nr_msgs; i++){
+		uint64_t stamp;
+
+		pace(next);
+		next += gap_ns;
+		stamp = now_ns();
+		memcpy(msg, &stamp, sizeof(stamp));
+		for(done = 0; done < msg_size; done += n){
+			n = write(r->wfd, msg + done, msg_size - done);
+			if(n < 0){
+				r->errors++;
+				n = 0;
+			}
+		}
+	}
+	free(msg);
+	return NULL;
+}
+
+static void *rw_consumer(void *arg){
+	struct run *r = arg;
+	unsigned char *msg = calloc(1, msg_size);
+	uint64_t stamp;
+	ssize_t n;
+	size_t done;
+	long i;
+
+	for(i = 0; i < nr_msgs; i++){
+		for(done = 0; done < msg_size; done += n){
+			n = read(r->rfd, msg + done, msg_size - done);
+			if(n < 0){
+				r->errors++;
+				n = 0;
+			}
+		}
+		memcpy(&stamp, msg, sizeof(stamp));
+		r->lat[i] = now_ns() - stamp;
+	}
+	free(msg);
+	return NULL;
+}
+
+static int run(struct run *r, void *(*producer)(void *), void *(*consumer)(void *), int *first){
+	pthread_t prod, cons;
+	uint64_t t0, t1;
+	double secs;
+
+	r->lat = calloc(nr_msgs, sizeof(*r->lat));
+	if(!r->lat)
+		return -1;
+
+	t0 = now_ns();
+	pthread_create(&cons, NULL, consumer, r);
+	pthread_create(&prod, NULL, producer, r);
+	pthread_join(prod, NULL);
+	pthread_join(cons, NULL);
+	t1 = now_ns();
+
+	qsort(r->lat, nr_msgs, sizeof(*r->lat), cmp_u64);
+	secs = (t1 - t0) / 1e9;
+
+	printf("%s\n\t\t{\"mode\": \"%s\", \"msgs\": %ld, \"errors\": %ld, \"elapsed_s\": %.6f, "
+	       "\"msgs_per_sec\": %.1f, "
+	       "\"lat_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+	       *first ? "" : ",", r->mode, nr_msgs, r->errors, secs, nr_msgs / secs,
+	       (unsigned long long)r->lat[(long)(0.50 * (nr_msgs - 1) + 0.5)],
+	       (unsigned long long)r->lat[(long)(0.99 * (nr_msgs - 1) + 0.5)],
+	       (unsigned long long)r->lat[(long)(0.999 * (nr_msgs - 1) + 0.5)],
+	       (unsigned long long)r->lat[nr_msgs - 1]);
+	*first = 0;
+	free(r->lat);
+	return r->errors ? -1 : 0;
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [-n msgs] [-s size] [-i gap_ns] [-p spins] <device>\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	struct run mm = { .mode = "mmap" }, rw = { .mode = "rw" };
+	int opt, first = 1, ret = 0;
+	const char *path;
+
+	while((opt = getopt(argc, argv, "n:s:i:p:h")) != -1){
+		switch(opt){
+		case 'n': nr_msgs = strtol(optarg, NULL, 0); break;
+		case 's': msg_size = strtoul(optarg, NULL, 0); break;
+		case 'i': gap_ns = strtoull(optarg, NULL, 0); break;
+		case 'p': spins = strtol(optarg, NULL, 0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1 || nr_msgs <= 0 || msg_size < sizeof(uint64_t))
+		usage(argv[0]);
+	path = argv[optind];
+
+	if(pcd_spsc_open(&mm.ch, path)){
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if(msg_size > mm.ch.size){
+		fprintf(stderr, "%s: message larger than the %u byte ring\n", path, mm.ch.size);
+		return 1;
+	}
+
+	rw.wfd = open(path, O_WRONLY);
+	rw.rfd = open(path, O_RDONLY);
+	if(rw.wfd < 0 || rw.rfd < 0){
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	printf("{\"device\": \"%s\", \"ring_size\": %u, \"msg_size\": %zu, \"gap_ns\": %llu, \"results\": [",
+	       path, mm.ch.size, msg_size, (unsigned long long)gap_ns);
+	if(run(&mm, mmap_producer, mmap_consumer, &first))
+		ret = 1;
+	if(run(&rw, rw_producer, rw_consumer, &first))
+		ret = 1;
+	printf("\n\t]}\n");
+
+	close(rw.wfd);
+	close(rw.rfd);
+	pcd_spsc_close(&mm.ch);
+	return ret;
+}
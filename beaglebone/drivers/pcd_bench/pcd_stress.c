@@ -0,0 +1,257 @@
+/*
+ * pcd_stress - concurrent readers and writers on one pcd device
+ *
+ * Writer threads keep rewriting the whole buffer of a flat device with
+ * one write() each while reader threads read it back with one pread()
+ * each. Every write fills the buffer with a pattern of its own, byte i
+ * of write g is (g + i) & 0xff, so a read that sees parts of two writes
+ * doesn't follow the pattern and is counted as torn. The readers are run
+ * with every thread count of -t to show how reads scale, the results are
+ * printed as JSON in the format of pcd_bench.
+ *
+ * usage: pcd_stress [options] <device>[:<size>]
+ *
+ *	-t list		reader thread counts (default: 1,2,4,8)
+ *	-w writers	writer threads (default: 1)
+ *	-d secs		duration of each run (default: 2)
+ *	-i usecs	pause of a writer between writes (default: 100), 0
+ *			keeps the device write locked most of the time
+ *
+ * The buffer size is probed by reading the device to the end unless it
+ * is given. The exit status is 1 if any read was torn or failed.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST 16
+
+static int nr_writers = 1;
+static double duration = 2;
+static long pause_us = 100;
+static size_t dev_size;
+
+struct run{
+	const char *path;
+	int readers;
+	pthread_barrier_t barrier;
+	volatile int stop;
+	long reads;	/* updated with __atomic builtins */
+	long writes;
+	long torn;
+	long errors;
+};
+
+struct worker{
+	pthread_t tid;
+	struct run *r;
+	int id;
+};
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fill(unsigned char *buf, unsigned gen){
+	size_t i;
+
+	for(i = 0; i < dev_size; i++)
+		buf[i] = gen + i;
+}
+
+/* A read is whole if it is one write's pattern from start to end */
+static int torn(const unsigned char *buf){
+	unsigned char gen = buf[0];
+	size_t i;
+
+	for(i = 1; i < dev_size; i++)
+		if(buf[i] != (unsigned char)(gen + i))
+			return 1;
+	return 0;
+}
+
+static void *writer_thread(void *arg){
+	struct worker *w = arg;
+	struct run *r = w->r;
+	unsigned char *buf = malloc(dev_size);
+	unsigned gen = w->id;
+	long writes = 0, errors = 0;
+	int fd = open(r->path, O_WRONLY);
+
+	pthread_barrier_wait(&r->barrier);
+
+	while(!r->stop){
+		/* Writers use different generations, the readers can't tell
+		them apart otherwise */
+		gen += nr_writers;
+		fill(buf, gen);
+		if(fd < 0 || pwrite(fd, buf, dev_size, 0) != (ssize_t)dev_size)
+			errors++;
+		else
+			writes++;
+		if(pause_us)
+			usleep(pause_us);
+	}
+
+	__atomic_fetch_add(&r->writes, writes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->errors, errors, __ATOMIC_RELAXED);
+	if(fd >= 0)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void *reader_thread(void *arg){
+	struct worker *w = arg;
+	struct run *r = w->r;
+	unsigned char *buf = malloc(dev_size);
+	long reads = 0, bad = 0, errors = 0;
+	int fd = open(r->path, O_RDONLY);
+
+	pthread_barrier_wait(&r->barrier);
+
+	while(!r->stop){
+		if(fd < 0 || pread(fd, buf, dev_size, 0) != (ssize_t)dev_size){
+			errors++;
+			continue;
+		}
+		reads++;
+		bad += torn(buf);
+	}
+
+	__atomic_fetch_add(&r->reads, reads, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->torn, bad, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&r->errors, errors, __ATOMIC_RELAXED);
+	if(fd >= 0)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+static int run(const char *path, int readers, int *first){
+	struct run r = { .path = path, .readers = readers };
+	int nr = readers + nr_writers, t;
+	struct worker *w = calloc(nr, sizeof(*w));
+	uint64_t start;
+	double secs;
+
+	pthread_barrier_init(&r.barrier, NULL, nr + 1);
+	for(t = 0; t < nr; t++){
+		w[t].r = &r;
+		w[t].id = t < readers ? t : t - readers;
+		pthread_create(&w[t].tid, NULL, t < readers ? reader_thread : writer_thread, &w[t]);
+	}
+
+	pthread_barrier_wait(&r.barrier);
+	start = now_ns();
+	usleep(duration * 1e6);
+	r.stop = 1;
+	for(t = 0; t < nr; t++)
+		pthread_join(w[t].tid, NULL);
+	secs = (now_ns() - start) / 1e9;
+	pthread_barrier_destroy(&r.barrier);
+
+	printf("%s\n\t\t\t{\"workload\": \"stress_read\", \"io_size\": %zu, \"threads\": %d, "
+	       "\"ops\": %ld, \"errors\": %ld, \"elapsed_s\": %.6f, "
+	       "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"writes\": %ld, \"torn\": %ld}",
+	       *first ? "" : ",", dev_size, readers, r.reads, r.errors + r.torn, secs,
+	       r.reads / secs, (double)r.reads * dev_size / secs / 1e6, r.writes, r.torn);
+	*first = 0;
+	free(w);
+	return (r.errors || r.torn) ? -1 : 0;
+}
+
+/* Size of a readable device, read to the end */
+static size_t probe_size(const char *path){
+	char buf[4096];
+	size_t size = 0;
+	ssize_t n;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0)
+		return 0;
+	while((n = read(fd, buf, sizeof(buf))) > 0)
+		size += n;
+	close(fd);
+	return size;
+}
+
+static int parse_list(const char *arg, long *out){
+	char *dup = strdup(arg), *tok, *save = NULL;
+	int n = 0;
+
+	for(tok = strtok_r(dup, ",", &save); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &save))
+		out[n++] = strtol(tok, NULL, 0);
+	free(dup);
+	return n;
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [-t readers] [-w writers] [-d secs] [-i usecs] <device>[:<size>]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	long readers[MAX_LIST] = { 1, 2, 4, 8 };
+	int nr_readers = 4, opt, t, first = 1, ret = 0, fd;
+	unsigned char *buf;
+	char *path, *colon;
+
+	while((opt = getopt(argc, argv, "t:w:d:i:h")) != -1){
+		switch(opt){
+		case 't': nr_readers = parse_list(optarg, readers); break;
+		case 'w': nr_writers = atoi(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		case 'i': pause_us = strtol(optarg, NULL, 0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1 || nr_writers <= 0 || duration <= 0)
+		usage(argv[0]);
+
+	path = strdup(argv[optind]);
+	colon = strchr(path, ':');
+	if(colon){
+		*colon = '\0';
+		dev_size = strtoul(colon + 1, NULL, 0);
+	}
+	else
+		dev_size = probe_size(path);
+	if(!dev_size){
+		fprintf(stderr, "%s: can't tell the buffer size\n", path);
+		return 1;
+	}
+
+	/* The readers must never see anything but a pattern, not even
+	before the first writer got to the device */
+	buf = malloc(dev_size);
+	fill(buf, 0);
+	fd = open(path, O_WRONLY);
+	if(fd < 0 || pwrite(fd, buf, dev_size, 0) != (ssize_t)dev_size){
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	close(fd);
+	free(buf);
+
+	printf("{\n\t\"cpus\": %ld,\n\t\"devices\": [\n\t\t{\"device\": \"%s\", \"writers\": %d, \"results\": [",
+	       sysconf(_SC_NPROCESSORS_ONLN), path, nr_writers);
+	for(t = 0; t < nr_readers; t++){
+		if(readers[t] <= 0)
+			continue;
+		if(run(path, readers[t], &first))
+			ret = 1;
+	}
+	printf("\n\t\t]}\n\t]\n}\n");
+	return ret;
+}
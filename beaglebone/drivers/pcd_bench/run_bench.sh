@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# Load each pcd driver built with 'make host', benchmark its device nodes
+# with pcd_bench and collect everything in one JSON report.
+#
+# usage: sudo ./run_bench.sh [report.json]
+#
+# Extra pcd_bench options can be passed through BENCH_ARGS, for example
+# BENCH_ARGS="-t 1,2,4,8 -s 64,4096 -n 100000", and pcd_spsc_bench options
+# through SPSC_ARGS, pcd_shard_bench options through SHARD_ARGS and
+# pcd_stress options through STRESS_ARGS.
+#
+# With BASELINE=<old report> the new report is compared against it with
+# bench_compare.sh, the run fails if a result got more than THRESHOLD
+# percent (default 10) slower or started to see errors.
+#
+# pcdev-4 is compressed, compare its throughput and stored_bytes with
+# the plain devices. BENCH_ARGS=-x fills it with data that doesn't
+# compress. pcdev-5 is pcdev-1 in integrity mode, the difference between
+# the two is the cost of the CRC32C checks.
+#
+# The drivers all register the same "pcd_class", so they are loaded one
+# at a time. The pcd core module they share stays loaded for the whole run.
+
+set -e
+
+cd "$(dirname "$0")"
+DRIVERS=..
+REPORT=${1:-pcd_bench.json}
+
+[ -x ./pcd_bench ] && [ -x ./pcd_spsc_bench ] && [ -x ./pcd_shard_bench ] && [ -x ./pcd_stress ] || make host
+
+# run_driver <name> <module dir> <modules...> -- <device nodes...>
+# The benchmark is pcd_bench unless BENCH says otherwise
+run_driver(){
+	name=$1 dir=$2
+	shift 2
+	mods=
+	while [ "$1" != "--" ]; do
+		mods="$mods $1"
+		shift
+	done
+	shift
+
+	for m in $mods; do
+		insmod "$dir/$m.ko"
+	done
+	udevadm settle 2>/dev/null || sleep 1
+
+	printf '"%s": ' "$name"
+	${BENCH:-./pcd_bench $BENCH_ARGS} "$@" || status=1
+
+	for m in $(echo $mods | tr ' ' '\n' | tac); do
+		rmmod "$m"
+	done
+}
+
+insmod $DRIVERS/pcd_core/pcd_core.ko
+
+status=0
+{
+	echo "{"
+	run_driver pcd $DRIVERS/002psuedochar pcd -- /dev/pcd
+	echo ","
+	# pcd-2 is write only, its size can't be probed by reading it
+	run_driver pcd_n $DRIVERS/003psuedocharmultiple pcd_n -- \
+		/dev/pcd-1 /dev/pcd-2:1024 /dev/pcd-3 /dev/pcd-4
+	echo ","
+	run_driver pcd_platform_driver $DRIVERS/004PcdPlatformDriver \
+		pcd_platform_driver pcd_device_setup -- /dev/pcdev-0 /dev/pcdev-1 /dev/pcdev-2 /dev/pcdev-4 /dev/pcdev-5
+	echo ","
+	# mmap ring against read/write on the SPSC device
+	BENCH="./pcd_spsc_bench $SPSC_ARGS" run_driver pcd_spsc $DRIVERS/004PcdPlatformDriver \
+		pcd_platform_driver pcd_device_setup -- /dev/pcdev-3
+	echo ","
+	# Writers on every CPU into the per CPU rings of pcdev-6, then into the
+	# one shared ring of the FIFO device pcdev-2
+	BENCH="./pcd_shard_bench $SHARD_ARGS" run_driver pcd_shard $DRIVERS/004PcdPlatformDriver \
+		pcd_platform_driver pcd_device_setup -- /dev/pcdev-6
+	echo ","
+	BENCH="./pcd_shard_bench -f $SHARD_ARGS" run_driver pcd_shard_fifo $DRIVERS/004PcdPlatformDriver \
+		pcd_platform_driver pcd_device_setup -- /dev/pcdev-2
+	echo ","
+	# Readers against a writer rewriting the whole buffer, a torn read
+	# fails the run
+	BENCH="./pcd_stress $STRESS_ARGS" run_driver pcd_stress $DRIVERS/004PcdPlatformDriver \
+		pcd_platform_driver pcd_device_setup -- /dev/pcdev-1
+	echo "}"
+} > "$REPORT"
+
+rmmod pcd_core
+
+echo "report written to $REPORT" >&2
+
+if [ -n "$BASELINE" ]; then
+	./bench_compare.sh -t "${THRESHOLD:-10}" "$BASELINE" "$REPORT" >&2 || status=1
+fi
+exit $status
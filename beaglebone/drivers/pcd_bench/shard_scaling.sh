@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Measure how writes into the per CPU rings of the shard device (pcdev-6)
+# scale with the writer count against the one shared ring of the FIFO
+# device (pcdev-2), and print the results as rows of the table in
+# README.md.
+#
+# usage: sudo ./shard_scaling.sh
+#        ./shard_scaling.sh <shard.json> <fifo.json>
+#
+# Without arguments the platform driver built with 'make host' is loaded
+# and pcd_shard_bench is run against both devices, with the thread counts
+# of THREADS (default 1,2,4,8) and extra options from SHARD_ARGS. The
+# reports are kept as shard.json and fifo.json. Given two reports of
+# pcd_shard_bench it only prints their rows.
+#
+# Run it on a host with at least as many CPUs as the largest thread
+# count, on one CPU the shards have nothing to scale with.
+
+DRIVERS=..
+THREADS=${THREADS:-1,2,4,8}
+
+if [ $# -eq 0 ]; then
+	cd "$(dirname "$0")"
+	[ -x ./pcd_shard_bench ] || make host || exit 1
+
+	insmod $DRIVERS/pcd_core/pcd_core.ko || exit 1
+	insmod $DRIVERS/004PcdPlatformDriver/pcd_platform_driver.ko || exit 1
+	insmod $DRIVERS/004PcdPlatformDriver/pcd_device_setup.ko || exit 1
+	udevadm settle 2>/dev/null || sleep 1
+
+	status=0
+	./pcd_shard_bench -t "$THREADS" $SHARD_ARGS /dev/pcdev-6 > shard.json || status=1
+	./pcd_shard_bench -t "$THREADS" -f $SHARD_ARGS /dev/pcdev-2 > fifo.json || status=1
+
+	rmmod pcd_device_setup
+	rmmod pcd_platform_driver
+	rmmod pcd_core
+	[ $status -eq 0 ] || { echo "pcd_shard_bench failed" >&2; exit 1; }
+	set -- shard.json fifo.json
+elif [ $# -ne 2 ]; then
+	echo "usage: $0 [<shard.json> <fifo.json>]" >&2
+	exit 2
+fi
+
+machine="$(uname -m), $(nproc) CPUs"
+kernel=$(uname -r)
+date=$(date +%Y-%m-%d)
+
+awk -v machine="$machine" -v kernel="$kernel" -v date="$date" '
+# value of "name": in a report line, up to the next , or }
+function field(line, name,    i, v){
+	i = index(line, "\"" name "\": ")
+	if(!i)
+		return ""
+	v = substr(line, i + length(name) + 4)
+	sub(/[,}].*/, "", v)
+	return v
+}
+
+FNR == 1 { file++ }
+
+/"workload"/ {
+	t = field($0, "threads")
+	ops[file, t] = field($0, "ops_per_sec")
+	if(file == 1)
+		threads[++n] = t
+}
+
+END {
+	for(i = 1; i <= n; i++){
+		t = threads[i]
+		printf("| %s | %s | %s | %s | %.0f | %.0f |\n", date, machine, kernel, t, ops[1, t], ops[2, t])
+	}
+	if(n > 1 && ops[1, threads[1]] > 0 && ops[2, threads[1]] > 0){
+		t = threads[n]
+		printf("shard %.2fx, fifo %.2fx from %s to %s writers\n",
+		       ops[1, t] / ops[1, threads[1]], ops[2, t] / ops[2, threads[1]], threads[1], t) > "/dev/stderr"
+	}
+}' "$1" "$2"
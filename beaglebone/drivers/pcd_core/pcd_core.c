@@ -0,0 +1,293 @@
+#include<linux/module.h>
+#include<linux/cdev.h>
+#include<linux/fs.h>
+#include<linux/kdev_t.h>
+#include<linux/mm.h>
+#include<linux/rwsem.h>
+#include<linux/uio.h>
+#include<linux/ktime.h>
+#include "pcd_core.h"
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s:" fmt, __func__
+
+#define CREATE_TRACE_POINTS
+#include "pcd_trace.h"
+
+/* The drivers trace their own events as well */
+EXPORT_TRACEPOINT_SYMBOL_GPL(pcd_read);
+EXPORT_TRACEPOINT_SYMBOL_GPL(pcd_write);
+EXPORT_TRACEPOINT_SYMBOL_GPL(pcd_lseek);
+EXPORT_TRACEPOINT_SYMBOL_GPL(pcd_open);
+EXPORT_TRACEPOINT_SYMBOL_GPL(pcd_release);
+EXPORT_TRACEPOINT_SYMBOL_GPL(pcd_resize);
+
+void pcd_core_init(struct pcd_core_dev *dev, const struct pcd_backend_ops *ops, void *priv, size_t size, int perm){
+	dev->ops = ops;
+	dev->priv = priv;
+	dev->size = size;
+	dev->data_len = 0;
+	dev->perm = perm;
+	init_rwsem(&dev->lock);
+}
+EXPORT_SYMBOL_GPL(pcd_core_init);
+
+/* Make the device reachable through devt, the owner module is pinned
+while it is open */
+int pcd_core_add(struct pcd_core_dev *dev, const struct file_operations *fops, struct module *owner, dev_t devt){
+	dev->devt = devt;
+	cdev_init(&dev->cdev, fops);
+	dev->cdev.owner = owner;
+	return cdev_add(&dev->cdev, devt, 1);
+}
+EXPORT_SYMBOL_GPL(pcd_core_add);
+
+void pcd_core_del(struct pcd_core_dev *dev){
+	cdev_del(&dev->cdev);
+}
+EXPORT_SYMBOL_GPL(pcd_core_del);
+
+/* Move the end of the written data up to end, never down. Page faults of
+the platform driver get here without the device lock */
+void pcd_core_data_len_extend(struct pcd_core_dev *dev, size_t end){
+	size_t old = READ_ONCE(dev->data_len);
+	size_t prev;
+
+	while(old < end){
+		prev = cmpxchg(&dev->data_len, old, end);
+		if(prev == old)
+			break;
+		old = prev;
+	}
+}
+EXPORT_SYMBOL_GPL(pcd_core_data_len_extend);
+
+int pcd_core_check_permission(int perm, int mode){
+	if(perm == RDWR){
+		return 0;
+	}
+	else if(perm == RDONLY){
+		if((mode & FMODE_READ) && !(mode & FMODE_WRITE)){
+			return 0;
+		}
+	}
+	else if(perm == WRONLY){
+		if(!(mode & FMODE_READ) && (mode & FMODE_WRITE)){
+			return 0;
+		}
+	}
+	return -EPERM;
+}
+EXPORT_SYMBOL_GPL(pcd_core_check_permission);
+
+int pcd_core_open(struct inode *p_inode, struct file *filep){
+	struct pcd_core_dev *dev = container_of(p_inode->i_cdev, struct pcd_core_dev, cdev);
+	int ret;
+
+	/* To supply device private data to other methods of the driver */
+	filep->private_data = dev;
+
+	ret = pcd_core_check_permission(dev->perm, filep->f_mode);
+	if(ret)
+		pr_debug("Minor %d refused f_mode 0x%x, permission is %x\n", MINOR(p_inode->i_rdev), filep->f_mode, dev->perm);
+
+	trace_pcd_open(dev->devt, filep->f_mode, ret);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(pcd_core_open);
+
+int pcd_core_release(struct inode *p_inode, struct file *filep){
+	struct pcd_core_dev *dev = filep->private_data;
+
+	trace_pcd_release(dev->devt);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(pcd_core_release);
+
+/* Positioned I/O goes through ki_pos and never touches f_pos. Concurrent
+readers don't exclude each other, a resize waits for them to finish */
+ssize_t pcd_core_read_iter(struct kiocb *iocb, struct iov_iter *to){
+	struct pcd_core_dev *dev = iocb->ki_filp->private_data;
+	loff_t pos = iocb->ki_pos;
+	size_t req = iov_iter_count(to);
+	size_t count = req;
+	u64 start = dev->ops->account ? ktime_get_ns() : 0;
+	ssize_t ret = 0;
+
+	down_read(&dev->lock);
+
+	/* Nothing to read at or past the end of the device */
+	if(pos >= dev->size)
+		goto unlock;
+
+	if(count > dev->size - pos)
+		count = dev->size - pos;
+
+	ret = dev->ops->read(dev, pos, count, to);
+	if(!ret && count)
+		ret = -EFAULT;
+	if(ret > 0)
+		iocb->ki_pos += ret;
+
+unlock:
+	up_read(&dev->lock);
+
+	trace_pcd_read(dev->devt, pos, req, ret);
+	if(dev->ops->account)
+		dev->ops->account(dev, PCD_DIR_READ, req, ret, start);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(pcd_core_read_iter);
+
+/* Writers are exclusive so readers never see a half written range */
+ssize_t pcd_core_write_iter(struct kiocb *iocb, struct iov_iter *from){
+	struct pcd_core_dev *dev = iocb->ki_filp->private_data;
+	loff_t pos = iocb->ki_pos;
+	size_t req = iov_iter_count(from);
+	size_t count = req;
+	u64 start = dev->ops->account ? ktime_get_ns() : 0;
+	ssize_t ret;
+
+	if(!count)
+		return 0;
+
+	down_write(&dev->lock);
+
+	if(pos >= dev->size){
+		pr_debug("No space remaining on device to write new bytes\n");
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	if(count > dev->size - pos)
+		count = dev->size - pos;
+
+	ret = dev->ops->write(dev, pos, count, from);
+	if(!ret)
+		ret = -EFAULT;
+	if(ret > 0){
+		pcd_core_data_len_extend(dev, pos + ret);
+		iocb->ki_pos += ret;
+	}
+
+unlock:
+	up_write(&dev->lock);
+
+	trace_pcd_write(dev->devt, pos, req, ret);
+	if(dev->ops->account)
+		dev->ops->account(dev, PCD_DIR_WRITE, req, ret, start);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(pcd_core_write_iter);
+
+/* read() and write() of threads sharing an fd race on f_pos, so lseek is
+only needed by readers that want to skip around. SEEK_DATA and SEEK_HOLE
+ask the backend which pages hold data if it can tell, everything from
+the end of the written data on is one hole */
+loff_t pcd_core_lseek(struct file *filep, loff_t off, int whence){
+	struct pcd_core_dev *dev = filep->private_data;
+	loff_t max_data, data_len, tmp;
+	unsigned long idx, nr_pages;
+
+	/* A resize must not change the size under SEEK_DATA/SEEK_HOLE */
+	down_read(&dev->lock);
+	max_data = dev->size;
+	data_len = READ_ONCE(dev->data_len);
+	nr_pages = PAGE_ALIGN(dev->size) >> PAGE_SHIFT;
+
+	switch(whence){
+		case SEEK_SET:
+			tmp = off;
+			break;
+		case SEEK_CUR:
+			tmp = filep->f_pos + off;
+			break;
+		case SEEK_END:
+			tmp = data_len + off;
+			break;
+		case SEEK_DATA:
+			if((off < 0) || (off >= data_len)){
+				tmp = -ENXIO;
+				goto out;
+			}
+			tmp = off;
+			if(dev->ops->present == NULL)
+				break;
+			idx = off >> PAGE_SHIFT;
+			while((idx < nr_pages) && !dev->ops->present(dev, idx))
+				idx++;
+			tmp = max_t(loff_t, off, (loff_t)idx << PAGE_SHIFT);
+			if(tmp >= data_len){
+				tmp = -ENXIO;
+				goto out;
+			}
+			break;
+		case SEEK_HOLE:
+			if((off < 0) || (off >= data_len)){
+				tmp = -ENXIO;
+				goto out;
+			}
+			tmp = data_len;
+			if(dev->ops->present == NULL)
+				break;
+			idx = off >> PAGE_SHIFT;
+			if(!dev->ops->present(dev, idx)){
+				tmp = off;
+				break;
+			}
+			while((idx < nr_pages) && dev->ops->present(dev, idx))
+				idx++;
+			tmp = min_t(loff_t, data_len, (loff_t)idx << PAGE_SHIFT);
+			break;
+		default:
+			tmp = -EINVAL;
+			goto out;
+	};
+
+	if((tmp > max_data) || (tmp < 0)){
+		tmp = -EINVAL;
+		goto out;
+	}
+	filep->f_pos = tmp;
+
+out:
+	up_read(&dev->lock);
+	trace_pcd_lseek(dev->devt, off, whence, tmp);
+	return tmp;
+}
+EXPORT_SYMBOL_GPL(pcd_core_lseek);
+
+const struct file_operations pcd_core_fops = {
+	.owner = THIS_MODULE,
+	.open = pcd_core_open,
+	.read_iter = pcd_core_read_iter,
+	.write_iter = pcd_core_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.llseek = pcd_core_lseek,
+	.release = pcd_core_release,
+};
+EXPORT_SYMBOL_GPL(pcd_core_fops);
+
+static ssize_t pcd_core_array_read(struct pcd_core_dev *dev, size_t pos, size_t count, struct iov_iter *to){
+	char *buffer = dev->priv;
+
+	return copy_to_iter(buffer + pos, count, to);
+}
+
+static ssize_t pcd_core_array_write(struct pcd_core_dev *dev, size_t pos, size_t count, struct iov_iter *from){
+	char *buffer = dev->priv;
+
+	return copy_from_iter(buffer + pos, count, from);
+}
+
+const struct pcd_backend_ops pcd_core_array_ops = {
+	.read = pcd_core_array_read,
+	.write = pcd_core_array_write,
+};
+EXPORT_SYMBOL_GPL(pcd_core_array_ops);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jakkampudi Venkata Dinesh");
+MODULE_DESCRIPTION("Shared I/O core of the pseudo character device drivers");
+MODULE_INFO(board, "BEAGLE BONE BLACK");
@@ -0,0 +1,273 @@
+#include<kunit/test.h>
+#include<linux/fs.h>
+#include<linux/mm.h>
+#include<linux/slab.h>
+#include<linux/uio.h>
+#include "pcd_core.h"
+
+/* KUnit suite of the rules every flat device follows, see pcd_core.h.
+The tests drive pcd_core_read_iter(), pcd_core_write_iter() and
+pcd_core_lseek() the way the VFS does, through a struct file over a
+buffer in kernel memory with pcd_core_array_ops behind it. No device
+node is involved.
+
+Needs a kernel with KUnit (5.7 or later to build it as a module), run it
+with kunit.py or load it and read the results from the kernel log */
+
+#define PCD_TEST_SIZE 64
+
+struct pcd_test_ctx{
+	struct pcd_core_dev dev;
+	struct file *filep;
+	char buffer[PCD_TEST_SIZE];
+};
+
+static int pcd_test_init(struct kunit *test){
+	struct pcd_test_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if(ctx == NULL)
+		return -ENOMEM;
+
+	/* Only f_mode, f_pos and private_data are looked at by the core */
+	ctx->filep = kunit_kzalloc(test, sizeof(*ctx->filep), GFP_KERNEL);
+	if(ctx->filep == NULL)
+		return -ENOMEM;
+
+	pcd_core_init(&ctx->dev, &pcd_core_array_ops, ctx->buffer, PCD_TEST_SIZE, RDWR);
+	ctx->filep->f_mode = FMODE_READ | FMODE_WRITE;
+	ctx->filep->private_data = &ctx->dev;
+	test->priv = ctx;
+	return 0;
+}
+
+/* One read() or write() of len bytes at pos, *end is ki_pos afterwards */
+static ssize_t pcd_test_io(struct pcd_test_ctx *ctx, int dir, loff_t pos, void *buf, size_t len, loff_t *end){
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	struct iov_iter iter;
+	struct kiocb iocb;
+	ssize_t ret;
+
+	init_sync_kiocb(&iocb, ctx->filep);
+	iocb.ki_pos = pos;
+	iov_iter_kvec(&iter, dir, &kv, 1, len);
+
+	if(dir == READ)
+		ret = pcd_core_read_iter(&iocb, &iter);
+	else
+		ret = pcd_core_write_iter(&iocb, &iter);
+
+	if(end)
+		*end = iocb.ki_pos;
+	return ret;
+}
+
+static void pcd_test_write_read(struct kunit *test){
+	struct pcd_test_ctx *ctx = test->priv;
+	char in[16], out[16];
+	loff_t end;
+
+	memset(in, 0x5a, sizeof(in));
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, 8, in, sizeof(in), &end), (ssize_t)sizeof(in));
+	KUNIT_EXPECT_EQ(test, end, (loff_t)(8 + sizeof(in)));
+	KUNIT_EXPECT_EQ(test, ctx->dev.data_len, (size_t)(8 + sizeof(in)));
+
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, READ, 8, out, sizeof(out), &end), (ssize_t)sizeof(out));
+	KUNIT_EXPECT_EQ(test, end, (loff_t)(8 + sizeof(out)));
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, sizeof(in)), 0);
+}
+
+/* Writes across the end are cut short, at or past it they fail */
+static void pcd_test_write_bounds(struct kunit *test){
+	struct pcd_test_ctx *ctx = test->priv;
+	char in[16] = { 0 };
+	loff_t end;
+
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, PCD_TEST_SIZE - 4, in, sizeof(in), &end), (ssize_t)4);
+	KUNIT_EXPECT_EQ(test, end, (loff_t)PCD_TEST_SIZE);
+	KUNIT_EXPECT_EQ(test, ctx->dev.data_len, (size_t)PCD_TEST_SIZE);
+
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, PCD_TEST_SIZE, in, sizeof(in), &end), (ssize_t)-ENOMEM);
+	KUNIT_EXPECT_EQ(test, end, (loff_t)PCD_TEST_SIZE);
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, PCD_TEST_SIZE + 100, in, sizeof(in), NULL), (ssize_t)-ENOMEM);
+
+	/* Nothing to write is no error, not even past the end */
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, PCD_TEST_SIZE, in, 0, NULL), (ssize_t)0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.data_len, (size_t)PCD_TEST_SIZE);
+}
+
+/* Reads across the end are cut short, at or past it they return 0 */
+static void pcd_test_read_bounds(struct kunit *test){
+	struct pcd_test_ctx *ctx = test->priv;
+	char out[16];
+	loff_t end;
+
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, READ, PCD_TEST_SIZE - 4, out, sizeof(out), &end), (ssize_t)4);
+	KUNIT_EXPECT_EQ(test, end, (loff_t)PCD_TEST_SIZE);
+
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, READ, PCD_TEST_SIZE, out, sizeof(out), &end), (ssize_t)0);
+	KUNIT_EXPECT_EQ(test, end, (loff_t)PCD_TEST_SIZE);
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, READ, PCD_TEST_SIZE + 100, out, sizeof(out), NULL), (ssize_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, READ, 0, out, 0, NULL), (ssize_t)0);
+}
+
+/* The end of the data only ever moves up */
+static void pcd_test_data_len(struct kunit *test){
+	struct pcd_test_ctx *ctx = test->priv;
+	char in[4] = { 0 };
+
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, 32, in, sizeof(in), NULL), (ssize_t)sizeof(in));
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, 0, in, sizeof(in), NULL), (ssize_t)sizeof(in));
+	KUNIT_EXPECT_EQ(test, ctx->dev.data_len, (size_t)36);
+
+	pcd_core_data_len_extend(&ctx->dev, 10);
+	KUNIT_EXPECT_EQ(test, ctx->dev.data_len, (size_t)36);
+	pcd_core_data_len_extend(&ctx->dev, 40);
+	KUNIT_EXPECT_EQ(test, ctx->dev.data_len, (size_t)40);
+}
+
+static ssize_t pcd_test_fault_io(struct pcd_core_dev *dev, size_t pos, size_t count, struct iov_iter *iter){
+	return 0;
+}
+
+/* A backend that copied nothing hit a bad user buffer */
+static void pcd_test_fault(struct kunit *test){
+	static const struct pcd_backend_ops fault_ops = {
+		.read = pcd_test_fault_io,
+		.write = pcd_test_fault_io,
+	};
+	struct pcd_test_ctx *ctx = test->priv;
+	char buf[8] = { 0 };
+	loff_t end;
+
+	ctx->dev.ops = &fault_ops;
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, READ, 0, buf, sizeof(buf), &end), (ssize_t)-EFAULT);
+	KUNIT_EXPECT_EQ(test, end, (loff_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, 0, buf, sizeof(buf), &end), (ssize_t)-EFAULT);
+	KUNIT_EXPECT_EQ(test, end, (loff_t)0);
+	KUNIT_EXPECT_EQ(test, ctx->dev.data_len, (size_t)0);
+}
+
+static void pcd_test_check_permission(struct kunit *test){
+	int rd = FMODE_READ, wr = FMODE_WRITE, rdwr = FMODE_READ | FMODE_WRITE;
+
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(RDWR, rd), 0);
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(RDWR, wr), 0);
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(RDWR, rdwr), 0);
+
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(RDONLY, rd), 0);
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(RDONLY, wr), -EPERM);
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(RDONLY, rdwr), -EPERM);
+
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(WRONLY, rd), -EPERM);
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(WRONLY, wr), 0);
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(WRONLY, rdwr), -EPERM);
+
+	/* Anything else is no permission at all */
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(0, rd), -EPERM);
+	KUNIT_EXPECT_EQ(test, pcd_core_check_permission(RDONLY, 0), -EPERM);
+}
+
+static void pcd_test_lseek(struct kunit *test){
+	struct pcd_test_ctx *ctx = test->priv;
+	struct file *filep = ctx->filep;
+	char in[10] = { 0 };
+
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 20, SEEK_SET), (loff_t)20);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 5, SEEK_CUR), (loff_t)25);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, -25, SEEK_CUR), (loff_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, PCD_TEST_SIZE, SEEK_SET), (loff_t)PCD_TEST_SIZE);
+
+	/* Out of the device, f_pos stays where it was */
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, PCD_TEST_SIZE + 1, SEEK_SET), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, -1, SEEK_SET), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 1, SEEK_CUR), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 0, 42), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, filep->f_pos, (loff_t)PCD_TEST_SIZE);
+
+	/* SEEK_END is relative to the data written, not the size */
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 0, SEEK_END), (loff_t)0);
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, 0, in, sizeof(in), NULL), (ssize_t)sizeof(in));
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 0, SEEK_END), (loff_t)10);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, -4, SEEK_END), (loff_t)6);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, PCD_TEST_SIZE - 10, SEEK_END), (loff_t)PCD_TEST_SIZE);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, PCD_TEST_SIZE - 9, SEEK_END), (loff_t)-EINVAL);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, -11, SEEK_END), (loff_t)-EINVAL);
+}
+
+/* Without a present() callback everything below the end of the data is
+data and the rest one hole */
+static void pcd_test_lseek_data_hole(struct kunit *test){
+	struct pcd_test_ctx *ctx = test->priv;
+	struct file *filep = ctx->filep;
+	char in[10] = { 0 };
+
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 0, SEEK_DATA), (loff_t)-ENXIO);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 0, SEEK_HOLE), (loff_t)-ENXIO);
+
+	KUNIT_EXPECT_EQ(test, pcd_test_io(ctx, WRITE, 0, in, sizeof(in), NULL), (ssize_t)sizeof(in));
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 3, SEEK_DATA), (loff_t)3);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 3, SEEK_HOLE), (loff_t)10);
+	KUNIT_EXPECT_EQ(test, filep->f_pos, (loff_t)10);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 10, SEEK_DATA), (loff_t)-ENXIO);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 10, SEEK_HOLE), (loff_t)-ENXIO);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, -1, SEEK_DATA), (loff_t)-ENXIO);
+	KUNIT_EXPECT_EQ(test, filep->f_pos, (loff_t)10);
+}
+
+/* Only page 1 and 2 of a four page device hold data */
+static bool pcd_test_present(struct pcd_core_dev *dev, unsigned long idx){
+	return (idx == 1) || (idx == 2);
+}
+
+static void pcd_test_lseek_sparse(struct kunit *test){
+	static const struct pcd_backend_ops sparse_ops = {
+		.read = pcd_test_fault_io,
+		.write = pcd_test_fault_io,
+		.present = pcd_test_present,
+	};
+	struct pcd_test_ctx *ctx = test->priv;
+	struct file *filep = ctx->filep;
+	loff_t size = 4 * PAGE_SIZE;
+
+	/* lseek never touches the storage, the device needs none */
+	pcd_core_init(&ctx->dev, &sparse_ops, NULL, size, RDWR);
+	pcd_core_data_len_extend(&ctx->dev, size);
+
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 0, SEEK_DATA), (loff_t)PAGE_SIZE);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, PAGE_SIZE + 5, SEEK_DATA), (loff_t)(PAGE_SIZE + 5));
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 3 * PAGE_SIZE, SEEK_DATA), (loff_t)-ENXIO);
+
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 5, SEEK_HOLE), (loff_t)5);
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, PAGE_SIZE, SEEK_HOLE), (loff_t)(3 * PAGE_SIZE));
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, 3 * PAGE_SIZE + 1, SEEK_HOLE), (loff_t)(3 * PAGE_SIZE + 1));
+
+	/* A hole at the end of the data is cut at the end of the data */
+	ctx->dev.data_len = 2 * PAGE_SIZE + 100;
+	KUNIT_EXPECT_EQ(test, pcd_core_lseek(filep, PAGE_SIZE, SEEK_HOLE), (loff_t)(2 * PAGE_SIZE + 100));
+}
+
+static struct kunit_case pcd_core_test_cases[] = {
+	KUNIT_CASE(pcd_test_write_read),
+	KUNIT_CASE(pcd_test_write_bounds),
+	KUNIT_CASE(pcd_test_read_bounds),
+	KUNIT_CASE(pcd_test_data_len),
+	KUNIT_CASE(pcd_test_fault),
+	KUNIT_CASE(pcd_test_check_permission),
+	KUNIT_CASE(pcd_test_lseek),
+	KUNIT_CASE(pcd_test_lseek_data_hole),
+	KUNIT_CASE(pcd_test_lseek_sparse),
+	{}
+};
+
+static struct kunit_suite pcd_core_test_suite = {
+	.name = "pcd_core",
+	.init = pcd_test_init,
+	.test_cases = pcd_core_test_cases,
+};
+kunit_test_suite(pcd_core_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jakkampudi Venkata Dinesh");
+MODULE_DESCRIPTION("KUnit tests of the shared pcd core");
+MODULE_INFO(board, "BEAGLE BONE BLACK");
@@ -0,0 +1,143 @@
+/*
+ * pcd_import_test - share a pcd buffer with the pcd_importer module
+ *
+ * Writes a pattern to a flat pcd device, exports its buffer as a dma-buf
+ * and hands the dma-buf to /dev/pcd_importer, which maps it and checks
+ * that it sees the pattern, then fills it with a byte of its own. The
+ * device must read back what the importer wrote. A read only export must
+ * be refused for writing. Results are printed as TAP.
+ *
+ * usage: pcd_import_test [-w secs] <device>
+ *
+ *	-w secs		close the device and wait before the import, time to
+ *			remove it (rmmod pcd_device_setup). The dma-buf must
+ *			still work, the read back is skipped then
+ *
+ * Load pcd_importer.ko and the platform driver first.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "pcd_ioctl.h"
+#include "pcd_importer.h"
+
+static int tests, failed;
+
+static void result(int ok, const char *what){
+	printf("%sok %d - %s\n", ok ? "" : "not ", ++tests, what);
+	if(!ok)
+		failed++;
+}
+
+/* CRC-32 as zlib computes it, crc32_le() in the kernel with ~0 in and out */
+static uint32_t crc32(uint32_t crc, const unsigned char *buf, size_t len){
+	int i;
+
+	crc = ~crc;
+	while(len--){
+		crc ^= *buf++;
+		for(i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static int export(int fd, int flags){
+	struct pcd_dmabuf_export exp = { .flags = flags | O_CLOEXEC };
+
+	if(ioctl(fd, PCD_IOC_EXPORT_DMABUF, &exp))
+		return -1;
+	return exp.fd;
+}
+
+int main(int argc, char **argv){
+	struct pcd_import_check chk;
+	unsigned char *buf, *back;
+	const char *path;
+	uint64_t size;
+	int opt, wait_s = 0, fd, imp, dfd, i;
+	uint32_t crc;
+
+	while((opt = getopt(argc, argv, "w:h")) != -1){
+		switch(opt){
+		case 'w': wait_s = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-w secs] <device>\n", argv[0]);
+			return 2;
+		}
+	}
+	if(optind != argc - 1){
+		fprintf(stderr, "usage: %s [-w secs] <device>\n", argv[0]);
+		return 2;
+	}
+	path = argv[optind];
+
+	imp = open("/dev/pcd_importer", O_RDWR);
+	fd = open(path, O_RDWR);
+	if(imp < 0 || fd < 0){
+		fprintf(stderr, "%s: %s\n", imp < 0 ? "/dev/pcd_importer" : path, strerror(errno));
+		return 1;
+	}
+	if(ioctl(fd, PCD_IOC_GET_SIZE, &size)){
+		perror("PCD_IOC_GET_SIZE");
+		return 1;
+	}
+
+	printf("TAP version 13\n1..%d\n", wait_s ? 4 : 6);
+
+	/* The dma-buf covers whole pages, the tail past the size is zeros */
+	buf = calloc(1, size + 65536);
+	back = malloc(size);
+	srand(getpid());
+	for(i = 0; i < (int)size; i++)
+		buf[i] = rand();
+	result(pwrite(fd, buf, size, 0) == (ssize_t)size, "write the pattern");
+
+	dfd = export(fd, O_RDWR);
+	result(dfd >= 0, "export read/write");
+	if(dfd < 0)
+		return 1;
+
+	if(wait_s){
+		close(fd);
+		fd = -1;
+		fprintf(stderr, "# device closed, remove it now, importing in %d s\n", wait_s);
+		sleep(wait_s);
+	}
+
+	memset(&chk, 0, sizeof(chk));
+	chk.fd = dfd;
+	chk.flags = PCD_IMPORT_FILL;
+	chk.fill = 0xa5;
+	result(!ioctl(imp, PCD_IMPORTER_IOC_CHECK, &chk), "import, map and fill");
+	crc = crc32(0, buf, chk.size);
+	result(chk.size >= size && chk.crc == crc, "importer sees the pattern");
+	printf("# size %llu, %u DMA segments\n", (unsigned long long)chk.size, chk.nents);
+	close(dfd);
+
+	if(fd >= 0){
+		memset(buf, 0xa5, size);
+		result((pread(fd, back, size, 0) == (ssize_t)size) && !memcmp(back, buf, size),
+		       "device reads what the importer wrote");
+
+		dfd = export(fd, O_RDONLY);
+		memset(&chk, 0, sizeof(chk));
+		chk.fd = dfd;
+		chk.flags = PCD_IMPORT_FILL;
+		result((dfd >= 0) && ioctl(imp, PCD_IMPORTER_IOC_CHECK, &chk) && (errno == EACCES),
+		       "read only export can't be written");
+		if(dfd >= 0)
+			close(dfd);
+		close(fd);
+	}
+
+	close(imp);
+	free(buf);
+	free(back);
+	return failed ? 1 : 0;
+}
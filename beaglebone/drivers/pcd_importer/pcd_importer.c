@@ -0,0 +1,152 @@
+#include<linux/module.h>
+#include<linux/fs.h>
+#include<linux/miscdevice.h>
+#include<linux/platform_device.h>
+#include<linux/dma-buf.h>
+#include<linux/dma-mapping.h>
+#include<linux/scatterlist.h>
+#include<linux/crc32.h>
+#include<linux/uaccess.h>
+#include "pcd_importer.h"
+
+#undef pr_fmt
+#define pr_fmt(fmt) "%s:" fmt, __func__
+
+/* Test importer of the dma-bufs pcd_platform_driver exports. It stands in
+for a device driver that shares the buffer of a pcd device, see
+pcd_import_test.c for the user space side */
+
+/* The device the dma-bufs are attached to and mapped for. A platform
+device with a DMA mask, the misc device has none */
+static struct platform_device *pcd_importer_pdev;
+
+/* Import chk->fd, map it and look at it with the CPU */
+static int pcd_importer_check(struct pcd_import_check *chk){
+	enum dma_data_direction dir = (chk->flags & PCD_IMPORT_FILL) ? DMA_BIDIRECTIONAL : DMA_TO_DEVICE;
+	struct dma_buf_attachment *attach;
+	struct dma_buf *dmabuf;
+	struct sg_table *sgt;
+	void *vaddr;
+	int ret;
+
+	dmabuf = dma_buf_get(chk->fd);
+	if(IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	/* Honour the access mode the exporter gave the dma-buf */
+	if((chk->flags & PCD_IMPORT_FILL) && !(dmabuf->file->f_mode & FMODE_WRITE)){
+		ret = -EACCES;
+		goto put;
+	}
+
+	attach = dma_buf_attach(dmabuf, &pcd_importer_pdev->dev);
+	if(IS_ERR(attach)){
+		ret = PTR_ERR(attach);
+		goto put;
+	}
+
+	sgt = dma_buf_map_attachment(attach, dir);
+	if(IS_ERR(sgt)){
+		ret = PTR_ERR(sgt);
+		goto detach;
+	}
+	chk->nents = sgt->nents;
+	chk->size = dmabuf->size;
+
+	ret = dma_buf_begin_cpu_access(dmabuf, dir);
+	if(ret)
+		goto unmap;
+
+	vaddr = dma_buf_vmap(dmabuf);
+	if(vaddr == NULL){
+		ret = -ENOMEM;
+		goto end_access;
+	}
+
+	chk->crc = crc32_le(~0, vaddr, dmabuf->size) ^ ~0;
+	if(chk->flags & PCD_IMPORT_FILL)
+		memset(vaddr, chk->fill, dmabuf->size);
+
+	dma_buf_vunmap(dmabuf, vaddr);
+end_access:
+	if(dma_buf_end_cpu_access(dmabuf, dir) && !ret)
+		ret = -EIO;
+unmap:
+	dma_buf_unmap_attachment(attach, sgt, dir);
+detach:
+	dma_buf_detach(dmabuf, attach);
+put:
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
+static long pcd_importer_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+	void __user *argp = (void __user *)arg;
+	struct pcd_import_check chk;
+	int ret;
+
+	if(cmd != PCD_IMPORTER_IOC_CHECK)
+		return -ENOTTY;
+
+	if(copy_from_user(&chk, argp, sizeof(chk)))
+		return -EFAULT;
+	if((chk.flags & ~PCD_IMPORT_FILL) || (chk.fill > 0xff))
+		return -EINVAL;
+
+	ret = pcd_importer_check(&chk);
+	if(ret)
+		return ret;
+
+	if(copy_to_user(argp, &chk, sizeof(chk)))
+		return -EFAULT;
+	return 0;
+}
+
+static const struct file_operations pcd_importer_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = pcd_importer_ioctl,
+	.compat_ioctl = pcd_importer_ioctl,
+};
+
+static struct miscdevice pcd_importer_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "pcd_importer",
+	.fops = &pcd_importer_fops,
+};
+
+static int __init pcd_importer_init(void){
+	int ret;
+
+	pcd_importer_pdev = platform_device_register_simple("pcd-importer", -1, NULL, 0);
+	if(IS_ERR(pcd_importer_pdev))
+		return PTR_ERR(pcd_importer_pdev);
+
+	ret = dma_coerce_mask_and_coherent(&pcd_importer_pdev->dev, DMA_BIT_MASK(32));
+	if(ret)
+		goto unregister;
+
+	ret = misc_register(&pcd_importer_misc);
+	if(ret)
+		goto unregister;
+
+	pr_info("pcd importer loaded\n");
+	return 0;
+
+unregister:
+	platform_device_unregister(pcd_importer_pdev);
+	return ret;
+}
+
+static void __exit pcd_importer_exit(void){
+	misc_deregister(&pcd_importer_misc);
+	platform_device_unregister(pcd_importer_pdev);
+	pr_info("pcd importer unloaded\n");
+}
+
+module_init(pcd_importer_init);
+module_exit(pcd_importer_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Jakkampudi Venkata Dinesh");
+MODULE_DESCRIPTION("Test importer of pcd dma-bufs");
+MODULE_INFO(board, "BEAGLE BONE BLACK");
@@ -0,0 +1,312 @@
+/*
+ * pcd_selftest - kselftest of the pcd-N and pcdev-N device nodes
+ *
+ * Checks the rules of the flat devices from user space on every node of
+ * the table below that exists, nodes of drivers that aren't loaded are
+ * skipped:
+ *	- opening is refused with EPERM when the mode doesn't match the
+ *	  device permission
+ *	- what is written reads back
+ *	- reads at the end return 0, reads across it are cut short
+ *	- writes at the end fail with ENOMEM, writes across it are cut short
+ *	- SEEK_SET/SEEK_CUR/SEEK_END and their invalid cases
+ * Then it times reads and writes of the whole buffer of every read/write
+ * node. With -b the throughput is checked against a baseline file and a
+ * node that got more than -T percent slower fails, with -u the baseline
+ * is written instead. The results are printed as TAP, the exit status is
+ * 1 if anything failed.
+ *
+ * usage: pcd_selftest [-b baseline] [-u] [-T percent] [-d secs]
+ *
+ *	-b file		baseline of the throughput checks, lines of
+ *			"<node> <read|write> <MB/s>"
+ *	-u		write the measured throughput to the baseline file
+ *	-T percent	allowed drop below the baseline (default: 20)
+ *	-d secs		duration of each throughput check (default: 0.5)
+ *
+ * The kernel side of the same rules is covered by the KUnit suite of the
+ * pcd core, pcd_core/pcd_core_test.c.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Device permissions, as in pcd_core.h */
+#define RDWR 0x11
+#define RDONLY 0x01
+#define WRONLY 0x10
+
+#define MAX_BASELINE 64
+
+struct node{
+	const char *path;
+	size_t size;
+	int perm;
+};
+
+/* The flat devices of pcd_n and pcd_device_setup */
+static const struct node nodes[] = {
+	{ "/dev/pcd-1", 1024, RDONLY },
+	{ "/dev/pcd-2", 1024, WRONLY },
+	{ "/dev/pcd-3", 1024, RDWR },
+	{ "/dev/pcd-4", 1024, RDWR },
+	{ "/dev/pcdev-0", 512, RDWR },
+	{ "/dev/pcdev-1", 1024, RDWR },
+	{ "/dev/pcdev-4", 4194304, RDWR },	/* compressed */
+	{ "/dev/pcdev-5", 1024, RDWR },	/* integrity */
+};
+
+struct baseline{
+	char path[64];
+	char what[8];
+	double mbps;
+};
+
+static struct baseline baseline[MAX_BASELINE];
+static int nr_baseline;
+static const char *baseline_file;
+static int update;
+static double threshold = 20, duration = 0.5;
+static int tests, failed;
+
+static void result(int ok, const char *path, const char *what){
+	printf("%sok %d - %s %s\n", ok ? "" : "not ", ++tests, path, what);
+	if(!ok)
+		failed++;
+}
+
+static void skip(const char *path, const char *why){
+	printf("ok %d - %s # SKIP %s\n", ++tests, path, why);
+}
+
+static uint64_t now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* open() must succeed exactly when the mode matches the permission */
+static void check_open(const struct node *n){
+	static const struct{ int flags, perm_ok; const char *name; } modes[] = {
+		{ O_RDONLY, RDONLY, "open read only" },
+		{ O_WRONLY, WRONLY, "open write only" },
+		{ O_RDWR, 0, "open read/write" },
+	};
+	int i, fd, allowed, ok;
+
+	for(i = 0; i < 3; i++){
+		allowed = (n->perm == RDWR) || (n->perm == modes[i].perm_ok);
+		fd = open(n->path, modes[i].flags);
+		ok = allowed ? (fd >= 0) : ((fd < 0) && (errno == EPERM));
+		result(ok, n->path, modes[i].name);
+		if(fd >= 0)
+			close(fd);
+	}
+}
+
+/* Reads of a readable node, *buf is what it is expected to hold if the
+node is writable as well */
+static void check_read(const struct node *n, int fd, const unsigned char *buf){
+	unsigned char *back = malloc(n->size + 16);
+
+	if(buf)
+		result((pread(fd, back, n->size, 0) == (ssize_t)n->size) && !memcmp(back, buf, n->size),
+		       n->path, "read back what was written");
+	result(pread(fd, back, 16, n->size - 4) == 4, n->path, "read across the end is cut short");
+	result(pread(fd, back, 16, n->size) == 0, n->path, "read at the end returns 0");
+	result(pread(fd, back, 16, n->size + 100) == 0, n->path, "read past the end returns 0");
+	free(back);
+}
+
+/* Writes of a writable node, the buffer is left holding buf */
+static void check_write(const struct node *n, int fd, const unsigned char *buf){
+	result(pwrite(fd, buf, 16, n->size - 4) == 4, n->path, "write across the end is cut short");
+	result((pwrite(fd, buf, 16, n->size) < 0) && (errno == ENOMEM), n->path, "write at the end fails with ENOMEM");
+	result((pwrite(fd, buf, 16, n->size + 100) < 0) && (errno == ENOMEM), n->path, "write past the end fails with ENOMEM");
+	result(pwrite(fd, buf, n->size, 0) == (ssize_t)n->size, n->path, "write the whole buffer");
+}
+
+/* The whole buffer has been written, SEEK_END is its size */
+static void check_lseek(const struct node *n, int fd){
+	off_t size = n->size;
+
+	result(lseek(fd, 10, SEEK_SET) == 10, n->path, "SEEK_SET");
+	result(lseek(fd, 5, SEEK_CUR) == 15, n->path, "SEEK_CUR");
+	result(lseek(fd, 0, SEEK_END) == size, n->path, "SEEK_END");
+	result(lseek(fd, -4, SEEK_END) == size - 4, n->path, "SEEK_END backwards");
+	result((lseek(fd, size + 1, SEEK_SET) < 0) && (errno == EINVAL), n->path, "SEEK_SET past the end fails");
+	result((lseek(fd, -1, SEEK_SET) < 0) && (errno == EINVAL), n->path, "negative SEEK_SET fails");
+	result((lseek(fd, 1, SEEK_END) < 0) && (errno == EINVAL), n->path, "SEEK_END past the end fails");
+	result(lseek(fd, 0, SEEK_CUR) == size - 4, n->path, "a failed lseek keeps the position");
+}
+
+static struct baseline *find_baseline(const char *path, const char *what){
+	int i;
+
+	for(i = 0; i < nr_baseline; i++)
+		if(!strcmp(baseline[i].path, path) && !strcmp(baseline[i].what, what))
+			return &baseline[i];
+	return NULL;
+}
+
+static void load_baseline(void){
+	FILE *f = fopen(baseline_file, "r");
+	struct baseline *b;
+
+	if(f == NULL)
+		return;
+	while(nr_baseline < MAX_BASELINE){
+		b = &baseline[nr_baseline];
+		if(fscanf(f, "%63s %7s %lf", b->path, b->what, &b->mbps) != 3)
+			break;
+		nr_baseline++;
+	}
+	fclose(f);
+}
+
+/* MB/s of reads or writes of the whole buffer, checked against the
+baseline or stored in it */
+static void check_throughput(const struct node *n, int fd, unsigned char *buf, const char *what){
+	int wr = !strcmp(what, "write");
+	uint64_t start = now_ns(), end = start + duration * 1e9, t;
+	long ops = 0, errors = 0;
+	struct baseline *b;
+	char name[64];
+	double mbps;
+
+	do{
+		if((wr ? pwrite(fd, buf, n->size, 0) : pread(fd, buf, n->size, 0)) != (ssize_t)n->size)
+			errors++;
+		ops++;
+		t = now_ns();
+	}while(t < end);
+	mbps = (double)(ops - errors) * n->size / ((t - start) / 1e9) / 1e6;
+
+	printf("# %s %s %.3f MB/s\n", n->path, what, mbps);
+	snprintf(name, sizeof(name), "%s throughput", what);
+	if(errors){
+		result(0, n->path, name);
+		return;
+	}
+
+	b = find_baseline(n->path, what);
+	if(update){
+		if(b == NULL && nr_baseline < MAX_BASELINE){
+			b = &baseline[nr_baseline++];
+			snprintf(b->path, sizeof(b->path), "%s", n->path);
+			snprintf(b->what, sizeof(b->what), "%s", what);
+		}
+		if(b)
+			b->mbps = mbps;
+		result(1, n->path, name);
+	}
+	else if(b == NULL)
+		skip(n->path, "no baseline");
+	else{
+		printf("# baseline %.3f MB/s, %+.1f%%\n", b->mbps, (mbps / b->mbps - 1) * 100);
+		result(mbps >= b->mbps * (1 - threshold / 100), n->path, name);
+	}
+}
+
+static int save_baseline(void){
+	FILE *f = fopen(baseline_file, "w");
+	int i;
+
+	if(f == NULL){
+		perror(baseline_file);
+		return -1;
+	}
+	for(i = 0; i < nr_baseline; i++)
+		fprintf(f, "%s %s %.3f\n", baseline[i].path, baseline[i].what, baseline[i].mbps);
+	return fclose(f);
+}
+
+static void check_node(const struct node *n){
+	unsigned char *buf;
+	struct stat st;
+	size_t i;
+	int fd;
+
+	if(stat(n->path, &st)){
+		skip(n->path, "not loaded");
+		return;
+	}
+
+	check_open(n);
+
+	buf = malloc(n->size + 16);
+	for(i = 0; i < n->size + 16; i++)
+		buf[i] = rand();
+
+	if(n->perm == RDWR){
+		fd = open(n->path, O_RDWR);
+		if(fd < 0){
+			result(0, n->path, "open for the I/O checks");
+			free(buf);
+			return;
+		}
+		check_write(n, fd, buf);
+		check_read(n, fd, buf);
+		check_lseek(n, fd);
+		if(baseline_file){
+			check_throughput(n, fd, buf, "read");
+			check_throughput(n, fd, buf, "write");
+		}
+		close(fd);
+	}
+	else{
+		fd = open(n->path, (n->perm == RDONLY) ? O_RDONLY : O_WRONLY);
+		if(fd < 0)
+			result(0, n->path, "open for the I/O checks");
+		else if(n->perm == RDONLY)
+			check_read(n, fd, NULL);
+		else
+			check_write(n, fd, buf);
+		if(fd >= 0)
+			close(fd);
+	}
+	free(buf);
+}
+
+static void usage(const char *prog){
+	fprintf(stderr, "usage: %s [-b baseline] [-u] [-T percent] [-d secs]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv){
+	unsigned int i;
+	int opt;
+
+	while((opt = getopt(argc, argv, "b:uT:d:h")) != -1){
+		switch(opt){
+		case 'b': baseline_file = optarg; break;
+		case 'u': update = 1; break;
+		case 'T': threshold = atof(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc || (update && !baseline_file) || duration <= 0)
+		usage(argv[0]);
+
+	if(baseline_file)
+		load_baseline();
+	srand(getpid());
+
+	printf("TAP version 13\n");
+	for(i = 0; i < sizeof(nodes) / sizeof(nodes[0]); i++)
+		check_node(&nodes[i]);
+	printf("1..%d\n", tests);
+
+	if(update && save_baseline())
+		failed++;
+	return failed ? 1 : 0;
+}
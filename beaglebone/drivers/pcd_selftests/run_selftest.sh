@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Load the pcd drivers built with 'make host' one at a time and run
+# pcd_selftest against their device nodes. The drivers all register the
+# same "pcd_class", pcd_n and the platform driver can't be loaded at once.
+#
+# usage: sudo ./run_selftest.sh
+#
+# The throughput checks compare against BASELINE (default
+# pcd_selftest.baseline), a node more than THRESHOLD percent (default 20)
+# slower than its baseline fails. UPDATE=1 records a new baseline, run it
+# once on a known good tree of the same machine. Without a baseline file
+# only the functional checks are run.
+
+cd "$(dirname "$0")"
+DRIVERS=..
+BASELINE=${BASELINE:-pcd_selftest.baseline}
+
+[ -x ./pcd_selftest ] || make host || exit 1
+
+if [ -n "$UPDATE" ]; then
+	ARGS="-b $BASELINE -u"
+elif [ -f "$BASELINE" ]; then
+	ARGS="-b $BASELINE -T ${THRESHOLD:-20}"
+else
+	ARGS=
+	echo "# no baseline $BASELINE, the throughput checks are skipped" >&2
+fi
+
+# run_driver <module dir> <modules...>
+run_driver(){
+	dir=$1
+	shift
+
+	for m in "$@"; do
+		insmod "$dir/$m.ko" || return 1
+	done
+	udevadm settle 2>/dev/null || sleep 1
+
+	./pcd_selftest $ARGS || status=1
+
+	for m in $(echo "$@" | tr ' ' '\n' | tac); do
+		rmmod "$m"
+	done
+}
+
+insmod $DRIVERS/pcd_core/pcd_core.ko || exit 1
+
+status=0
+run_driver $DRIVERS/003psuedocharmultiple pcd_n || status=1
+run_driver $DRIVERS/004PcdPlatformDriver pcd_platform_driver pcd_device_setup || status=1
+
+rmmod pcd_core
+exit $status